@@ -0,0 +1,172 @@
+# 2026-10-19  build_flavours.py
+
+"""
+用几种不同的优化方式编译 C 版本，在同一份自我对弈负载上测速，比较每秒走多少步。
+
+- baseline：只开 O2
+- lto：O2 + 链接时优化
+- pgo：O2 + 链接时优化 + 按配置文件优化。先编译插桩版本，用训练负载跑一遍生成配置文件，再用它重新编译。
+
+负载是自我对弈（SELF_PLAY）：用内置的方块生成器按种子生成方块，不读输入。
+训练用 SELF_PLAY_SEED=1，测速默认用另一个种子，避免只在训练过的对局上变快。
+每一行输出是 "game k: score s, placed_blocks n"，n 加起来就是走的步数。
+同一个种子下各版本的输出应当完全相同，不同时会报出来。
+
+用法：
+    python build_flavours.py                              # Windows 上用 cl（需要在 VS 开发者命令行里运行），其他系统用 gcc
+    python build_flavours.py --compiler gcc --games 50 --repeat 5
+生成的文件都放在 --build-dir（默认 flavours_build）下。
+"""
+
+import argparse
+import os
+import re
+import shlex
+import subprocess
+import sys
+import time
+
+
+SOURCE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "tetris_ai_v3_c_version.c")
+TRAINING_SEED = 1
+PLACED_BLOCKS_PATTERN = re.compile(r"placed_blocks (\d+)")
+
+
+
+def workload_defines(compiler: str, games: int, max_pieces: int, seed: int) -> list[str]:
+    prefix = "/D" if compiler == "msvc" else "-D"
+    return [
+        f"{prefix}SELF_PLAY",
+        f"{prefix}SELF_PLAY_GAMES={games}",
+        f"{prefix}SELF_PLAY_MAX_PIECES_PER_GAME={max_pieces}",
+        f"{prefix}SELF_PLAY_SEED={seed}",
+    ]
+
+
+def compile_command(compiler: str, flavour: str, stage: str, output: str, defines: list[str], extra_flags: list[str]) -> list[str]:
+    """
+    stage 只对 pgo 有意义："instrument" 是插桩版本，"optimize" 是用配置文件重新编译的版本。
+    两个阶段的输出文件名必须相同，编译器靠它找到配置文件。
+    """
+    if compiler == "msvc":
+        object_dir = os.path.dirname(output) + os.sep
+        command = ["cl", "/nologo", "/O2", *defines, *extra_flags, SOURCE, f"/Fo{object_dir}", f"/Fe{output}"]
+
+        if flavour == "baseline":
+            return command
+
+        command[3:3] = ["/GL"]
+        link = ["/link", "/LTCG"]
+
+        if flavour == "pgo":
+            pgd = os.path.splitext(output)[0] + ".pgd"
+            link.append(f"/GENPROFILE:PGD={pgd}" if stage == "instrument" else f"/USEPROFILE:PGD={pgd}")
+
+        return command + link
+
+    libraries = ["-lws2_32"] if sys.platform == "win32" else ["-lm", "-lpthread"]
+    command = ["gcc", "-O2", *defines, *extra_flags, SOURCE, "-o", output]
+
+    if flavour == "baseline":
+        return command + libraries
+
+    command[2:2] = ["-flto"]
+
+    if flavour == "pgo":
+        command[2:2] = ["-fprofile-generate"] if stage == "instrument" else ["-fprofile-use", "-fprofile-correction", "-Wno-missing-profile"]
+
+    return command + libraries
+
+
+def run_checked(command: list[str]) -> str:
+    result = subprocess.run(command, capture_output=True, text=True)
+
+    if result.returncode != 0:
+        print(" ".join(shlex.quote(part) for part in command))
+        print(result.stdout)
+        print(result.stderr)
+        raise SystemExit(f"command failed with exit code {result.returncode}")
+
+    return result.stdout
+
+
+def build(compiler: str, flavour: str, build_dir: str, defines: list[str], training_defines: list[str], extra_flags: list[str]) -> str:
+    executable = os.path.join(build_dir, flavour + (".exe" if sys.platform == "win32" else ""))
+
+    if flavour != "pgo":
+        run_checked(compile_command(compiler, flavour, "", executable, defines, extra_flags))
+        return executable
+
+    # 训练负载和测速负载只有几个常量宏不同，函数的控制流一样，所以插桩时用训练负载的宏、重新编译时换回测速负载的宏，配置文件仍然对得上。
+    for stale in os.listdir(build_dir):
+        if stale.endswith((".gcda", ".pgc")):
+            os.remove(os.path.join(build_dir, stale))
+
+    print(f"  training {flavour} ...")
+    run_checked(compile_command(compiler, flavour, "instrument", executable, training_defines, extra_flags))
+    run_checked([executable])
+    run_checked(compile_command(compiler, flavour, "optimize", executable, defines, extra_flags))
+    return executable
+
+
+def measure(executable: str, repeat: int) -> tuple[int, float, str]:
+    best_seconds = float("inf")
+    output = ""
+
+    for _ in range(repeat):
+        begin = time.perf_counter()
+        output = run_checked([executable])
+        best_seconds = min(best_seconds, time.perf_counter() - begin)
+
+    moves = sum(int(match.group(1)) for match in PLACED_BLOCKS_PATTERN.finditer(output))
+    return moves, best_seconds, output
+
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="比较不同优化方式编译出的 C 版本的速度")
+    parser.add_argument("--compiler", choices=["msvc", "gcc"], default="msvc" if sys.platform == "win32" else "gcc")
+    parser.add_argument("--flavours", default="baseline,lto,pgo", help="用逗号分隔")
+    parser.add_argument("--build-dir", default="flavours_build")
+    parser.add_argument("--games", type=int, default=20, help="测速负载的局数")
+    parser.add_argument("--training-games", type=int, default=20)
+    parser.add_argument("--max-pieces", type=int, default=3000, help="每局最多放多少个方块")
+    parser.add_argument("--seed", type=int, default=2, help="测速负载的种子，训练负载固定用 1")
+    parser.add_argument("--repeat", type=int, default=3, help="每种版本跑几次，取最快的一次")
+    parser.add_argument("--extra-flags", default="", help="原样加到每条编译命令里，以 - 开头时要写成 --extra-flags=\"-I...\"")
+    args = parser.parse_args()
+
+    os.makedirs(args.build_dir, exist_ok=True)
+    defines = workload_defines(args.compiler, args.games, args.max_pieces, args.seed)
+    training_defines = workload_defines(args.compiler, args.training_games, args.max_pieces, TRAINING_SEED)
+    extra_flags = shlex.split(args.extra_flags)
+
+    results = []
+    reference_output = None
+
+    for flavour in args.flavours.split(","):
+        print(f"building {flavour} ...")
+        executable = build(args.compiler, flavour, args.build_dir, defines, training_defines, extra_flags)
+        moves, seconds, output = measure(executable, args.repeat)
+
+        if reference_output is None:
+            reference_output = output
+        elif output != reference_output:
+            print(f"warning: {flavour} played differently from {args.flavours.split(',')[0]}")
+
+        results.append((flavour, moves, seconds))
+
+    baseline_speed = results[0][1] / results[0][2]
+    print()
+    print(f"compiler: {args.compiler}, workload: {args.games} games x up to {args.max_pieces} pieces, seed {args.seed}, best of {args.repeat}")
+    print(f"{'flavour':<10}{'moves':>10}{'seconds':>10}{'moves/s':>12}{'speedup':>10}")
+
+    for flavour, moves, seconds in results:
+        speed = moves / seconds
+        print(f"{flavour:<10}{moves:>10}{seconds:>10.3f}{speed:>12.0f}{speed / baseline_speed:>9.2f}x")
+
+    return None
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,231 @@
+# 2026-10-19  tetris_ai_c.py
+
+"""
+用 ctypes 调用 C 版本（tetris_ai_v3_c_version.c 编译成的动态库），代替 tetris_ai_v3.py 里的纯 Python 实现。
+
+编译动态库：
+    cl /O2 /LD /DTETRIS_BUILD_SHARED_LIBRARY tetris_ai_v3_c_version.c /Fe:tetris_ai.dll
+默认在本文件所在目录找 tetris_ai.dll，也可以用环境变量 TETRIS_AI_LIBRARY 指定路径。
+
+GameState 的接口与 tetris_ai_v3.GameState 相同，可以直接替换。
+play_games、play_sequence、evaluate_boards 一次调用处理整批数据，中间不回到解释器；它们需要 numpy。
+"""
+
+import ctypes
+import os
+import sys
+
+from dataclasses import dataclass
+
+
+SCORES_OF_LINE_CLEARED = {
+    1: 100,
+    2: 300,
+    3: 500,
+    4: 800,
+}
+
+# 与 C 版本的 PIECE_RANDOMIZER_* 相同
+RANDOMIZER_UNIFORM = 0
+RANDOMIZER_BAG     = 1
+RANDOMIZER_HISTORY = 2
+
+# 与 C 版本的 ENGINE_LEVEL_* 相同：0、1 少算几项特征，2 是贪心，再往上每级多搜一层
+ENGINE_LEVEL_LANDING      = 0
+ENGINE_LEVEL_ROW_FEATURES = 1
+ENGINE_LEVEL_GREEDY       = 2
+ENGINE_LEVEL_COUNT        = 5
+
+GRID_CELLS = 20 * 10
+MOVE_COUNT = 4 * 10
+INVALID_SCORE_X2 = -2 ** 31
+
+
+
+type list2d[T] = list[list[T]]
+
+@dataclass
+class Statistics(object):
+    """
+    与 tetris_ai_v3.Statistics 相同。
+    """
+    placed_blocks:       int
+    score:               int
+    total_cleared_lines: int
+    cleared_lines:       dict[int, int]
+
+    def print_out(self) -> None:
+        print(f"statistics:")
+        print(f"- score: {self.score}")
+        print(f"- placed_blocks: {self.placed_blocks}")
+        print(f"- cleared_lines:")
+        for line, count in self.cleared_lines.items():
+            print(f"  - {line} lines: {count}")
+
+
+
+def _load_library() -> ctypes.CDLL:
+    default_name = "tetris_ai.dll" if sys.platform == "win32" else "libtetris_ai.so"
+    path = os.environ.get("TETRIS_AI_LIBRARY", os.path.join(os.path.dirname(os.path.abspath(__file__)), default_name))
+    library = ctypes.CDLL(path)
+
+    uint8_p = ctypes.POINTER(ctypes.c_uint8)
+    int32_p = ctypes.POINTER(ctypes.c_int32)
+
+    library.tetris_initialize.argtypes = []
+    library.tetris_initialize.restype = None
+    library.tetris_make_decision.argtypes = [uint8_p, ctypes.c_char, ctypes.c_char, int32_p]
+    library.tetris_make_decision.restype = ctypes.c_int32
+    library.tetris_make_decision_at_level.argtypes = [uint8_p, ctypes.c_char, ctypes.c_char, ctypes.c_int32, int32_p]
+    library.tetris_make_decision_at_level.restype = ctypes.c_int32
+    library.tetris_next_state.argtypes = [uint8_p, ctypes.c_char, ctypes.c_int32, ctypes.c_int32, uint8_p, int32_p]
+    library.tetris_next_state.restype = ctypes.c_int32
+    library.tetris_evaluate_boards.argtypes = [ctypes.c_int32, uint8_p, ctypes.c_char_p, int32_p]
+    library.tetris_evaluate_boards.restype = None
+    library.tetris_play_sequence.argtypes = [ctypes.c_int32, ctypes.c_char_p, int32_p, int32_p]
+    library.tetris_play_sequence.restype = ctypes.c_int32
+    library.tetris_play_games.argtypes = [ctypes.c_int32, ctypes.POINTER(ctypes.c_uint64), ctypes.c_int32, ctypes.c_int32, int32_p]
+    library.tetris_play_games.restype = None
+
+    library.tetris_initialize()
+    return library
+
+
+_library = _load_library()
+
+
+def _tetris_byte(tetris: str) -> bytes:
+    # Python 版本用 "" 表示还不知道的下一个方块，C 版本用 '?'
+    return (tetris or "?").encode("ascii")
+
+
+
+class GameState(object):
+    """
+    与 tetris_ai_v3.GameState 相同，对外显现为不可变对象。
+    网格在内部存成 200 字节，读 grid 属性时才转换成二维列表。
+
+    与 Python 版本的一处区别：deadline_touched 看的是消行之后的网格（C 版本的规则）。
+    """
+
+    def __init__(self, grid: list2d[int], falling_tetris: str, next_tetris: str, deadline_touched: bool, statistics: Statistics) -> None:
+        self._cells           = (ctypes.c_uint8 * GRID_CELLS)(*(cell for row in grid for cell in row))
+        self.falling_tetris   = falling_tetris
+        self.next_tetris      = next_tetris
+        self.deadline_touched = deadline_touched
+        self.statistics       = statistics
+        return None
+
+
+    @property
+    def grid(self) -> list2d[int]:
+        return [list(self._cells[i * 10:(i + 1) * 10]) for i in range(20)]
+
+
+    def with_next_tetris_filled_in(self, next_tetris: str) -> 'GameState':
+        assert self.next_tetris == ""
+        return GameState(self.grid, self.falling_tetris, next_tetris, self.deadline_touched, _copy_statistics(self.statistics))
+
+
+    def print_grid(self) -> None:
+        print("     0 1 2 3 4 5 6 7 8 9")
+        print("   +--------------------+")
+        for i, row in enumerate(self.grid):
+            print(f"{i:2d} |{''.join("[]" if cell == 1 else "  " for cell in row)}|")
+        print("   +--------------------+")
+        return None
+
+
+    def print_statistics(self) -> None:
+        return self.statistics.print_out()
+
+
+    def is_deadline_touched(self) -> bool:
+        return self.deadline_touched
+
+
+    def make_decision(self, level: int | None = None) -> tuple[int, int]:
+        """
+        level 为 None 时与 tetris_ai_v3.GameState.make_decision 相同；否则按 ENGINE_LEVEL_* 的这一级决策。
+        """
+        operation = (ctypes.c_int32 * 2)()
+        falling, next_ = _tetris_byte(self.falling_tetris), _tetris_byte(self.next_tetris)
+        if level is None:
+            status = _library.tetris_make_decision(self._cells, falling, next_, operation)
+        elif 0 <= level < ENGINE_LEVEL_COUNT:
+            status = _library.tetris_make_decision_at_level(self._cells, falling, next_, level, operation)
+        else:
+            raise ValueError(f"level should be in [0, {ENGINE_LEVEL_COUNT})")
+        if status != 0:
+            raise ValueError("no valid move")
+        return operation[0], operation[1]
+
+
+    def the_next_state(self, rotation: int, j_pos: int) -> 'GameState':
+        cells_out = (ctypes.c_uint8 * GRID_CELLS)()
+        result = (ctypes.c_int32 * 2)()
+        if _library.tetris_next_state(self._cells, _tetris_byte(self.falling_tetris), rotation, j_pos, cells_out, result) != 0:
+            raise ValueError("cannot place the tetris here")
+        lines, deadline_touched = result[0], result[1]
+
+        statistics = _copy_statistics(self.statistics)
+        statistics.placed_blocks += 1
+        if lines > 0:
+            statistics.score += SCORES_OF_LINE_CLEARED[lines]
+            statistics.cleared_lines[lines] += 1
+            statistics.total_cleared_lines += lines
+
+        new_state = GameState([], self.next_tetris, "", self.deadline_touched or bool(deadline_touched), statistics)
+        new_state._cells = cells_out
+        return new_state
+
+
+
+def _copy_statistics(statistics: Statistics) -> Statistics:
+    return Statistics(statistics.placed_blocks, statistics.score, statistics.total_cleared_lines, dict(statistics.cleared_lines))
+
+
+def _int32_pointer(array):
+    return array.ctypes.data_as(ctypes.POINTER(ctypes.c_int32))
+
+
+def play_games(seeds, randomizer: int = RANDOMIZER_UNIFORM, max_pieces: int = 10000):
+    """
+    按自我对弈的规则（碰到死线或放满 max_pieces 个方块就结束）玩 len(seeds) 局。
+    返回形状为 (局数, 3) 的 int32 数组：最终得分、放置的方块数、总消行数。
+    """
+    import numpy as np
+    seeds = np.ascontiguousarray(seeds, dtype=np.uint64)
+    results = np.zeros((len(seeds), 3), dtype=np.int32)
+    _library.tetris_play_games(len(seeds), seeds.ctypes.data_as(ctypes.POINTER(ctypes.c_uint64)), randomizer, max_pieces, _int32_pointer(results))
+    return results
+
+
+def play_sequence(pieces: str):
+    """
+    已知整个方块序列（可以以 X 结尾），和 C 版本的主程序一样贪心地走完。
+    返回 (operations, scores)：形状为 (步数, 2) 的 rotation、j_pos，以及每一步之后的分数。
+    """
+    import numpy as np
+    pieces = "".join(c for c in pieces if not c.isspace())
+    operations = np.zeros((max(len(pieces) - 1, 0), 2), dtype=np.int32)
+    scores = np.zeros(max(len(pieces) - 1, 0), dtype=np.int32)
+    steps = _library.tetris_play_sequence(len(pieces), pieces.encode("ascii"), _int32_pointer(operations), _int32_pointer(scores))
+    return operations[:steps], scores[:steps]
+
+
+def evaluate_boards(boards, falling_tetrises: str):
+    """
+    boards 是形状为 (n, 20, 10) 的 0/1 数组，falling_tetrises 是 n 个方块字母。
+    返回形状为 (n, 40) 的 float64 数组：第 rotation * 10 + j_pos 项是这种摆法的评价值，放不下的是 NaN。
+    """
+    import numpy as np
+    boards = np.ascontiguousarray(boards, dtype=np.uint8).reshape(-1, GRID_CELLS)
+    assert len(falling_tetrises) == len(boards)
+    scores_x2 = np.zeros((len(boards), MOVE_COUNT), dtype=np.int32)
+    _library.tetris_evaluate_boards(
+        len(boards), boards.ctypes.data_as(ctypes.POINTER(ctypes.c_uint8)), falling_tetrises.encode("ascii"), _int32_pointer(scores_x2)
+    )
+    scores = scores_x2 / 2.0
+    scores[scores_x2 == INVALID_SCORE_X2] = np.nan
+    return scores
@@ -6,22 +6,45 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <io.h>  // _read、_get_osfhandle
+
+#ifdef _MSC_VER
+#include <intrin.h>  // __cpuid、__popcnt、_tzcnt_u32
+#endif
+
+#include <WinSock2.h>  // 必须在 Windows.h 之前
+#include <afunix.h>
 #include <Windows.h>
 
+#ifdef _MSC_VER
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+
 
 //////////////// 宏
 
 
+// 编译成动态库（给 tetris_ai_c.py 用）时定义 TETRIS_BUILD_SHARED_LIBRARY，此时没有 main 函数。
+// 例如：cl /O2 /LD /DTETRIS_BUILD_SHARED_LIBRARY tetris_ai_v3_c_version.c /Fe:tetris_ai.dll
+#ifdef TETRIS_BUILD_SHARED_LIBRARY
+#define TETRIS_API __declspec(dllexport)
+#else
+#define TETRIS_API
+#endif
+
 #define TETRIS_MAX_ANGLE    4
 #define TETRIS_SHAPE_I_LIM  4
 #define TETRIS_SHAPE_J_LIM  4
 #define TETRIS_GRID_I_LIM   20
 #define TETRIS_GRID_J_LIM   10
+#define TETRIS_DEADLINE_ROW 4     // 消行之后这一行还有砖格就是碰到死线
 
 #define HOLE_WEIGHT (-4)
 #define WELL_WEIGHT (-1)
@@ -33,6 +56,236 @@
 //#define DEBUGGING_THE_EVALUATOR
 //#define DRAW_DETAIL
 
+// 可视化：在单独的线程里把局面画到标准错误上，不影响标准输出的协议，引擎照常全速跑。
+// 主循环每走一步把局面快照放进队列；画图线程按 VISUALIZER_FPS 限帧，每帧只画最新的快照，
+// 用 ANSI 光标定位只重画变了的格子，整帧拼好后一次写出。DRAW_DETAIL 每步要调用几百次 printf，这个不会。
+//#define VISUALIZER
+
+#define VISUALIZER_FPS                  30
+#define VISUALIZER_QUEUE_SIZE           64    // 满了就丢掉最旧的快照
+#define VISUALIZER_FRAME_BUFFER_SIZE    (16 * 1024)
+
+// 自检：固定种子下整局的走法与记录下来的结果比对；再随机生成大量局面，检查放置、消行的不变量，
+// 以及各种优化过的实现（查表、整数评价值、选择键、紧凑局面等）与逐格计算的参考实现结果一致。失败时返回 1。
+//#define SELF_TEST
+
+#define SELF_TEST_FUZZ_CASES            3000
+#define SELF_TEST_SEED                  1
+#define SELF_TEST_SEQUENCE_LENGTH       3000
+
+// 基准测试：比较逐格扫描与查表两种方式计算行转变数和井的速度
+//#define BENCHMARK_ROW_FEATURES
+
+#define BENCHMARK_GRIDS                 4096
+#define BENCHMARK_ROUNDS                200
+#define BENCHMARK_SEED                  1
+
+// 输入缓冲区大小。只有缓冲区里的方块都用完了才再读一次，每次能读多少读多少。
+#define INPUT_READER_BUFFER_SIZE        (64 * 1024)
+
+// 一次读完：先把整个方块序列读进来，再一口气算完，所有输出最后一次写出去。只能用于非交互式的评测。
+//#define READ_WHOLE_SEQUENCE
+
+// 离线规划：先读完整个方块序列，再对整局做束搜索（beam search），让最终得分尽量高。
+// 输出格式与 run_ai_1 相同，最后一次写出。每一层的回溯指针写进检查点文件，内存里只留当前这一层。
+//#define OFFLINE_PLANNER
+
+#define OFFLINE_BEAM_WIDTH              64
+#define OFFLINE_THREAD_COUNT            4
+#define OFFLINE_SCORE_WEIGHT            2     // 排序键 = 得分 / 100 * 这个权重 + 局面评价值的两倍
+#define OFFLINE_DEADLINE_PENALTY        100000
+#define OFFLINE_CHECKPOINT_FILE_NAME    "offline_beam.bin"
+
+// 自我对弈：不读标准输入，自己随机生成方块连续玩很多局
+//#define SELF_PLAY
+// 导出训练数据：在主循环中把每一步的局面、候选特征、所选操作与终局结果写进列式二进制文件
+//#define EXPORT_TRAINING_DATA
+
+// 这三个可以在编译命令行上覆盖，例如 /DSELF_PLAY_GAMES=20（build_flavours.py 用它们设定训练和测速的负载）
+#ifndef SELF_PLAY_GAMES
+#define SELF_PLAY_GAMES                 1000
+#endif
+#ifndef SELF_PLAY_MAX_PIECES_PER_GAME
+#define SELF_PLAY_MAX_PIECES_PER_GAME   10000
+#endif
+#ifndef SELF_PLAY_SEED
+#define SELF_PLAY_SEED                  1
+#endif
+#define SELF_PLAY_RANDOMIZER            PIECE_RANDOMIZER_UNIFORM
+
+// 批量自我对弈：BATCH_LANES 局同步推进，每一步对同一种摆法一次算完所有局的评价值，见 board_batch_s。
+// 走法与逐局计算完全相同，只是更快；只支持默认权重的贪心决策，不管 SURVIVAL_MODE、MOVE_CACHE 等开关。
+// tetris_play_games 总是这样跑。
+//#define SELF_PLAY_BATCHED
+
+#define BATCH_LANES                     8     // 8 个 uint32 正好是一个 AVX2 寄存器；16 就是两个
+
+// 生成方块序列：不玩游戏，只把方块序列按 input_tetris_generator.py 的格式写到标准输出
+//#define GENERATE_PIECES
+
+#define GENERATE_PIECES_RANDOMIZER      PIECE_RANDOMIZER_UNIFORM
+#define GENERATE_PIECES_SEED            1
+#define GENERATE_PIECES_START           0     // 从第几个方块开始（从 0 开始数）
+#define GENERATE_PIECES_LENGTH          3000
+#define GENERATE_PIECES_REPLAY_FILE     "pieces.txt"  // 只有 PIECE_RANDOMIZER_REPLAY 用
+
+// 方块生成方式
+#define PIECE_RANDOMIZER_UNIFORM        0     // 每个方块都从 7 种里均匀随机选
+#define PIECE_RANDOMIZER_BAG            1     // 7 个一袋，每袋是 7 种方块的一个随机排列
+#define PIECE_RANDOMIZER_HISTORY        2     // TGM 式：记住最近 4 个方块，抽到重复的就重抽，最多抽 6 次
+#define PIECE_RANDOMIZER_REPLAY         3     // 从文件里读
+
+#define PIECE_HISTORY_SIZE              4
+#define PIECE_HISTORY_TRIES             6
+#define PIECE_HISTORY_SYNC_PERIOD       256   // 每隔这么多个方块把历史重置一次，跳转时最多只需从上一个重置点往后生成
+
+#define TRAINING_DATA_FILE_NAME         "training_data.bin"
+#define TRAINING_DATA_CHUNK_SAMPLES     16384
+#define TRAINING_DATA_CHUNK_GAMES       1024
+#define TRAINING_DATA_FEATURE_COUNT     6
+#define TRAINING_DATA_INVALID_FEATURE   0xFF
+
+// 遥测：自我对弈、对战这类大批模拟时，收集每局的统计和每步决策耗时的直方图，结束时写成 CSV 或二进制汇总，
+// 不用再从标准输出里解析。每个线程先记在自己的 telemetry_recorder_s 里，攒够一批或线程结束时再并入总表，不加锁。
+//#define TELEMETRY
+//#define TELEMETRY_BINARY                    // 写二进制文件，否则写两个 CSV 文件
+
+#define TELEMETRY_GAMES_FILE_NAME       "telemetry_games.csv"
+#define TELEMETRY_LATENCY_FILE_NAME     "telemetry_latency.csv"
+#define TELEMETRY_BINARY_FILE_NAME      "telemetry.bin"
+#define TELEMETRY_LATENCY_BUCKETS       32    // 第 k 桶是 [2^k, 2^(k+1)) 纳秒，第 0 桶也包括 0
+#define TELEMETRY_RECORDER_BATCH_GAMES  256   // 每个线程攒这么多局再并入总表
+
+// 检查点：run_ai_1 和自我对弈（不分批的）每走 CHECKPOINT_PERIOD_PIECES 步存一次局面、方块序列的位置和遥测，
+// 进程中途退出后加上 --resume 重新运行，从最后一个检查点接着走，之后的每一步都和没中断过一样。
+// run_ai_1 续跑时输入要从头再给一遍，已经读过的方块会被跳过。正常结束时删掉检查点文件。
+// 决策依赖时间的（ANYTIME_DECISION）或依赖跨次运行状态的（MOVE_CACHE）续跑后不保证逐位相同。
+//#define CHECKPOINT
+
+#define CHECKPOINT_FILE_NAME            "checkpoint.bin"
+#define CHECKPOINT_PERIOD_PIECES        10000
+#define CHECKPOINT_MAGIC                0x504B4354u  // "TCKP"，小端序
+#define CHECKPOINT_RESUME_OPTION        "--resume"
+
+// 服务器模式：在 Unix 域套接字上同时跑很多局，每个连接一局，协议与 run_ai_1 的标准输入输出相同
+//#define SERVER_MODE
+
+#define SERVER_SOCKET_PATH              "tetris_ai.sock"
+#define SERVER_MAX_SESSIONS             4096
+#define SERVER_WORKER_COUNT             4
+#define SERVER_POLL_TIMEOUT_MS          10
+#define SERVER_INPUT_BUFFER_SIZE        256
+#define SERVER_DEFAULT_ENGINE_LEVEL     ENGINE_LEVEL_GREEDY
+
+// 暂存（hold）：每一步可以先把下落的方块和暂存的方块交换，再放下换出来的那个。暂存是空的时候，
+// 下落的方块放进暂存，放下的是下一个方块，这一步用掉两个方块，要多读一个。
+// 决策时两种都试（见 game_state_make_decision_with_hold），输出的每一步变成 "rotation j_pos hold"。
+//#define HOLD_PIECE
+
+#define HOLD_EMPTY                      '-'
+
+// 限时决策：先得到贪心解，再在时限内逐层加深搜索（已知的下一个方块、之后对 7 种方块取平均），
+// 始终保留最后一个完整搜完的深度的结果
+//#define ANYTIME_DECISION
+
+#define ANYTIME_BUDGET_MICROSECONDS     10000
+#define ANYTIME_MAX_DEPTH               8
+#define ANYTIME_ROOT_WIDTH              8
+#define ANYTIME_BEAM_WIDTH              4
+#define ANYTIME_DEAD_END_SCORE_X2       (-2000)
+#define ANYTIME_ARENA_BYTES             (16 * 1024 * 1024)
+
+// 分级引擎：game_state_make_decision_at_level 用一个级别调节每步的计算量，给强度不同的机器人用。
+// 贪心以下的两级少算几项特征，贪心以上每级多搜一层（与 ANYTIME_DECISION 的搜索相同，但不限时，结果是确定的）。
+// 定义 ENGINE_LEVEL 时 run_ai_1 和自我对弈按这一级决策；服务器的每个连接可以用 "level n" 一行自己选。
+//#define ENGINE_LEVEL                    ENGINE_LEVEL_GREEDY
+
+#define ENGINE_LEVEL_LANDING            0     // 只看着陆高度和侵蚀格数
+#define ENGINE_LEVEL_ROW_FEATURES       1     // 再加井和行转变数（查表）；不扫列，洞和列转变数记 0
+#define ENGINE_LEVEL_GREEDY             2     // 完整的评价函数，与 game_state_make_decision 相同
+#define ENGINE_LEVEL_COUNT              5     // 3 用上已知的下一个方块，4 再对未知的方块取平均
+
+// 各级引擎的耗时与得分：每一级用同样的种子玩同样的几局
+//#define BENCHMARK_ENGINE_LEVELS
+
+#define BENCHMARK_ENGINE_GAMES          10
+#define BENCHMARK_ENGINE_MAX_PIECES     2000
+
+// 对战模拟：两个 AI 在同一个方块序列上同步落子，消多行和连击会给对方送垃圾行。
+// 几组权重两两对战很多局（多线程并行），最后按 Elo 给每组权重打分。
+//#define BATTLE_MODE
+
+#define BATTLE_MATCHES_PER_PAIR         50
+#define BATTLE_MAX_TURNS                5000
+#define BATTLE_THREAD_COUNT             4
+#define BATTLE_SEED                     1
+#define BATTLE_ELO_INITIAL              1500.0
+#define BATTLE_ELO_K                    16.0
+
+// 生存模式：碰到死线就结束这一局；评价时考虑方块堆离死线有多近，堆得太高时改用更保守、也更快的策略
+//#define SURVIVAL_MODE
+
+#define SURVIVAL_DANGER_MARGIN          2     // 方块堆顶离死线不到这么多行就开始算危险，每近一行记 1
+#define SURVIVAL_DANGER_ROW             (TETRIS_DEADLINE_ROW + SURVIVAL_DANGER_MARGIN)
+#define SURVIVAL_DANGER_WEIGHT          (-4)
+#define SURVIVAL_SAFE_POLICY_MARGIN     2     // 方块堆顶离死线只剩这么多行或更少时，改用保守策略
+#define SURVIVAL_SAFE_POLICY_ROW        (TETRIS_DEADLINE_ROW + SURVIVAL_SAFE_POLICY_MARGIN)
+#define SURVIVAL_SAFE_DANGER_WEIGHT     (-16)
+#define SURVIVAL_SAFE_LANDING_HEIGHT_WEIGHT (-4)
+
+#ifdef SURVIVAL_MODE
+#define DANGER_WEIGHT SURVIVAL_DANGER_WEIGHT
+#else
+#define DANGER_WEIGHT 0
+#endif
+
+
+// 走法缓存：没有洞的局面完全由各列高度决定，贪心选的走法又基本只看表面形状，
+// 所以把（各列相对高度，下落的方块）→ 选出的走法记下来，再遇到同样的表面就不用重新算。
+// 相对高度裁剪到 0 .. MOVE_CACHE_HEIGHT_CLIP - 1，命中时不保证与完整计算完全一致，可以打开 MOVE_CACHE_VALIDATION 抽查。
+// 缓存在开始时从文件读入、结束时写回，可以跨局、跨次运行积累。只用于 run_ai_1 和自我对弈。
+//#define MOVE_CACHE
+//#define MOVE_CACHE_VALIDATION
+
+#define MOVE_CACHE_FILE_NAME            "move_cache.bin"
+#define MOVE_CACHE_HEIGHT_CLIP          8     // 每列 3 位
+#define MOVE_CACHE_CAPACITY_BITS        20    // 哈希表 2^20 项，装到四分之三就不再插入
+#define MOVE_CACHE_VALIDATION_PERIOD    16    // 每命中这么多次抽查一次
+
+// run_ai_1 和自我对弈每步只能用一种决策方式，下面这几个开关同时打开时只有排在前面的那个起作用，
+// 其余的被悄悄忽略（例如 HOLD_PIECE 的输出格式对了，决策却不考虑暂存），所以直接不让编译。
+#if defined(EXPORT_TRAINING_DATA) + defined(SURVIVAL_MODE) + defined(HOLD_PIECE) + defined(ENGINE_LEVEL) \
+    + defined(ANYTIME_DECISION) + defined(MOVE_CACHE) > 1
+#error "EXPORT_TRAINING_DATA, SURVIVAL_MODE, HOLD_PIECE, ENGINE_LEVEL, ANYTIME_DECISION and MOVE_CACHE each pick the decision function; define at most one of them"
+#endif
+
+
+// 棋盘内核（数洞和列转变数、找满行）按指令集编译成几种，启动时用 CPUID 选这台机器支持的最高一级，
+// 同一个可执行文件在新旧机器上都能用上对应的指令，不需要 -march=native 重新编译。
+// 环境变量 TETRIS_ISA 可以强制指定 baseline、x86-64-v2 或 x86-64-v3，用来测试；机器不支持时不理会，仍然自动选择。
+#define ISA_LEVEL_BASELINE              0     // x86-64，用移位和乘法数位
+#define ISA_LEVEL_V2                    1     // x86-64-v2：POPCNT
+#define ISA_LEVEL_V3                    2     // x86-64-v3：再加 AVX2、BMI1（TZCNT）、BMI2
+#define ISA_LEVEL_COUNT                 3
+#define ISA_ENVIRONMENT_VARIABLE        "TETRIS_ISA"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define ISA_DISPATCH_X86
+#endif
+
+#if defined(ISA_DISPATCH_X86) && defined(_MSC_VER)
+// MSVC 不给单个函数指定指令集：内建函数总是生成对应的指令，只要调用前确认 CPU 支持就行
+#define ISA_TARGET_V2
+#define ISA_TARGET_V3
+#define ISA_INLINE_CALLEES
+#define ISA_POPCOUNT32(bits) ((int) __popcnt(bits))
+#define ISA_TZCNT32(bits) ((int) _tzcnt_u32(bits))
+#elif defined(ISA_DISPATCH_X86)
+#define ISA_TARGET_V2 __attribute__((target("popcnt")))
+#define ISA_TARGET_V3 __attribute__((target("popcnt,avx2,bmi,bmi2")))
+#define ISA_INLINE_CALLEES __attribute__((flatten))  // 被调用的函数要内联进来，才会按这个函数的指令集编译
+#endif
+
 
 //////////////// 类声明
 
@@ -70,47 +323,762 @@ full_rows_index_container_s full_rows_index_container_with_a_row_index_appended(
 bool full_rows_index_container_contains(const full_rows_index_container_s *container, int index);
 
 
+#define GRID_COLUMN_MASK ((1u << TETRIS_GRID_I_LIM) - 1)
+
 typedef struct {
     int content[TETRIS_GRID_I_LIM][TETRIS_GRID_J_LIM];
+
+    // 以下是辅助索引，放方块、消行、加垃圾行时跟着增量更新，读取都是 O(1)。
+    // 直接改了 content 的话要调用 grid__rebuild_index。
+    uint64_t  surface_signature;                    // 表面形状：各列相对最矮列的高度，每列 5 位拼起来，不会冲突
+    uint32_t  column_holes[TETRIS_GRID_J_LIM];      // 每列的洞，第 i 位是第 i 行
+    int       column_tops[TETRIS_GRID_J_LIM];       // 每列最高的砖格所在的行，空列为 TETRIS_GRID_I_LIM
 } grid_s;
 
 grid_s grid_make_blank();  // 构造函数
+grid_s grid_make_from_cells(const uint8_t cells[TETRIS_GRID_I_LIM * TETRIS_GRID_J_LIM]);  // 构造函数
+void grid_copy_to_cells(const grid_s *grid, uint8_t cells[TETRIS_GRID_I_LIM * TETRIS_GRID_J_LIM]);
 grid_s grid_with_a_tetris_placed(const grid_s *grid, char tetris, int rotation, int j_pos, int i_pos);
 full_rows_index_container_s grid_all_full_rows(const grid_s *grid);
 void grid_print_out(const grid_s *grid);
 bool grid_is_deadline_touched(const grid_s *grid);
+bool grid_is_row_empty(const grid_s *grid, int i);
+int grid_get_top_occupied_row(const grid_s *grid);  // 全空时返回 TETRIS_GRID_I_LIM
+grid_s grid_with_garbage_rows_inserted(const grid_s *grid, int count, int hole_j);
 int grid_get_with_default(const grid_s *grid, int i, int j, int default_value);
+uint16_t grid_get_row_bits(const grid_s *grid, int i);
+void grid_set_row_bits(grid_s *grid, int i, uint16_t bits);
+grid_s grid_with_full_rows_cleared(const grid_s *grid, const full_rows_index_container_s *container);
+uint32_t grid_get_column_bits(const grid_s *grid, int j);  // 第 i 位是第 i 行
+int grid_count_holes(const grid_s *grid);
+int grid_count_col_transitions(const grid_s *grid);
+void grid__set_column_bits(grid_s *grid, int j, uint32_t bits);  // 只更新这一列的索引，不动 content
+void grid__update_surface_signature(grid_s *grid);
+void grid__rebuild_index(grid_s *grid);
 
 
 typedef struct {
-    int  rotation;
-    int  j_pos;
+    int   rotation;
+    int   j_pos;
+    bool  hold;      // 先和暂存的方块交换，放下的是换出来的方块
 } operation_s;
 
 void operation_print_out(const operation_s *operation);
+int operation_get_priority(const operation_s *operation);
+int64_t operation_make_selection_key(const operation_s *operation, int evaluate_score_x2);
+operation_s operation_from_selection_key(int64_t key);
+
+#define OPERATION_INVALID_SELECTION_KEY INT64_MIN
+
+
+// 评价函数用到的各项特征，见 game_state__calculate_evaluate_features
+// 着陆高度是半整数，存它的两倍，这样评价值也可以全用整数（评价值的两倍）计算。
+typedef struct {
+    int  hole;
+    int  well;
+    int  row_transition;
+    int  col_transition;
+    int  landing_height_x2;
+    int  eroded_cells;
+    int  danger;             // 消行后方块堆顶高出 SURVIVAL_DANGER_ROW 的行数
+} evaluate_features_s;
+
+int evaluate_features_to_score_x2(const evaluate_features_s *features);
+
+
+// 评价函数各项特征的权重。默认值就是上面的 *_WEIGHT 宏，对战模式里拿不同的权重互相比较。
+typedef struct {
+    int  hole;
+    int  well;
+    int  row_transition;
+    int  col_transition;
+    int  landing_height;
+    int  eroded_cells;
+    int  danger;
+} evaluate_weights_s;
+
+evaluate_weights_s evaluate_weights_make_default(void);  // 构造函数
+evaluate_weights_s evaluate_weights_make_safe(void);  // 构造函数，生存模式堆得很高时用
+int evaluate_weights_apply_x2(const evaluate_weights_s *weights, const evaluate_features_s *features);
+
+
+// 一行对评价函数的贡献。行转变数和井只取决于这一行本身（墙算作砖格），
+// 所以按这一行的 10 位占用情况（第 j 位是第 j 列）预先算好 1024 种，见 row_features_table。
+typedef struct {
+    uint8_t  row_transition;
+    uint8_t  well;
+} row_features_s;
+
+row_features_s row_features_calculate(const grid_s *grid, int i);  // 逐格扫描，用来生成表
+void row_features_table_initialize(void);
+
+#define ROW_FEATURES_TABLE_SIZE (1 << TETRIS_GRID_J_LIM)
+
+
+// 只看每列的位就能算出来的两项特征
+typedef struct {
+    int  hole;
+    int  col_transition;
+} column_features_s;
+
+
+// BATCH_LANES 个互不相干的网格按结构数组（SoA）存放：第 lane 个网格的第 j 列是 columns[j][lane]（第 i 位是第 i 行）。
+// 各网格的同一列挨在一起，对同一种摆法（rotation, j_pos）逐列计算时，一条向量指令就同时算完所有网格，
+// 与单个网格内部的位运算是两个不同的方向。每个网格落下的方块可以不同，按列拆开放在 piece_* 里。
+typedef struct {
+    uint32_t  columns[TETRIS_GRID_J_LIM][BATCH_LANES];
+    int32_t   column_tops[TETRIS_GRID_J_LIM][BATCH_LANES];    // 空列为 TETRIS_GRID_I_LIM
+
+    uint32_t  piece_columns[TETRIS_MAX_ANGLE][TETRIS_SHAPE_J_LIM][BATCH_LANES];  // 第 rel_i 位是方块的第 rel_i 行
+    int32_t   piece_bottoms[TETRIS_MAX_ANGLE][TETRIS_SHAPE_J_LIM][BATCH_LANES];  // 这一列最低的格子，空列为 -1
+    int32_t   piece_i_lims[TETRIS_MAX_ANGLE][BATCH_LANES];
+    int32_t   piece_j_lims[TETRIS_MAX_ANGLE][BATCH_LANES];
+} board_batch_s;
+
+board_batch_s board_batch_make_blank(void);  // 构造函数
+void board_batch_clear_lane(board_batch_s *batch, int lane);
+void board_batch_load_pieces(board_batch_s *batch, const char falling_tetrises[BATCH_LANES]);  // 不认识的方块哪里都放得下，也不占格子
+int board_batch_place(board_batch_s *batch, int lane, operation_s operation, bool *deadline_touched);  // 返回消行数
+void board_batch__selection_keys(const board_batch_s *batch, const evaluate_weights_s *weights, int rotation, int j_pos, int64_t keys[BATCH_LANES]);
+
+
+// 同一指令集的一组棋盘内核。各组的结果完全相同，只是速度不同。
+typedef struct {
+    const char                    *name;
+    column_features_s            (*column_features)(const grid_s *grid);
+    full_rows_index_container_s  (*full_rows)(const grid_s *grid);
+
+    // 各网格摆成 (rotation, j_pos) 的选择键（见 operation_make_selection_key），放不下的是 OPERATION_INVALID_SELECTION_KEY
+    void                         (*batch_selection_keys)(const board_batch_s *batch, const evaluate_weights_s *weights, int rotation, int j_pos, int64_t keys[BATCH_LANES]);
+} board_kernels_s;
+
+void board_kernels_initialize(void);  // 选一次，之后 board_kernels 指向选中的那组
+int board_kernels_detect_level(void);
+int board_kernels__level_from_name(const char *name);  // 不认识的名字返回 -1
+column_features_s board_kernels__column_features_baseline(const grid_s *grid);
+full_rows_index_container_s board_kernels__full_rows_baseline(const grid_s *grid);
+column_features_s board_kernels__column_features_v2(const grid_s *grid);
+full_rows_index_container_s board_kernels__full_rows_v2(const grid_s *grid);
+column_features_s board_kernels__column_features_v3(const grid_s *grid);
+full_rows_index_container_s board_kernels__full_rows_v3(const grid_s *grid);
+void board_kernels__batch_selection_keys_baseline(const board_batch_s *batch, const evaluate_weights_s *weights, int rotation, int j_pos, int64_t keys[BATCH_LANES]);
+void board_kernels__batch_selection_keys_v3(const board_batch_s *batch, const evaluate_weights_s *weights, int rotation, int j_pos, int64_t keys[BATCH_LANES]);
+
+
+// 一个网格上所有摆法共用的数据：每行的占用情况、每列的洞与列转变数，以及各项的和。
+// 不消行的摆法只改动方块占到的几行几列，其余行列的特征直接从这里取，见 game_state__calculate_evaluate_features_cached。
+// 暂存与不暂存两个分支的网格相同，共用一份。
+typedef struct {
+    uint16_t           row_bits[TETRIS_GRID_I_LIM];
+    column_features_s  columns[TETRIS_GRID_J_LIM];
+    column_features_s  column_total;
+    int                well;
+    int                row_transition;
+    int                top_row;
+} grid_feature_cache_s;
+
+grid_feature_cache_s grid_feature_cache_make(const grid_s *grid);  // 构造函数
+column_features_s grid_feature_cache__column_features_of(uint32_t bits);  // 一列的洞与列转变数，bits 的第 i 位是第 i 行
+
+
+// 一种摆法（rotation * 10 + j_pos）的计算结果。i_pos 为 -1 表示放不下，此时 features 无意义。
+typedef struct {
+    int                  i_pos;
+    evaluate_features_s  features;
+} candidate_s;
 
 
 typedef struct {
     grid_s        grid;
     char          falling_tetris;
     char          next_tetris;
+    char          hold_tetris;       // 暂存的方块，HOLD_EMPTY 表示空
     bool          deadline_touched;
     statistics_s  statistics;
 } game_state_s;
 
 
-game_state_s game_state_make(grid_s grid, char falling_tetris, char next_tetris, bool deadline_touched, statistics_s statistics);  // 构造函数
-game_state_s game_state_with_next_tetris_filled_in(const game_state_s *game_state, char next_tetris);
+// 截止时刻。过期以后 expired 一直为 true，之后的检查不再读时钟。
+typedef struct {
+    LONGLONG  end_ticks;
+    bool      expired;
+} deadline_s;
+
+deadline_s deadline_make_after_microseconds(long long microseconds);  // 构造函数
+deadline_s deadline_make_never(void);  // 构造函数
+bool deadline_is_expired(deadline_s *deadline);
+long long deadline__ticks_per_second(void);
+
+
+typedef struct {
+    int        completed_depth;       // 1 是贪心，2 用上了 next_tetris，再往后是对未知方块取平均
+    long long  evaluated_candidates;  // 调用评价函数的次数
+    long long  elapsed_microseconds;
+} anytime_report_s;
+
+void anytime_report_print_out(const anytime_report_s *report);
+
+
+game_state_s game_state_make(grid_s grid, char falling_tetris, char next_tetris, bool deadline_touched, statistics_s statistics);  // 构造函数，暂存为空
+game_state_s game_state_with_next_tetris_filled_in(const game_state_s *game_state, char next_tetris);  // 下落的方块也不知道时先填它
 void game_state_print_grid(const game_state_s *game_state);
 void game_state_print_statistics(const game_state_s *game_state);
 bool game_state_is_deadline_touched(const game_state_s *game_state);
 operation_s game_state_make_decision(const game_state_s *game_state);
+operation_s game_state_make_decision_survival(const game_state_s *game_state);
+bool game_state_has_valid_move(const game_state_s *game_state);
+bool game_state_can_hold(const game_state_s *game_state);  // 换出来的方块已知、又和下落的方块不同
+operation_s game_state_make_decision_with_hold(const game_state_s *game_state);
+game_state_s game_state__with_hold_swapped(const game_state_s *game_state);
+int64_t game_state__calculate_best_selection_key_cached(const game_state_s *game_state, const grid_feature_cache_s *cache, const evaluate_weights_s *weights);  // 没有能放的位置时返回 OPERATION_INVALID_SELECTION_KEY
+evaluate_features_s game_state__calculate_evaluate_features_cached(const game_state_s *game_state, const grid_feature_cache_s *cache, int rotation, int j_pos, int i_pos);  // cache 必须是 game_state 的网格的
 game_state_s game_state_the_next_state_with_no_next_tetris(const game_state_s *game_state, operation_s operation);
 int game_state__calculate_i_pos(const game_state_s *game_state, operation_s operation);
 operation_s game_state__calculate_best_move(const game_state_s *game_state);
+operation_s game_state__calculate_best_move_with_candidates(const game_state_s *game_state, candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM]);
+operation_s game_state__calculate_best_move_with_weights(const game_state_s *game_state, const evaluate_weights_s *weights, candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM]);
 double game_state__calculate_evaluate_score(const game_state_s *game_state, int rotation, int j_pos, int i_pos);
+int game_state__calculate_evaluate_score_x2(const game_state_s *game_state, int rotation, int j_pos, int i_pos);
+evaluate_features_s game_state__calculate_evaluate_features(const game_state_s *game_state, int rotation, int j_pos, int i_pos);
 void game_state_draw_the_falling_tetris(const game_state_s *game_state);
 void game_state_static_test_evaluator(void);
+operation_s game_state_make_decision_anytime(const game_state_s *game_state, long long budget_microseconds, anytime_report_s *report);
+operation_s game_state__make_decision_searching(const game_state_s *game_state, deadline_s deadline, int max_depth, anytime_report_s *report);
+operation_s game_state_make_decision_at_level(const game_state_s *game_state, int level);  // level 是 ENGINE_LEVEL_*，0 到 ENGINE_LEVEL_COUNT - 1
+operation_s game_state__calculate_best_move_partial(const game_state_s *game_state, bool with_row_features);
+evaluate_features_s game_state__calculate_evaluate_features_partial(const game_state_s *game_state, const grid_feature_cache_s *cache, int rotation, int j_pos, int i_pos, bool with_row_features);  // cache 必须是 game_state 的网格的
+int game_state__calculate_top_moves(const game_state_s *game_state, int width, operation_s moves[], int scores_x2[], deadline_s *deadline, long long *evaluated);
+
+
+// 线性（bump）分配器。一次决策里的所有搜索节点都从这里分配，决策结束后整体 reset，
+// 所以每步都不调用 malloc。每个线程一块，见 arena_for_this_thread。
+typedef struct {
+    unsigned char  *base;
+    size_t          capacity;
+    size_t          used;
+} arena_s;
+
+arena_s arena_make(size_t capacity);  // 构造函数
+void *arena_allocate(arena_s *arena, size_t size);  // 空间不够时返回 NULL
+void arena_reset(arena_s *arena);
+arena_s *arena_for_this_thread(void);
+
+
+// 搜索树的节点，不到 64 字节。只存打包的网格和这一步带来的变化，不存整个 game_state_s。
+// falling_tetris 为 '?' 的节点是“随机方块”节点，它的 7 个子节点网格相同、分别落下 7 种方块；
+// 其余节点的子节点是这个方块评价值最高的几种摆法。
+typedef struct search_node_s {
+    uint16_t               rows[TETRIS_GRID_I_LIM];  // 第 j 位是第 j 列
+    struct search_node_s  *children;
+    int16_t                move_score_x2;  // 走到这个节点的那一步的评价值的两倍
+    uint8_t                move;           // rotation * 10 + j_pos
+    uint8_t                lines_cleared;  // 统计数据的增量
+    char                   falling_tetris;
+    uint8_t                child_count;    // SEARCH_NODE_NOT_EXPANDED 表示还没展开
+} search_node_s;
+
+#define SEARCH_NODE_NOT_EXPANDED 0xFF
+
+search_node_s search_node_make_from_game_state(const game_state_s *game_state);  // 构造函数
+game_state_s search_node_to_game_state(const search_node_s *node);
+operation_s search_node_get_move(const search_node_s *node);
+
+
+// 一次限时决策的搜索上下文。树在逐层加深之间保留，下一层只需要展开新的叶子。
+typedef struct {
+    deadline_s  deadline;
+    arena_s    *arena;
+    long long   evaluated;
+} search_context_s;
+
+bool search_node__expand(search_node_s *node, int width, char child_falling_tetris, search_context_s *context, deadline_s *deadline);
+bool search_node__value(search_node_s *node, int depth, search_context_s *context, double *value);
+
+
+// game_state_s 的紧凑版本，正好 64 字节（一条缓存行）。用于需要同时保存大量局面的场合。
+// 网格每行打包成 10 位；得分与总消行数可以由 lines_cleared 推出，不单独存。
+typedef struct {
+    uint16_t  rows[TETRIS_GRID_I_LIM];  // 第 j 位是第 j 列
+    char      falling_tetris;
+    char      next_tetris;
+    uint8_t   deadline_touched;
+    char      hold_tetris;
+    uint32_t  placed_blocks;
+    uint32_t  lines_cleared[4];         // lines_cleared[n - 1] 是一次消 n 行的次数
+} packed_game_state_s;
+
+_Static_assert(sizeof(packed_game_state_s) == 64, "packed_game_state_s should fit in one cache line");
+
+packed_game_state_s packed_game_state_make(const game_state_s *game_state);  // 构造函数
+game_state_s packed_game_state_to_game_state(const packed_game_state_s *packed);
+int packed_game_state_get_cell(const packed_game_state_s *packed, int i, int j);
+char packed_game_state_get_falling_tetris(const packed_game_state_s *packed);
+char packed_game_state_get_next_tetris(const packed_game_state_s *packed);
+char packed_game_state_get_hold_tetris(const packed_game_state_s *packed);
+bool packed_game_state_is_deadline_touched(const packed_game_state_s *packed);
+int packed_game_state_get_placed_blocks(const packed_game_state_s *packed);
+int packed_game_state_get_lines_cleared(const packed_game_state_s *packed, int lines);
+int packed_game_state_get_total_lines_cleared(const packed_game_state_s *packed);
+int packed_game_state_get_score(const packed_game_state_s *packed);
+
+
+// 训练数据文件由若干个块（chunk）依次拼接而成，每块的格式：
+//   "TTDC" uint32 样本数 n  uint32 终局数 g
+//   样本列：uint32 game_id[n]  uint32 step[n]  uint16 board[n][20]（第 j 位是第 j 列）
+//           uint8 falling_tetris[n]  uint8 next_tetris[n]
+//           uint8 candidate_features[n][40][6]（洞、井、行转变、列转变、着陆高度×2、侵蚀格数；放不下记 0xFF）
+//           uint8 chosen_move[n]（rotation * 10 + j_pos）
+//   终局列：uint32 game_id[g]  int32 final_score[g]  int32 placed_blocks[g]  int32 total_lines_cleared[g]
+// 所有整数都是小端序。一局的终局结果可能落在比它的样本更靠后的块里，读取时按 game_id 关联。
+typedef struct {
+    uint32_t  sample_count;
+    uint32_t  game_count;
+
+    uint32_t  sample_game_id[TRAINING_DATA_CHUNK_SAMPLES];
+    uint32_t  sample_step[TRAINING_DATA_CHUNK_SAMPLES];
+    uint16_t  board[TRAINING_DATA_CHUNK_SAMPLES][TETRIS_GRID_I_LIM];
+    uint8_t   falling_tetris[TRAINING_DATA_CHUNK_SAMPLES];
+    uint8_t   next_tetris[TRAINING_DATA_CHUNK_SAMPLES];
+    uint8_t   candidate_features[TRAINING_DATA_CHUNK_SAMPLES][TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM][TRAINING_DATA_FEATURE_COUNT];
+    uint8_t   chosen_move[TRAINING_DATA_CHUNK_SAMPLES];
+
+    uint32_t  game_id[TRAINING_DATA_CHUNK_GAMES];
+    int32_t   final_score[TRAINING_DATA_CHUNK_GAMES];
+    int32_t   final_placed_blocks[TRAINING_DATA_CHUNK_GAMES];
+    int32_t   final_total_lines_cleared[TRAINING_DATA_CHUNK_GAMES];
+} training_data_chunk_s;
+
+void training_data_chunk_write_to(const training_data_chunk_s *chunk, FILE *file);
+
+
+// 双缓冲：主循环往 filling 里填，填满后交给后台写线程（pending），自己换另一块继续填。
+// 只有当写线程还没写完上一块时主循环才需要等待。
+typedef struct {
+    FILE                   *file;
+    training_data_chunk_s  *chunks[2];
+    training_data_chunk_s  *filling;
+    training_data_chunk_s  *pending;   // NULL 表示写线程空闲
+    bool                    stopping;
+    CRITICAL_SECTION        lock;
+    CONDITION_VARIABLE      pending_changed;
+    HANDLE                  writer_thread;
+    uint32_t                game_id;
+    uint32_t                step;
+} training_data_exporter_s;
+
+training_data_exporter_s *training_data_exporter_open(const char *file_name);  // 构造函数
+void training_data_exporter_close(training_data_exporter_s *exporter);  // 析构函数
+void training_data_exporter_record_decision(training_data_exporter_s *exporter, const game_state_s *game_state, const candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM], operation_s operation);
+void training_data_exporter_record_game_over(training_data_exporter_s *exporter, const game_state_s *game_state);
+void training_data_exporter__submit_filling_chunk(training_data_exporter_s *exporter);
+DWORD WINAPI training_data_exporter__writer_thread_main(LPVOID parameter);
+
+
+// 一个连接上的一局游戏。
+// 协议与 run_ai_1 相同：先收一行两个方块，之后每行一个方块；每走一步回复 "rotation j_pos\nscore\n"。
+// 第一行之前可以先发一行 "level n" 选择引擎的级别（见 ENGINE_LEVEL_*），不发就是 SERVER_DEFAULT_ENGINE_LEVEL。
+// 收到 E、下一个方块是 X、无处可放或协议出错时结束这一局并断开。
+typedef struct {
+    SOCKET               socket;
+    packed_game_state_s  game;      // 连接很多时只存紧凑版本，处理一行时再展开
+    int                  level;
+    bool                 started;   // 是否已收到第一行
+    bool                 busy;      // 已交给工作线程，只有工作线程能改 game、started、finished
+    bool                 finished;  // 由工作线程设置：这一局结束了
+    bool                 hung_up;   // 由主线程设置：对方断开了
+    int                  input_size;
+    char                 input[SERVER_INPUT_BUFFER_SIZE];
+} server_session_s;
+
+int server_session_take_line(server_session_s *session, char *line, int line_capacity);
+bool server_session_has_line(const server_session_s *session);
+void server_session_handle_line(server_session_s *session, const char *line, int length);
+void server_session__step_and_reply(server_session_s *session, game_state_s game);
+
+
+// 会话池：启动时一次分配好，之后分配与回收都只是在空闲下标栈上 push/pop，不再调用 malloc。
+// active_indices 是正在使用的会话，下标连续，方便主线程逐个加入 WSAPoll。
+typedef struct {
+    server_session_s  sessions[SERVER_MAX_SESSIONS];
+    int               free_indices[SERVER_MAX_SESSIONS];
+    int               free_count;
+    int               active_indices[SERVER_MAX_SESSIONS];
+    int               active_positions[SERVER_MAX_SESSIONS];
+    int               active_count;
+} server_session_pool_s;
+
+server_session_pool_s *server_session_pool_make(void);  // 构造函数
+void server_session_pool_free(server_session_pool_s *pool);  // 析构函数
+server_session_s *server_session_pool_allocate(server_session_pool_s *pool, SOCKET socket);
+void server_session_pool_release(server_session_pool_s *pool, server_session_s *session);
+int server_session_pool_index_of(const server_session_pool_s *pool, const server_session_s *session);
+
+
+// 主线程用 WSAPoll 收发连接与输入，决策交给固定数量的工作线程。
+// lock 保护会话池、任务队列以及各会话的 input、busy、hung_up。
+typedef struct {
+    SOCKET                  listen_socket;
+    server_session_pool_s  *pool;
+    CRITICAL_SECTION        lock;
+    CONDITION_VARIABLE      job_available;
+    int                     job_queue[SERVER_MAX_SESSIONS];
+    int                     job_head;
+    int                     job_count;
+    HANDLE                  workers[SERVER_WORKER_COUNT];
+} server_s;
+
+void server_run(const char *socket_path);
+void server__enqueue_if_ready(server_s *server, server_session_s *session);
+DWORD WINAPI server__worker_thread_main(LPVOID parameter);
+
+
+// 画图用的局面快照，只保留画得出来的东西
+typedef struct {
+    uint16_t  rows[TETRIS_GRID_I_LIM];
+    char      falling_tetris;
+    int       score;
+    int       placed_blocks;
+    int       total_lines_cleared;
+} visualizer_snapshot_s;
+
+visualizer_snapshot_s visualizer_snapshot_make(const game_state_s *game_state);  // 构造函数
+
+
+// lock 只保护队列和 stopping；drawn_* 和 frame 只有画图线程用。
+typedef struct {
+    visualizer_snapshot_s   queue[VISUALIZER_QUEUE_SIZE];
+    int                     queue_head;
+    int                     queue_size;
+    long long               dropped;
+    bool                    stopping;
+    CRITICAL_SECTION        lock;
+    HANDLE                  thread;
+
+    bool                    drawn_anything;
+    uint16_t                drawn_rows[TETRIS_GRID_I_LIM];
+    char                    frame[VISUALIZER_FRAME_BUFFER_SIZE];
+    size_t                  frame_size;
+    long long               frames;
+} visualizer_s;
+
+visualizer_s *visualizer_open(void);  // 构造函数，开始画
+void visualizer_close(visualizer_s *visualizer);  // 析构函数，画完最后一帧才返回
+void visualizer_push(visualizer_s *visualizer, const game_state_s *game_state);  // 不会等画图线程
+bool visualizer__take_latest(visualizer_s *visualizer, visualizer_snapshot_s *snapshot, bool *stopping);  // 取最新的一个，其余的丢掉
+void visualizer__render(visualizer_s *visualizer, const visualizer_snapshot_s *snapshot);
+void visualizer__append(visualizer_s *visualizer, const char *format, ...);
+void visualizer__enable_virtual_terminal(void);
+DWORD WINAPI visualizer__thread_main(LPVOID parameter);
+
+
+// 一局的汇总。二进制文件里就是这个结构体原样排列（都是 4 字节整数，小端序）。
+typedef struct {
+    uint32_t  game_id;
+    int32_t   score;
+    int32_t   placed_blocks;
+    int32_t   lines_cleared[4];     // 一次消 1、2、3、4 行各多少次
+    int32_t   max_stack_height;     // 消行之后方块堆最高到过几行
+} telemetry_game_s;
+
+telemetry_game_s telemetry_game_make(uint32_t game_id);  // 构造函数
+
+
+// 总表。各线程用 InterlockedAdd 在 games 里预留一段位置再写进去，直方图用 InterlockedAdd64 累加，都不需要加锁。
+// 文件格式（TELEMETRY_BINARY）：uint32 game_count  uint32 bucket_count  telemetry_game_s games[game_count]  int64 latency_buckets[bucket_count]
+typedef struct {
+    telemetry_game_s   *games;
+    LONG                game_capacity;
+    volatile LONG       game_count;      // 可能超过 game_capacity，超出的局丢掉
+    volatile LONGLONG   latency_buckets[TELEMETRY_LATENCY_BUCKETS];
+    long long           ticks_per_second;
+} telemetry_s;
+
+telemetry_s *telemetry_make(LONG game_capacity);  // 构造函数
+void telemetry_free(telemetry_s *telemetry);  // 析构函数
+void telemetry_write(telemetry_s *telemetry);  // 先按 game_id 排序，所以结果与线程调度无关
+void telemetry_print_summary(const telemetry_s *telemetry);
+LONG telemetry__recorded_game_count(const telemetry_s *telemetry);
+int telemetry__compare_games(const void *a, const void *b);
+
+
+// 每个线程一个，只有这个线程用。
+typedef struct {
+    telemetry_s        *telemetry;
+    telemetry_game_s    games[TELEMETRY_RECORDER_BATCH_GAMES];
+    int                 game_count;
+    long long           latency_buckets[TELEMETRY_LATENCY_BUCKETS];
+} telemetry_recorder_s;
+
+telemetry_recorder_s telemetry_recorder_make(telemetry_s *telemetry);  // 构造函数
+void telemetry_recorder_record_decision(telemetry_recorder_s *recorder, telemetry_game_s *game, long long ticks, const game_state_s *game_state);  // game_state 是走完这一步的局面
+void telemetry_recorder_record_game_over(telemetry_recorder_s *recorder, telemetry_game_s *game, const game_state_s *game_state);
+void telemetry_recorder_flush(telemetry_recorder_s *recorder);  // 线程结束前要调用
+
+
+// 参加对战的一组权重。
+typedef struct {
+    const char          *name;
+    evaluate_weights_s   weights;
+} battle_entrant_s;
+
+
+// 对战中的一方。收到的垃圾行先记在 pending_garbage 里，等自己某一步没有消行时才一次升上来；
+// 自己消行时先抵消 pending_garbage，剩下的才送给对方。
+typedef struct {
+    game_state_s               game;
+    const evaluate_weights_s  *weights;
+    int                        pending_garbage;
+    int                        combo;           // 在这一步之前连续消行的步数
+    int                        lines_sent;
+    uint64_t                   garbage_random;  // 决定垃圾行缺口在哪一列
+    bool                       lost;
+    telemetry_recorder_s      *recorder;        // 不收集遥测时为 NULL
+    telemetry_game_s           telemetry;
+} battle_player_s;
+
+battle_player_s battle_player_make(const evaluate_weights_s *weights, char falling_tetris, char next_tetris, uint64_t seed, telemetry_recorder_s *recorder, uint32_t game_id);  // 构造函数
+int battle_player_step(battle_player_s *player, char next_tetris);  // 返回送给对方的垃圾行数
+void battle_player__raise_pending_garbage(battle_player_s *player);
+
+
+// 一局对战。entrant_indices 是 battle_entrants 的下标；winner 是 0、1，平局是 -1。
+typedef struct {
+    int       entrant_indices[2];
+    uint64_t  seed;
+    int       winner;
+    int       turns;
+    int       lines_sent[2];
+} battle_match_s;
+
+void battle_match_run(battle_match_s *match, telemetry_recorder_s *recorder, uint32_t first_game_id);  // 两方的 game_id 是 first_game_id 和它加 1
+
+
+// 所有对局事先排好，各线程用 InterlockedIncrement 领下一局，结果写回各自的 battle_match_s，不需要加锁。
+// Elo 在全部对局结束后按对局顺序计算，所以结果与线程数和调度无关。
+typedef struct {
+    battle_match_s  *matches;
+    int              match_count;
+    volatile LONG    next_match;
+    telemetry_s     *telemetry;    // 不收集遥测时为 NULL
+} battle_tournament_s;
+
+void battle_run_tournament(void);
+DWORD WINAPI battle__worker_thread_main(LPVOID parameter);
+uint64_t battle__next_random(uint64_t *state);
+
+
+// 方块序列。第 n 个方块只由种子和 n 决定（基于计数器的随机数），所以可以直接跳到第 n 个，
+// 多个线程也可以各自从序列中间开始。position 与 history 是顺序读取时的状态，每个线程用自己的副本。
+typedef struct {
+    int        randomizer;                   // PIECE_RANDOMIZER_*
+    uint64_t   seed;
+    long long  position;                     // 下一次 piece_generator_next 返回第几个方块
+    char       history[PIECE_HISTORY_SIZE];  // 只有 PIECE_RANDOMIZER_HISTORY 用
+    char      *replay;                       // 只有 PIECE_RANDOMIZER_REPLAY 用，各副本共享，只读
+    long long  replay_length;
+} piece_generator_s;
+
+piece_generator_s piece_generator_make(int randomizer, uint64_t seed);  // 构造函数
+piece_generator_s piece_generator_make_replay(const char *file_name);  // 构造函数
+void piece_generator_free(piece_generator_s *generator);  // 析构函数
+void piece_generator_seek(piece_generator_s *generator, long long position);
+char piece_generator_next(piece_generator_s *generator);
+void piece_generator_write_sequence(piece_generator_s *generator, long long length, FILE *file);
+uint64_t piece_generator__hash(uint64_t seed, uint64_t counter);
+char piece_generator__bag_piece(const piece_generator_s *generator, long long position);
+char piece_generator__history_piece(piece_generator_s *generator, long long position);
+
+
+// 批量玩很多局，规则与 tetris_play_games 相同（碰到死线、无处可放或放满 max_pieces 个方块就结束）。
+// 每条通道（lane）是一局，一局结束后马上换下一局进来，直到局数用完，所以各通道基本一直是满的。
+typedef struct {
+    board_batch_s       boards;
+    int                 randomizer;
+    const uint64_t     *seeds;        // 第 k 局用 seeds[k] 生成方块，不复制，要比 game_batch_s 活得久
+    int                 game_count;
+    int                 max_pieces;
+    int                 next_game;
+    int                 lane_games[BATCH_LANES];  // 这条通道在玩第几局，-1 表示空闲
+    piece_generator_s   lane_generators[BATCH_LANES];
+    char                lane_falling_tetrises[BATCH_LANES];
+    char                lane_next_tetrises[BATCH_LANES];
+    statistics_s        lane_statistics[BATCH_LANES];
+    statistics_s       *results;      // 第 k 局的最终统计
+} game_batch_s;
+
+game_batch_s *game_batch_make(int randomizer, const uint64_t seeds[], int game_count, int max_pieces);  // 构造函数
+void game_batch_free(game_batch_s *batch);  // 析构函数
+void game_batch_run(game_batch_s *batch);
+bool game_batch_step(game_batch_s *batch);  // 各通道各走一步；全部空闲时返回 false
+void game_batch__start_next_game(game_batch_s *batch, int lane);
+
+
+// 从标准输入读方块。直接在读缓冲区里找方块字母，不按行复制。
+// 空白字符（空格、\r、\n）一律跳过，所以 CRLF、空行、一次发来很多行都能正确处理。
+typedef struct {
+    FILE       *file;
+    char       *buffer;
+    size_t      capacity;
+    size_t      size;
+    size_t      position;
+    bool        end_of_file;
+    long long   pieces_read;   // 已经返回了几个方块，不算 'E'
+} input_reader_s;
+
+input_reader_s input_reader_make(FILE *file, size_t capacity);  // 构造函数
+void input_reader_free(input_reader_s *reader);  // 析构函数
+char input_reader_next_piece(input_reader_s *reader);  // 输入结束时返回 'E'
+long long input_reader_read_all_pieces(input_reader_s *reader, char **pieces);
+bool input_reader__fill(input_reader_s *reader);
+
+
+// 检查点文件：checkpoint_s 原样写出，后面跟 telemetry_game_count 个 telemetry_game_s，都是小端序。
+// 先写临时文件，落盘后再改名替换，所以磁盘上的检查点要么是旧的一份、要么是新的一份，不会只写了一半。
+typedef struct {
+    uint32_t             magic;                  // CHECKPOINT_MAGIC
+    uint32_t             size;                   // sizeof(checkpoint_s)，结构体变了以后旧文件不读
+    int64_t              steps;                  // 从头算起一共走了几步，跨局累计
+    int64_t              pieces_read;            // run_ai_1：从输入读了几个方块
+    int32_t              game_index;             // 自我对弈：正在玩第几局
+    int32_t              randomizer;             // 自我对弈：这一局的方块序列，position 是下一个要取的方块
+    uint64_t             seed;
+    int64_t              generator_position;
+    packed_game_state_s  game;                   // 下一步要决策的局面
+    telemetry_game_s     telemetry_game;         // 这一局到目前为止的遥测
+    uint32_t             telemetry_game_count;   // 已经结束的局，跟在结构体后面
+    uint32_t             reserved;
+    int64_t              latency_buckets[TELEMETRY_LATENCY_BUCKETS];
+} checkpoint_s;
+
+checkpoint_s checkpoint_make(const game_state_s *game_state, long long steps);  // 构造函数，其余字段由调用者填
+bool checkpoint_load(checkpoint_s *checkpoint, const char *file_name, telemetry_s *telemetry);  // 文件不存在或不匹配时返回 false；telemetry 不为 NULL 时恢复总表
+void checkpoint_write_to(const checkpoint_s *checkpoint, const telemetry_game_s games[], const char *file_name);
+
+
+// 主循环提交检查点时只在锁里抄一份就返回，不等落盘。写线程每次只写最新的一份：它在写的时候
+// 新提交的检查点直接覆盖 pending，被覆盖的那份不再写，所以检查点再密，每次落盘也只等一次 FlushFileBuffers。
+typedef struct {
+    checkpoint_s         pending;
+    telemetry_game_s    *pending_games;
+    checkpoint_s         writing;         // 只有写线程用
+    telemetry_game_s    *writing_games;
+    LONG                 game_capacity;
+    bool                 has_pending;
+    bool                 stopping;
+    CRITICAL_SECTION     lock;
+    CONDITION_VARIABLE   pending_changed;
+    HANDLE               writer_thread;
+} checkpoint_writer_s;
+
+checkpoint_writer_s *checkpoint_writer_open(LONG game_capacity);  // 构造函数，game_capacity 是遥测总表的容量
+void checkpoint_writer_close(checkpoint_writer_s *writer);  // 析构函数，等最后一份写完
+void checkpoint_writer_submit(checkpoint_writer_s *writer, const checkpoint_s *checkpoint, const telemetry_s *telemetry);  // telemetry 可以是 NULL
+DWORD WINAPI checkpoint_writer__thread_main(LPVOID parameter);
+
+
+// 开放寻址（线性探测）的哈希表。每项是一个 uint64：(键 << 8) | (rotation << 4) | j_pos，0 表示空。
+// 键 = (裁剪后的各列相对高度，每列 3 位) << 7 | 下落的方块，方块字母不为 0，所以键不为 0。
+// 文件格式：uint32 height_clip  uint32 entry_count  uint64 entries[entry_count]（只存非空项，小端序）。
+// height_clip 与当前的 MOVE_CACHE_HEIGHT_CLIP 不同的文件不读。
+typedef struct {
+    uint64_t   *entries;
+    long long   capacity;
+    long long   size;
+    long long   hits;
+    long long   misses;        // 有洞的局面、没找到的、找到了但放不下的都算
+    long long   validations;
+    long long   validation_mismatches;
+} move_cache_s;
+
+move_cache_s *move_cache_make(void);  // 构造函数
+void move_cache_free(move_cache_s *cache);  // 析构函数
+bool move_cache_load(move_cache_s *cache, const char *file_name);  // 文件不存在或不匹配时返回 false，缓存不变
+void move_cache_save(const move_cache_s *cache, const char *file_name);
+bool move_cache_lookup(const move_cache_s *cache, uint64_t key, operation_s *operation);
+void move_cache_insert(move_cache_s *cache, uint64_t key, operation_s operation);
+void move_cache_print_statistics(const move_cache_s *cache);
+uint64_t move_cache__key_of(const game_state_s *game_state);  // 有洞时返回 0，表示不能用缓存
+long long move_cache__slot_of(const move_cache_s *cache, uint64_t key);
+
+operation_s game_state_make_decision_cached(const game_state_s *game_state, move_cache_s *cache);  // game_state_s 的成员，放在这里是因为要用到 move_cache_s
+
+
+// 束中的一个局面。parent 与 move 是回溯指针：它由上一层第 parent 个局面走 move 得到。
+typedef struct {
+    packed_game_state_s  state;
+    int64_t              key;     // 越大越好，见 OFFLINE_SCORE_WEIGHT
+    uint16_t             parent;
+    uint8_t              move;    // rotation * 10 + j_pos
+    uint8_t              valid;
+} offline_beam_entry_s;
+
+
+// 检查点文件里每层 OFFLINE_BEAM_WIDTH 条记录，不足的用 valid = 0 补齐，所以第 step 层第 k 条的位置可以直接算出来。
+typedef struct {
+    uint16_t  parent;
+    uint8_t   move;
+    uint8_t   valid;
+} offline_checkpoint_record_s;
+
+
+// 每一层：工作线程用 InterlockedIncrement 领取束中的局面，把它的 40 种摆法写到 children 中对应的位置，
+// 互不重叠，不需要加锁；全部展开后主线程挑出最好的 OFFLINE_BEAM_WIDTH 个作为下一层。
+// lock 只保护 generation、busy_workers、stopping。
+typedef struct {
+    const char            *pieces;
+    long long              piece_count;
+    long long              step;
+    int                    beam_size;
+    offline_beam_entry_s   beam[OFFLINE_BEAM_WIDTH];
+    offline_beam_entry_s   children[OFFLINE_BEAM_WIDTH * TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+    volatile LONG          next_parent;
+    FILE                  *checkpoint;
+    CRITICAL_SECTION       lock;
+    CONDITION_VARIABLE     work_ready;
+    CONDITION_VARIABLE     work_done;
+    long long              generation;
+    int                    busy_workers;
+    bool                   stopping;
+    HANDLE                 workers[OFFLINE_THREAD_COUNT];
+} offline_planner_s;
+
+offline_planner_s *offline_planner_make(const char *pieces, long long piece_count, const char *checkpoint_file_name);  // 构造函数
+void offline_planner_free(offline_planner_s *planner);  // 析构函数
+long long offline_planner_run(offline_planner_s *planner, operation_s operations[]);  // 返回走了多少步
+void offline_planner__expand(offline_planner_s *planner, int parent_index);
+int offline_planner__select(offline_planner_s *planner);
+DWORD WINAPI offline_planner__worker_thread_main(LPVOID parameter);
+
+
+// 自检记下的一局：用 randomizer 和 seed 生成 pieces 个方块，贪心 AI 每一步的走法与分数的散列。
+typedef struct {
+    int        randomizer;
+    uint64_t   seed;
+    int        pieces;
+    uint64_t   moves_hash;
+    int        final_score;
+} self_test_golden_s;
+
+
+typedef struct {
+    long long  checks;
+    long long  failures;
+} self_test_s;
+
+void self_test_check(self_test_s *test, bool ok, const char *what, long long case_index);
+uint64_t self_test__play_and_hash(int randomizer, uint64_t seed, int pieces, int *final_score);
+statistics_s self_test__reference_play_game(int randomizer, uint64_t seed, int max_pieces);
+grid_s self_test__random_grid(long long case_index);
+int self_test__count_cells(const grid_s *grid);
+grid_s self_test__reference_clear_full_rows(const grid_s *grid, int *lines_cleared);
+int self_test__reference_i_pos(const grid_s *grid, char tetris, int rotation, int j_pos);
+bool self_test__is_grid_index_consistent(const grid_s *grid);
+void self_test__check_board_kernels(self_test_s *test, const grid_s *grid, long long case_index);
+double self_test__reference_evaluate_score(const game_state_s *game_state, int rotation, int j_pos, int i_pos);
+operation_s self_test__reference_best_move(const game_state_s *game_state);
+void self_test__fuzz_one_case(self_test_s *test, long long case_index);
+void self_test__check_piece_generators(self_test_s *test);
+void self_test__check_game_batch(self_test_s *test);
 
 
 //////////////// 不变的数据
@@ -415,16 +1383,81 @@ const shape_s tetris_shapes[128][TETRIS_MAX_ANGLE] = {
 
 const int scores_of_line_cleared[5] = {0, 100, 300, 500, 800};
 
+// 对战中一次消 n 行送出的垃圾行数，单消不送
+const int battle_garbage_of_line_cleared[5] = {0, 0, 1, 2, 4};
+
+// 连击加送的垃圾行数，下标是这一步之前已经连续消行的步数，超出的按最后一项算
+const int battle_garbage_of_combo[] = {0, 1, 1, 2, 2, 3, 3, 4, 4, 4, 5};
+
+#define BATTLE_COMBO_TABLE_SIZE ((int) (sizeof battle_garbage_of_combo / sizeof battle_garbage_of_combo[0]))
+
+const battle_entrant_s battle_entrants[] = {
+    {"default",     {HOLE_WEIGHT, WELL_WEIGHT, ROW_TRANSITION_WEIGHT, COL_TRANSITION_WEIGHT, LANDING_HEIGHT_WEIGHT, ERODED_CELLS_WEIGHT, DANGER_WEIGHT}},
+    {"hole-averse", {-8, -1, -1, -1, -1, 1, 0}},
+    {"flat",        {-4, -1, -2, -2, -1, 1, 0}},
+    {"eroder",      {-4, -1, -1, -1, -1, 3, 0}},
+    {"low",         {-4, -1, -1, -1, -3, 1, 0}},
+    {"survivor",    {-4, -1, -1, -1, -1, 1, SURVIVAL_DANGER_WEIGHT}},
+};
+
+#define BATTLE_ENTRANT_COUNT ((int) (sizeof battle_entrants / sizeof battle_entrants[0]))
+
+// 由当前版本的贪心 AI（默认权重，不打开 SURVIVAL_MODE）生成。改动评价函数或选法以后走法本来就会变，那时需要重新生成。
+const self_test_golden_s self_test_goldens[] = {
+    {PIECE_RANDOMIZER_UNIFORM, 1, 2000, 0xCF38DF909032C9BFu, 92600},
+    {PIECE_RANDOMIZER_UNIFORM, 2, 2000, 0xDD1946671A8BF9F6u, 92600},
+    {PIECE_RANDOMIZER_UNIFORM, 3, 2000, 0xA9D6E82294737836u, 93300},
+    {PIECE_RANDOMIZER_BAG,     1, 2000, 0x5DC29D22F74EE39Eu, 93100},
+    {PIECE_RANDOMIZER_HISTORY, 1, 2000, 0x7CCA4ECD838C2771u, 90200},
+};
+
+#define SELF_TEST_GOLDEN_COUNT ((int) (sizeof self_test_goldens / sizeof self_test_goldens[0]))
+
+// 下标是一行的 10 位占用情况。程序启动时由 row_features_table_initialize 填好，之后只读。
+row_features_s row_features_table[ROW_FEATURES_TABLE_SIZE];
+
+// 下标是 ISA_LEVEL_*。不是 x86-64 时只有 baseline 一种实现，另外两项也指向它。
+const board_kernels_s board_kernels_table[ISA_LEVEL_COUNT] = {
+    {"baseline",  board_kernels__column_features_baseline, board_kernels__full_rows_baseline, board_kernels__batch_selection_keys_baseline},
+    {"x86-64-v2", board_kernels__column_features_v2,       board_kernels__full_rows_v2,       board_kernels__batch_selection_keys_baseline},
+    {"x86-64-v3", board_kernels__column_features_v3,       board_kernels__full_rows_v3,       board_kernels__batch_selection_keys_v3},
+};
+
+// 程序启动时由 board_kernels_initialize 设好，之后只读
+const board_kernels_s *board_kernels = &board_kernels_table[ISA_LEVEL_BASELINE];
+
 
 //////////////// 自由函数声明
 
 // 没有 main 函数的声明。
 
 int new_main(void);
-int raw_main(void);
-void run_ai_1(void);
+int raw_main(bool resume);
+void run_ai_1(bool resume);
+void run_ai_whole_sequence(void);
+void run_offline_planner(void);
+void run_self_play(bool resume);
+void run_self_play_batched(void);
+void run_row_features_benchmark(void);
+void run_engine_level_benchmark(void);
+int benchmark__compare_ticks(const void *a, const void *b);
+int run_self_test(void);
+void run_generate_pieces(void);
+bool tetris_is_known(char tetris);
+int bits_count(uint32_t bits);
+int bits_count_trailing_zeros(uint32_t bits);  // bits 为 0 时返回 32
 operation_s run_game_step(game_state_s *game, char next_tetris);
 
+// 动态库导出的接口，见 tetris_ai_c.py。只用定长整数和数组，网格是 20 * 10 个按行排列的 uint8（0 或 1）。
+// 尚不知道的下一个方块用 '?' 表示。
+TETRIS_API void tetris_initialize(void);
+TETRIS_API int32_t tetris_make_decision(const uint8_t cells[], char falling_tetris, char next_tetris, int32_t operation[2]);
+TETRIS_API int32_t tetris_make_decision_at_level(const uint8_t cells[], char falling_tetris, char next_tetris, int32_t level, int32_t operation[2]);
+TETRIS_API int32_t tetris_next_state(const uint8_t cells[], char falling_tetris, int32_t rotation, int32_t j_pos, uint8_t cells_out[], int32_t result[2]);
+TETRIS_API void tetris_evaluate_boards(int32_t count, const uint8_t cells[], const char falling_tetrises[], int32_t scores_x2[]);
+TETRIS_API int32_t tetris_play_sequence(int32_t piece_count, const char pieces[], int32_t operations[], int32_t scores[]);
+TETRIS_API void tetris_play_games(int32_t count, const uint64_t seeds[], int32_t randomizer, int32_t max_pieces, int32_t results[]);
+
 
 //////////////// 自由函数定义
 
@@ -474,19 +1507,44 @@ void print_operation(const game_state_s *game, const operation_s *operation)
 }
 
 
-int main(void)
+#ifndef TETRIS_BUILD_SHARED_LIBRARY
+int main(int argc, char *argv[])
 {
-    return raw_main();
+    // 唯一的命令行参数是 --resume，见 CHECKPOINT
+    bool resume = false;
+
+    for (int k = 1; k < argc; ++k) {
+
+        if (strcmp(argv[k], CHECKPOINT_RESUME_OPTION) != 0) {
+            fprintf(stderr, "unknown option: %s\n", argv[k]);
+            return 2;
+        }
+
+        resume = true;
+    }
+
+#ifndef CHECKPOINT
+    if (resume) {
+        fprintf(stderr, "%s needs CHECKPOINT\n", CHECKPOINT_RESUME_OPTION);
+        return 2;
+    }
+#endif /* CHECKPOINT */
+
+    row_features_table_initialize();
+    board_kernels_initialize();
+    return raw_main(resume);
 }
+#endif /* TETRIS_BUILD_SHARED_LIBRARY */
 
 
 int new_main(void)
 {
     // 主程序，包含了有 IO 的主循环
 
-    char block1, block2;
+    input_reader_s reader = input_reader_make(stdin, INPUT_READER_BUFFER_SIZE);
 
-    scanf("%c%c\n", &block1, &block2);
+    char block1 = input_reader_next_piece(&reader);
+    char block2 = input_reader_next_piece(&reader);
     game_state_s game = game_state_make(grid_make_blank(), block1, block2, false, statistics_make_blank());
 
     // 这次调用重复给了 block2，没关系。game_state_make 里给的 block2 才是被忽略的。
@@ -494,17 +1552,13 @@ int new_main(void)
     print_operation(&game, &operation);
 
     while (true) {
-        scanf("%c\n", &block1);
+        block1 = input_reader_next_piece(&reader);
 
+        // 碰到文件尾也会得到 E
         if (block1 == 'E') {
             break;
         }
 
-        // 实际上碰到文件尾是 scanf 本身返回 EOF
-        if (block1 == EOF) {
-            break;
-        }
-
         operation = run_game_step(&game, block1);
         print_operation(&game, &operation);
 
@@ -515,42 +1569,139 @@ int new_main(void)
         }
     }
 
-
+    input_reader_free(&reader);
     return 0;
 }
 
 
-int raw_main(void)
+int raw_main(bool resume)
 {
-#ifdef DEBUGGING_THE_EVALUATOR
+#if defined(DEBUGGING_THE_EVALUATOR)
     game_state_static_test_evaluator();
+#elif defined(SELF_TEST)
+    return run_self_test() == 0 ? 0 : 1;
+#elif defined(BENCHMARK_ROW_FEATURES)
+    run_row_features_benchmark();
+#elif defined(BENCHMARK_ENGINE_LEVELS)
+    run_engine_level_benchmark();
+#elif defined(GENERATE_PIECES)
+    run_generate_pieces();
+#elif defined(READ_WHOLE_SEQUENCE)
+    run_ai_whole_sequence();
+#elif defined(OFFLINE_PLANNER)
+    run_offline_planner();
+#elif defined(SELF_PLAY) && defined(SELF_PLAY_BATCHED)
+    run_self_play_batched();
+#elif defined(SELF_PLAY)
+    run_self_play(resume);
+#elif defined(SERVER_MODE)
+    server_run(SERVER_SOCKET_PATH);
+#elif defined(BATTLE_MODE)
+    battle_run_tournament();
 #else
-    run_ai_1();
+    run_ai_1(resume);
 #endif
+    (void) resume;
     return 0;
 }
 
 
-void run_ai_1(void)
+void run_ai_1(bool resume)
 {
-    char first_line[10] = {0};
-    fgets(first_line, 10, stdin);
-    assert(first_line[2] == '\n');
+    input_reader_s reader = input_reader_make(stdin, INPUT_READER_BUFFER_SIZE);
+
+    // 第一行是两个方块，之后每行一个；这里不管换行在哪里，按顺序取就行
+    char first = input_reader_next_piece(&reader);
+    char second = input_reader_next_piece(&reader);
 
-    char first = first_line[0];
-    char second = first_line[1];
+    if (!tetris_is_known(first)) {
+        input_reader_free(&reader);
+        return;
+    }
 
     game_state_s game = game_state_make(grid_make_blank(), first, second, false, statistics_make_blank());
 
+#ifdef CHECKPOINT
+    long long steps = 0;
+    checkpoint_s resumed;
+
+    if (resume && checkpoint_load(&resumed, CHECKPOINT_FILE_NAME, NULL)) {
+        // 输入是从头重新给的，检查点之前读过的方块跳过
+        while (reader.pieces_read < resumed.pieces_read) {
+
+            if (input_reader_next_piece(&reader) == 'E') {
+                fprintf(stderr, "input ends before the checkpoint in %s, not resuming\n", CHECKPOINT_FILE_NAME);
+                input_reader_free(&reader);
+                return;
+            }
+        }
+
+        game = packed_game_state_to_game_state(&resumed.game);
+        second = game.next_tetris;
+        steps = resumed.steps;
+    } else if (resume) {
+        fprintf(stderr, "no usable checkpoint in %s, starting from the beginning\n", CHECKPOINT_FILE_NAME);
+    }
+
+    checkpoint_writer_s *checkpoints = checkpoint_writer_open(0);
+#endif /* CHECKPOINT */
+
+    (void) resume;
+
+#ifdef EXPORT_TRAINING_DATA
+    training_data_exporter_s *exporter = training_data_exporter_open(TRAINING_DATA_FILE_NAME);
+#endif /* EXPORT_TRAINING_DATA */
+
+#ifdef MOVE_CACHE
+    move_cache_s *cache = move_cache_make();
+    move_cache_load(cache, MOVE_CACHE_FILE_NAME);
+#endif /* MOVE_CACHE */
+
+#ifdef VISUALIZER
+    visualizer_s *visualizer = visualizer_open();
+#endif /* VISUALIZER */
+
 
     while (true) {
         //Sleep(400);
+#ifdef SURVIVAL_MODE
+        if (!game_state_has_valid_move(&game)) {
+            // 标准输出是给评测程序的，原因写到标准错误
+            fprintf(stderr, "Game Over because no valid move.\n");
+            break;
+        }
+#endif /* SURVIVAL_MODE */
+
+#ifdef EXPORT_TRAINING_DATA
+        candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+        operation_s operation = game_state__calculate_best_move_with_candidates(&game, candidates);
+        training_data_exporter_record_decision(exporter, &game, candidates, operation);
+#elif defined(SURVIVAL_MODE)
+        operation_s operation = game_state_make_decision_survival(&game);
+#elif defined(HOLD_PIECE)
+        operation_s operation = game_state_make_decision_with_hold(&game);
+#elif defined(ENGINE_LEVEL)
+        operation_s operation = game_state_make_decision_at_level(&game, ENGINE_LEVEL);
+#elif defined(ANYTIME_DECISION)
+        anytime_report_s report;
+        operation_s operation = game_state_make_decision_anytime(&game, ANYTIME_BUDGET_MICROSECONDS, &report);
+#elif defined(MOVE_CACHE)
+        operation_s operation = game_state_make_decision_cached(&game, cache);
+#else
         operation_s operation = game_state_make_decision(&game);
+#endif /* EXPORT_TRAINING_DATA */
         game = game_state_the_next_state_with_no_next_tetris(&game, operation);
 
+#ifdef VISUALIZER
+        visualizer_push(visualizer, &game);
+#endif /* VISUALIZER */
+
 
 #ifdef DRAW_DETAIL
         // draw things
+#ifdef ANYTIME_DECISION
+        anytime_report_print_out(&report);
+#endif
         operation_print_out(&operation);
         printf("\n");
         game_state_print_grid(&game);
@@ -562,31 +1713,47 @@ void run_ai_1(void)
 #endif /* DRAW_DETAIL */
 
         // 应该在这里打印操作与分数
+#ifdef HOLD_PIECE
+        printf("%d %d %d\n", operation.rotation, operation.j_pos, operation.hold);
+#else
         printf("%d %d\n", operation.rotation, operation.j_pos);
+#endif /* HOLD_PIECE */
         fflush(stdout);
         printf("%d\n", game.statistics.score);
         fflush(stdout);
 
+#ifdef SURVIVAL_MODE
+        if (game_state_is_deadline_touched(&game)) {
+            fprintf(stderr, "Game Over because deadline touched.\n");
+            break;
+        }
+#endif /* SURVIVAL_MODE */
+
+#ifdef HOLD_PIECE
+        // 暂存是空的时候交换用掉了下一个方块，下落的方块也要从输入里读
+        if (game.falling_tetris == '?') {
+            second = input_reader_next_piece(&reader);
+
+            if (second == 'E') {
+                break;
+            }
+
+            game = game_state_with_next_tetris_filled_in(&game, second);
+        }
+#endif /* HOLD_PIECE */
+
         first = second;
 
         if (first == 'X') {
             break;
         }
 
-        char next_line[10] = {0};
-        fgets(next_line, 10, stdin);
-        assert(next_line[1] == '\n');
-        second = next_line[0];
+        second = input_reader_next_piece(&reader);
 
         if (second == 'E') {
             break;
         }
 
-        //if (game_state_is_deadline_touched(&game)) {
-        //    printf("Game Over because deadline touched.\n");
-        //    return;
-        //}
-
         //if (second == 'X') {
         //    printf("Game Over because next_tetris is X.\n");
         //    return;
@@ -594,713 +1761,5865 @@ void run_ai_1(void)
 
 
         game = game_state_with_next_tetris_filled_in(&game, second);
+
+#ifdef CHECKPOINT
+        if (++steps % CHECKPOINT_PERIOD_PIECES == 0) {
+            checkpoint_s checkpoint = checkpoint_make(&game, steps);
+            checkpoint.pieces_read = reader.pieces_read;
+            checkpoint_writer_submit(checkpoints, &checkpoint, NULL);
+        }
+#endif /* CHECKPOINT */
     }
-}
 
+#ifdef EXPORT_TRAINING_DATA
+    training_data_exporter_record_game_over(exporter, &game);
+    training_data_exporter_close(exporter);
+#endif /* EXPORT_TRAINING_DATA */
 
+#ifdef MOVE_CACHE
+    // 标准输出是给评测程序的，这里不打印统计
+    move_cache_save(cache, MOVE_CACHE_FILE_NAME);
+    move_cache_free(cache);
+#endif /* MOVE_CACHE */
 
-//////////////// 类成员函数实现
+#ifdef VISUALIZER
+    visualizer_close(visualizer);
+#endif /* VISUALIZER */
 
+#ifdef CHECKPOINT
+    // 走完了，没有可以续跑的
+    checkpoint_writer_close(checkpoints);
+    DeleteFileA(CHECKPOINT_FILE_NAME);
+#endif /* CHECKPOINT */
 
-int shape_get_i_lim(const shape_s *shape)
-{
-    return shape->i_lim;
+    input_reader_free(&reader);
 }
 
 
-int shape_get_j_lim(const shape_s *shape)
+void run_ai_whole_sequence(void)
 {
-    return shape->j_lim;
-}
-
+    // 与 run_ai_1 的输入输出完全相同，只是先读完整个序列，最后一次写出所有输出
+    input_reader_s reader = input_reader_make(stdin, INPUT_READER_BUFFER_SIZE);
 
-int shape_get_cell_hitbox_check(const shape_s *shape, int i, int j)
-{
-    assert(0 <= i && i < shape->i_lim);
-    assert(0 <= j && j < shape->j_lim);
-    return shape->content[i][j];
-}
+    char *pieces = NULL;
+    const long long piece_count = input_reader_read_all_pieces(&reader, &pieces);
 
+    if (piece_count < 2 || !tetris_is_known(pieces[0])) {
+        input_reader_free(&reader);
+        return;
+    }
 
-int shape_get_cell_not_hitbox_check(const shape_s *shape, int i, int j)
-{
-    assert(0 <= i && i < TETRIS_SHAPE_I_LIM);
-    assert(0 <= j && j < TETRIS_SHAPE_J_LIM);
-    return shape->content[i][j];
-}
+    // 每一步最多输出 "3 9\n" 加上一个不超过 11 位的分数和换行
+    char *output = malloc((size_t) piece_count * 32);
+    assert(output != NULL);
+    size_t output_size = 0;
 
+    game_state_s game = game_state_make(grid_make_blank(), pieces[0], pieces[1], false, statistics_make_blank());
 
-statistics_s statistics_make_blank()
-{
-    return (statistics_s) {
-        .placed_blocks       = 0,
-        .score               = 0,
-        .total_lines_cleared = 0,
-        .lines_cleared       = {0, 0, 0, 0, 0},
-    };
-}
+    for (long long k = 2; ; ++k) {
+        const operation_s operation = game_state_make_decision(&game);
+        game = game_state_the_next_state_with_no_next_tetris(&game, operation);
 
+        output_size += (size_t) sprintf(output + output_size, "%d %d\n%d\n", operation.rotation, operation.j_pos, game.statistics.score);
 
-void statistics_print_out(const statistics_s *statistics)
-{
-    printf("statistics:\n");
-    printf("- score: %d\n", statistics->score);
-    printf("- placed_blocks: %d\n", statistics->placed_blocks);
-    printf("- cleared_lines:\n");
+        if (game.falling_tetris == 'X' || k >= piece_count) {
+            break;
+        }
 
-    for (int i = 1; i < 5; ++i) {
-        printf("  - %d lines: %d\n", i, statistics->lines_cleared[i]);
+        game = game_state_with_next_tetris_filled_in(&game, pieces[k]);
     }
+
+    fwrite(output, 1, output_size, stdout);
+    fflush(stdout);
+
+    free(output);
+    input_reader_free(&reader);
 }
 
 
-grid_s grid_make_blank()
+void run_offline_planner(void)
 {
-    grid_s grid;
+    input_reader_s reader = input_reader_make(stdin, INPUT_READER_BUFFER_SIZE);
 
-    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+    char *pieces = NULL;
+    const long long piece_count = input_reader_read_all_pieces(&reader, &pieces);
 
-        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
-            grid.content[i][j] = 0;
-        }
+    if (piece_count < 2 || !tetris_is_known(pieces[0])) {
+        input_reader_free(&reader);
+        return;
     }
 
-    return grid;
-}
+    // 和 run_ai_whole_sequence 一样，最后一个方块（X 或者文件尾前的那个）不用放
+    operation_s *operations = malloc((size_t) (piece_count - 1) * sizeof(operation_s));
+    assert(operations != NULL);
 
+    offline_planner_s *planner = offline_planner_make(pieces, piece_count, OFFLINE_CHECKPOINT_FILE_NAME);
+    const long long step_count = offline_planner_run(planner, operations);
+    offline_planner_free(planner);
 
-grid_s grid_with_a_tetris_placed(const grid_s *grid, char tetris, int rotation, int j_pos, int i_pos)
-{
-    grid_s new_grid = *grid;
-    const shape_s shape = tetris_shapes[(unsigned char) tetris][rotation];
+    // 重新走一遍，得到每一步之后的分数
+    char *output = malloc((size_t) piece_count * 32);
+    assert(output != NULL);
+    size_t output_size = 0;
 
-    for (int i = 0; i < shape_get_i_lim(&shape); ++i) {
+    game_state_s game = game_state_make(grid_make_blank(), pieces[0], pieces[1], false, statistics_make_blank());
 
-        for (int j = 0; j < shape_get_j_lim(&shape); ++j) {
-            const int abs_i = i_pos + i;
-            const int abs_j = j_pos + j;
+    for (long long step = 0; step < step_count; ++step) {
+        game = game_state_the_next_state_with_no_next_tetris(&game, operations[step]);
+        output_size += (size_t) sprintf(output + output_size, "%d %d\n%d\n", operations[step].rotation, operations[step].j_pos, game.statistics.score);
 
-            assert(0 <= abs_i && abs_i < TETRIS_GRID_I_LIM);
-            assert(0 <= abs_j && abs_j < TETRIS_GRID_J_LIM);
-
-            if (shape_get_cell_hitbox_check(&shape, i, j) == 0) {
-                continue;
-            }
-
-            assert(new_grid.content[abs_i][abs_j] == 0);
-            new_grid.content[abs_i][abs_j] = 1;
+        if (step + 2 < piece_count) {
+            game = game_state_with_next_tetris_filled_in(&game, pieces[step + 2]);
         }
     }
 
-    return new_grid;
-}
+    fwrite(output, 1, output_size, stdout);
+    fflush(stdout);
 
+    free(output);
+    free(operations);
+    input_reader_free(&reader);
+}
 
-full_rows_index_container_s grid_all_full_rows(const grid_s *grid)
+void run_self_play(bool resume)
 {
-    full_rows_index_container_s container = full_rows_index_container_make_blank();
+    // 遥测和检查点放在最前面：续跑时检查点里的遥测要读进总表，检查点不能用时别的都还没打开，直接返回
+#ifdef TELEMETRY
+    telemetry_s *telemetry = telemetry_make(SELF_PLAY_GAMES);
+    telemetry_recorder_s recorder = telemetry_recorder_make(telemetry);
+#else
+    telemetry_s *telemetry = NULL;
+#endif /* TELEMETRY */
+
+    int first_game_index = 0;
+
+#ifdef CHECKPOINT
+    long long steps = 0;
+    checkpoint_s resumed;
+    const bool has_resumed = resume && checkpoint_load(&resumed, CHECKPOINT_FILE_NAME, telemetry);
+
+    // 别的随机方式或种子下存的检查点，接着走就和原来那一局对不上了
+    if (has_resumed && (resumed.randomizer != SELF_PLAY_RANDOMIZER || resumed.seed != piece_generator__hash(SELF_PLAY_SEED, resumed.game_index))) {
+        fprintf(stderr, "%s was written with another randomizer or seed, not resuming\n", CHECKPOINT_FILE_NAME);
+#ifdef TELEMETRY
+        telemetry_free(telemetry);
+#endif /* TELEMETRY */
+        return;
+    }
 
-    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
-        bool all_value = true;
+    if (has_resumed) {
+        first_game_index = resumed.game_index;
+        steps = resumed.steps;
+    } else if (resume) {
+        fprintf(stderr, "no usable checkpoint in %s, starting from the beginning\n", CHECKPOINT_FILE_NAME);
+    }
+#endif /* CHECKPOINT */
+
+#ifdef EXPORT_TRAINING_DATA
+    training_data_exporter_s *exporter = training_data_exporter_open(TRAINING_DATA_FILE_NAME);
+#endif /* EXPORT_TRAINING_DATA */
+
+#ifdef MOVE_CACHE
+    move_cache_s *cache = move_cache_make();
+    move_cache_load(cache, MOVE_CACHE_FILE_NAME);
+#endif /* MOVE_CACHE */
+
+#ifdef VISUALIZER
+    visualizer_s *visualizer = visualizer_open();
+#endif /* VISUALIZER */
+
+#ifdef CHECKPOINT
+    checkpoint_writer_s *checkpoints = checkpoint_writer_open(SELF_PLAY_GAMES);
+#endif /* CHECKPOINT */
+
+    (void) resume;
+    (void) telemetry;
+
+    for (int game_index = first_game_index; game_index < SELF_PLAY_GAMES; ++game_index) {
+        // 每局一个种子，和前面的局用掉了多少个方块无关
+        piece_generator_s generator = piece_generator_make(SELF_PLAY_RANDOMIZER, piece_generator__hash(SELF_PLAY_SEED, game_index));
+        const char first = piece_generator_next(&generator);
+        const char second = piece_generator_next(&generator);
+        game_state_s game = game_state_make(grid_make_blank(), first, second, false, statistics_make_blank());
+
+#ifdef TELEMETRY
+        telemetry_game_s telemetry_game = telemetry_game_make((uint32_t) game_index);
+#endif /* TELEMETRY */
+
+#ifdef CHECKPOINT
+        if (has_resumed && game_index == resumed.game_index) {
+            game = packed_game_state_to_game_state(&resumed.game);
+            piece_generator_seek(&generator, resumed.generator_position);
+#ifdef TELEMETRY
+            telemetry_game = resumed.telemetry_game;
+#endif /* TELEMETRY */
+        }
+#endif /* CHECKPOINT */
+
+        for (int piece = game.statistics.placed_blocks; piece < SELF_PLAY_MAX_PIECES_PER_GAME; ++piece) {
+#ifdef TELEMETRY
+            LARGE_INTEGER decision_begin;
+            QueryPerformanceCounter(&decision_begin);
+#endif /* TELEMETRY */
+
+#ifdef EXPORT_TRAINING_DATA
+            candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+            const operation_s operation = game_state__calculate_best_move_with_candidates(&game, candidates);
+            training_data_exporter_record_decision(exporter, &game, candidates, operation);
+#elif defined(SURVIVAL_MODE)
+            const operation_s operation = game_state_make_decision_survival(&game);
+#elif defined(HOLD_PIECE)
+            const operation_s operation = game_state_make_decision_with_hold(&game);
+#elif defined(ENGINE_LEVEL)
+            const operation_s operation = game_state_make_decision_at_level(&game, ENGINE_LEVEL);
+#elif defined(MOVE_CACHE)
+            const operation_s operation = game_state_make_decision_cached(&game, cache);
+#else
+            const operation_s operation = game_state_make_decision(&game);
+#endif /* EXPORT_TRAINING_DATA */
 
-        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+#ifdef TELEMETRY
+            LARGE_INTEGER decision_end;
+            QueryPerformanceCounter(&decision_end);
+#endif /* TELEMETRY */
+
+            game = game_state_the_next_state_with_no_next_tetris(&game, operation);
+
+#ifdef TELEMETRY
+            telemetry_recorder_record_decision(&recorder, &telemetry_game, decision_end.QuadPart - decision_begin.QuadPart, &game);
+#endif /* TELEMETRY */
 
-            if (grid->content[i][j] == 0) {
-                all_value = false;
+#ifdef VISUALIZER
+            visualizer_push(visualizer, &game);
+#endif /* VISUALIZER */
+
+            if (game_state_is_deadline_touched(&game)) {
                 break;
             }
-        }
 
-        if (all_value) {
-            container = full_rows_index_container_with_a_row_index_appended(&container, i);
+            game = game_state_with_next_tetris_filled_in(&game, piece_generator_next(&generator));
+
+#ifdef HOLD_PIECE
+            if (game.next_tetris == '?') {
+                game = game_state_with_next_tetris_filled_in(&game, piece_generator_next(&generator));
+            }
+#endif /* HOLD_PIECE */
+
+#ifdef CHECKPOINT
+            if (++steps % CHECKPOINT_PERIOD_PIECES == 0) {
+                checkpoint_s checkpoint = checkpoint_make(&game, steps);
+                checkpoint.game_index = game_index;
+                checkpoint.randomizer = generator.randomizer;
+                checkpoint.seed = generator.seed;
+                checkpoint.generator_position = generator.position;
+#ifdef TELEMETRY
+                // 已经结束的局要先并入总表，检查点里才有
+                telemetry_recorder_flush(&recorder);
+                checkpoint.telemetry_game = telemetry_game;
+#endif /* TELEMETRY */
+                checkpoint_writer_submit(checkpoints, &checkpoint, telemetry);
+            }
+#endif /* CHECKPOINT */
         }
+
+#ifdef EXPORT_TRAINING_DATA
+        training_data_exporter_record_game_over(exporter, &game);
+#endif /* EXPORT_TRAINING_DATA */
+
+#ifdef TELEMETRY
+        telemetry_recorder_record_game_over(&recorder, &telemetry_game, &game);
+#endif /* TELEMETRY */
+
+        printf("game %d: score %d, placed_blocks %d\n", game_index, game.statistics.score, game.statistics.placed_blocks);
+        fflush(stdout);
     }
 
-    return container;
+#ifdef EXPORT_TRAINING_DATA
+    training_data_exporter_close(exporter);
+#endif /* EXPORT_TRAINING_DATA */
+
+#ifdef VISUALIZER
+    visualizer_close(visualizer);
+#endif /* VISUALIZER */
+
+#ifdef CHECKPOINT
+    checkpoint_writer_close(checkpoints);
+    DeleteFileA(CHECKPOINT_FILE_NAME);
+#endif /* CHECKPOINT */
+
+#ifdef TELEMETRY
+    telemetry_recorder_flush(&recorder);
+    telemetry_print_summary(telemetry);
+    telemetry_write(telemetry);
+    telemetry_free(telemetry);
+#endif /* TELEMETRY */
+
+#ifdef MOVE_CACHE
+    move_cache_print_statistics(cache);
+    move_cache_save(cache, MOVE_CACHE_FILE_NAME);
+    move_cache_free(cache);
+#endif /* MOVE_CACHE */
 }
 
 
-void grid_print_out(const grid_s *grid)
+void run_self_play_batched(void)
 {
-    printf("     0 1 2 3 4 5 6 7 8 9\n");
-    printf("   +--------------------+\n");
+    // 种子与 run_self_play 相同，输出也相同；各局结束的先后不定，所以全部玩完再按顺序打印
+    uint64_t *seeds = malloc(SELF_PLAY_GAMES * sizeof(uint64_t));
+    assert(seeds != NULL);
 
-    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
-        printf("%2d |", i);
+    for (int game_index = 0; game_index < SELF_PLAY_GAMES; ++game_index) {
+        seeds[game_index] = piece_generator__hash(SELF_PLAY_SEED, game_index);
+    }
 
-        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
-            printf("%s", grid->content[i][j] == 1 ? "[]" : "  ");
-        }
-        printf("|\n");
+    game_batch_s *batch = game_batch_make(SELF_PLAY_RANDOMIZER, seeds, SELF_PLAY_GAMES, SELF_PLAY_MAX_PIECES_PER_GAME);
+    game_batch_run(batch);
+
+    for (int game_index = 0; game_index < SELF_PLAY_GAMES; ++game_index) {
+        printf("game %d: score %d, placed_blocks %d\n", game_index, batch->results[game_index].score, batch->results[game_index].placed_blocks);
     }
-    printf("   +--------------------+\n");
+    fflush(stdout);
+
+    game_batch_free(batch);
+    free(seeds);
 }
 
 
-bool grid_is_deadline_touched(const grid_s *grid)
+void run_row_features_benchmark(void)
 {
-    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+    // 先用贪心 AI 玩出一批真实的局面，再分别用两种方式计算每个局面每一行的行转变数和井。
+    const char tetrises[] = "IOLJZST";
+    srand(BENCHMARK_SEED);
 
-        // 4 是死线
-        if (grid->content[4][j] == 1) {
-            return true;
+    grid_s *grids = malloc(BENCHMARK_GRIDS * sizeof(grid_s));
+    assert(grids != NULL);
+
+    game_state_s game = game_state_make(grid_make_blank(), tetrises[rand() % 7], tetrises[rand() % 7], false, statistics_make_blank());
+
+    for (int g = 0; g < BENCHMARK_GRIDS; ++g) {
+
+        if (!game_state_has_valid_move(&game) || game_state_is_deadline_touched(&game)) {
+            game = game_state_make(grid_make_blank(), tetrises[rand() % 7], tetrises[rand() % 7], false, statistics_make_blank());
         }
+
+        const operation_s operation = game_state_make_decision(&game);
+        game = game_state_the_next_state_with_no_next_tetris(&game, operation);
+        game = game_state_with_next_tetris_filled_in(&game, tetrises[rand() % 7]);
+        grids[g] = game.grid;
     }
 
-    return false;
-}
+    long long sums[2] = {0, 0};
+    long long elapsed_ticks[2] = {0, 0};
 
+    for (int method = 0; method < 2; ++method) {
+        LARGE_INTEGER begin;
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&begin);
 
-int grid_get_with_default(const grid_s *grid, int i, int j, int default_value)
-{
-    if (0 <= i && i < TETRIS_GRID_I_LIM && 0 <= j && j < TETRIS_GRID_J_LIM) {
-        return grid->content[i][j];
-    }
+        for (int round = 0; round < BENCHMARK_ROUNDS; ++round) {
 
-    return default_value;
-}
+            for (int g = 0; g < BENCHMARK_GRIDS; ++g) {
 
+                for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+                    const row_features_s row_features = method == 0
+                        ? row_features_calculate(&grids[g], i)
+                        : row_features_table[grid_get_row_bits(&grids[g], i)];
+                    sums[method] += row_features.row_transition * 16 + row_features.well;
+                }
+            }
+        }
 
-void operation_print_out(const operation_s *operation)
-{
-    printf("operation: rotation=%d, j_pos=%d\n", operation->rotation, operation->j_pos);
-}
+        QueryPerformanceCounter(&end);
+        elapsed_ticks[method] = end.QuadPart - begin.QuadPart;
+    }
 
+    // 顺便测一下整个评价函数现在每次调用要多久，这台机器支持的每一级棋盘内核各测一次。
+    // 轮流测三遍取最快的，免得先测的吃亏。
+    const board_kernels_s *selected_kernels = board_kernels;
+    const int detected_level = board_kernels_detect_level();
+    long long evaluated = 0;
+    long long evaluate_ticks[ISA_LEVEL_COUNT] = {INT64_MAX, INT64_MAX, INT64_MAX};
+    int checksums[ISA_LEVEL_COUNT];
 
-game_state_s game_state_make(grid_s grid, char falling_tetris, char next_tetris, bool deadline_touched, statistics_s statistics)
-{
-    return (game_state_s) {
-        .grid             = grid,
-        .falling_tetris   = falling_tetris,
-        .next_tetris      = next_tetris,
-        .deadline_touched = deadline_touched,
-        .statistics       = statistics
-    };
-}
+    for (int pass = 0; pass < 3 * (detected_level + 1); ++pass) {
+        const int level = pass % (detected_level + 1);
+        board_kernels = &board_kernels_table[level];
+        evaluated = 0;
+        checksums[level] = 0;
 
+        LARGE_INTEGER begin;
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&begin);
 
-game_state_s game_state_with_next_tetris_filled_in(const game_state_s *game_state, char next_tetris)
-{
-    assert(game_state->next_tetris == '?');
-    game_state_s return_value = *game_state;
-    return_value.next_tetris = next_tetris;
-    return return_value;
-}
+        for (int g = 0; g < BENCHMARK_GRIDS; ++g) {
+            const game_state_s state = game_state_make(grids[g], tetrises[g % 7], '?', false, statistics_make_blank());
 
+            for (int rotation = 0; rotation < 4; ++rotation) {
 
-void game_state_print_grid(const game_state_s *game_state)
-{
-    grid_print_out(&game_state->grid);
-}
+                for (int j_pos = 0; j_pos < 10; ++j_pos) {
+                    const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+                    const int i_pos = game_state__calculate_i_pos(&state, operation);
+
+                    if (i_pos != -1) {
+                        checksums[level] += game_state__calculate_evaluate_score_x2(&state, rotation, j_pos, i_pos);
+                        ++evaluated;
+                    }
+                }
+            }
+        }
 
+        QueryPerformanceCounter(&end);
 
-void game_state_print_statistics(const game_state_s *game_state)
-{
-    statistics_print_out(&game_state->statistics);
-}
+        if (end.QuadPart - begin.QuadPart < evaluate_ticks[level]) {
+            evaluate_ticks[level] = end.QuadPart - begin.QuadPart;
+        }
+    }
 
+    board_kernels = selected_kernels;
 
-bool game_state_is_deadline_touched(const game_state_s *game_state)
-{
-    return game_state->deadline_touched;
-}
+    // 一次决策：不暂存，以及两个分支都试（暂存里放的是另一种方块，所以两个分支都要算）
+    long long decision_ticks[2] = {INT64_MAX, INT64_MAX};
+    int decision_checksums[2] = {0, 0};
 
+    for (int pass = 0; pass < 2 * 3; ++pass) {
+        const int with_hold = pass % 2;
+        decision_checksums[with_hold] = 0;
 
-operation_s game_state_make_decision(const game_state_s *game_state)
-{
-    return game_state__calculate_best_move(game_state);
-}
+        LARGE_INTEGER begin;
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&begin);
 
+        for (int g = 0; g < BENCHMARK_GRIDS; ++g) {
+            game_state_s state = game_state_make(grids[g], tetrises[g % 7], '?', false, statistics_make_blank());
+            state.hold_tetris = tetrises[(g + 1) % 7];
 
-game_state_s game_state_the_next_state_with_no_next_tetris(const game_state_s *game_state, operation_s operation)
-{
-    const int rotation = operation.rotation;
-    const int j_pos = operation.j_pos;
+            if (!game_state_has_valid_move(&state)) {
+                continue;
+            }
 
-    // 0. 创建一个副本，并开始修改它
-    game_state_s return_value = *game_state;
-    const int i_pos = game_state__calculate_i_pos(&return_value, operation);
+            const operation_s operation = with_hold ? game_state_make_decision_with_hold(&state) : game_state_make_decision(&state);
+            decision_checksums[with_hold] += operation.rotation * TETRIS_GRID_J_LIM + operation.j_pos + 100 * operation.hold;
+        }
 
-    // 1. 更新网格（将下落的方块放入格子中）
-    return_value.grid = grid_with_a_tetris_placed(&return_value.grid, game_state->falling_tetris, rotation, j_pos, i_pos);
+        QueryPerformanceCounter(&end);
 
-    // 2. (有可能) deadline_touched = True
-    if (grid_is_deadline_touched(&game_state->grid)) {
-        return_value.deadline_touched = true;
+        if (end.QuadPart - begin.QuadPart < decision_ticks[with_hold]) {
+            decision_ticks[with_hold] = end.QuadPart - begin.QuadPart;
+        }
     }
 
-    // debug
-    //printf("######################\n");
-    //grid_print_out(&return_value.grid);
+    const double rows = (double) BENCHMARK_ROUNDS * BENCHMARK_GRIDS * TETRIS_GRID_I_LIM;
+    const double ticks_per_nanosecond = deadline__ticks_per_second() / 1e9;
+    const double scan_ns = elapsed_ticks[0] / ticks_per_nanosecond / rows;
+    const double table_ns = elapsed_ticks[1] / ticks_per_nanosecond / rows;
 
-    // 3. 更新网格（清除已满的行）
-    // 如果不想再去更改已满行的索引，那么清除满行时就要从上到下。
-    const full_rows_index_container_s container = grid_all_full_rows(&return_value.grid);
+    printf("rows: %.0f, results %s\n", rows, sums[0] == sums[1] ? "match" : "DIFFER");
+    printf("scan:  %.2f ns/row\n", scan_ns);
+    printf("table: %.2f ns/row (%.1fx)\n", table_ns, scan_ns / table_ns);
 
-    for (int i = 0; i < container.size; ++i) {
-        memmove(
-            &return_value.grid.content[1][0],
-            &return_value.grid.content[0][0],
-            container.indices[i] * sizeof return_value.grid.content[0]
+    for (int level = 0; level <= detected_level; ++level) {
+        printf(
+            "evaluate (%s%s): %.1f ns/call over %lld calls (checksum %d)\n",
+            board_kernels_table[level].name, &board_kernels_table[level] == board_kernels ? ", selected" : "",
+            evaluate_ticks[level] / ticks_per_nanosecond / evaluated, evaluated, checksums[level]
         );
-        memset(&return_value.grid.content[0][0], 0, sizeof return_value.grid.content[0]);
     }
 
-    // debug
-    //printf("!!!!!!!!!!!!!!!!!!!!!!!\n");
-    //grid_print_out(&return_value.grid);
+    printf(
+        "decision: %.0f ns, with hold: %.0f ns (%.2fx, checksums %d %d)\n",
+        decision_ticks[0] / ticks_per_nanosecond / BENCHMARK_GRIDS, decision_ticks[1] / ticks_per_nanosecond / BENCHMARK_GRIDS,
+        (double) decision_ticks[1] / decision_ticks[0], decision_checksums[0], decision_checksums[1]
+    );
+    fflush(stdout);
 
-    // 4. 更新数据
-    return_value.statistics.placed_blocks++;
+    free(grids);
+}
 
-    if (container.size > 0) {
-        return_value.statistics.score += scores_of_line_cleared[container.size];
-        return_value.statistics.lines_cleared[container.size]++;
-        return_value.statistics.total_lines_cleared += container.size;
-    }
+void run_engine_level_benchmark(void)
+{
+    // 每一级都玩同样的 BENCHMARK_ENGINE_GAMES 局（规则与自我对弈相同），记下每步决策的耗时和每局的得分。
+    // 按耗时挑级别时看 p99：服务器上一个核能带多少局，取决于最慢的那些步。
+    const char *const level_names[ENGINE_LEVEL_COUNT] = {"landing", "row features", "greedy", "depth 2", "depth 3"};
+    const double ticks_per_microsecond = deadline__ticks_per_second() / 1e6;
+
+    long long *latencies = malloc((size_t) BENCHMARK_ENGINE_GAMES * BENCHMARK_ENGINE_MAX_PIECES * sizeof latencies[0]);
+    assert(latencies != NULL);
+
+    printf("%d games x up to %d pieces per level\n", BENCHMARK_ENGINE_GAMES, BENCHMARK_ENGINE_MAX_PIECES);
+    printf("%-16s%12s%12s%12s%14s%14s%10s\n", "level", "mean us", "p50 us", "p99 us", "decisions/s", "mean score", "survived");
+
+    for (int level = 0; level < ENGINE_LEVEL_COUNT; ++level) {
+        long long decisions = 0;
+        long long total_ticks = 0;
+        long long total_score = 0;
+        int survived = 0;
+
+        for (int game_index = 0; game_index < BENCHMARK_ENGINE_GAMES; ++game_index) {
+            piece_generator_s generator = piece_generator_make(PIECE_RANDOMIZER_UNIFORM, piece_generator__hash(BENCHMARK_SEED, game_index));
+            const char first = piece_generator_next(&generator);
+            const char second = piece_generator_next(&generator);
+            game_state_s game = game_state_make(grid_make_blank(), first, second, false, statistics_make_blank());
+
+            while (game.statistics.placed_blocks < BENCHMARK_ENGINE_MAX_PIECES && game_state_has_valid_move(&game)) {
+                LARGE_INTEGER begin;
+                LARGE_INTEGER end;
+                QueryPerformanceCounter(&begin);
+                const operation_s operation = game_state_make_decision_at_level(&game, level);
+                QueryPerformanceCounter(&end);
+
+                latencies[decisions++] = end.QuadPart - begin.QuadPart;
+                total_ticks += end.QuadPart - begin.QuadPart;
+
+                game = game_state_the_next_state_with_no_next_tetris(&game, operation);
+
+                if (game_state_is_deadline_touched(&game)) {
+                    break;
+                }
 
-    // 5. falling_tetris = next_tetris
-    return_value.falling_tetris = game_state->next_tetris;
+                game = game_state_with_next_tetris_filled_in(&game, piece_generator_next(&generator));
+            }
 
-    // 6. next_tetris = ""
-    // 假定下次调用此方法之前会调用 fill_in_the_next_tetris() 方法
-    return_value.next_tetris = '?';
+            total_score += game.statistics.score;
+            survived += game.statistics.placed_blocks == BENCHMARK_ENGINE_MAX_PIECES;
+        }
 
-    // 7. 返回已修改的副本
-    return return_value;
+        qsort(latencies, (size_t) decisions, sizeof latencies[0], benchmark__compare_ticks);
+        const double mean_us = total_ticks / ticks_per_microsecond / decisions;
+
+        printf(
+            "%d %-14s%12.1f%12.1f%12.1f%14.0f%14.0f%7d/%d\n",
+            level, level_names[level], mean_us, latencies[decisions / 2] / ticks_per_microsecond,
+            latencies[decisions * 99 / 100] / ticks_per_microsecond, 1e6 / mean_us,
+            (double) total_score / BENCHMARK_ENGINE_GAMES, survived, BENCHMARK_ENGINE_GAMES
+        );
+        fflush(stdout);
+    }
+
+    free(latencies);
 }
 
 
-int game_state__calculate_i_pos(const game_state_s *game_state, operation_s operation)
+int benchmark__compare_ticks(const void *a, const void *b)
 {
-    const int rotation = operation.rotation;
-    const int j_pos = operation.j_pos;
-
-    const shape_s shape = tetris_shapes[(unsigned char) game_state->falling_tetris][rotation];
+    const long long x = *(const long long *) a;
+    const long long y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
 
-    for (int i_pos = TETRIS_GRID_I_LIM - 1; i_pos >= 0; --i_pos) {
-        // 尝试一个坐标 ((i_pos, j_pos) 组合)
-        bool can_place = true;
 
-        for (int rel_i = 0; rel_i < shape_get_i_lim(&shape); ++rel_i) {
+void run_generate_pieces(void)
+{
+#if GENERATE_PIECES_RANDOMIZER == PIECE_RANDOMIZER_REPLAY
+    piece_generator_s generator = piece_generator_make_replay(GENERATE_PIECES_REPLAY_FILE);
+#else
+    piece_generator_s generator = piece_generator_make(GENERATE_PIECES_RANDOMIZER, GENERATE_PIECES_SEED);
+#endif
+    piece_generator_seek(&generator, GENERATE_PIECES_START);
+    piece_generator_write_sequence(&generator, GENERATE_PIECES_LENGTH, stdout);
+    fflush(stdout);
+    piece_generator_free(&generator);
+}
 
-            for (int rel_j = 0; rel_j < shape_get_j_lim(&shape); ++rel_j) {
-                const int cell = shape_get_cell_hitbox_check(&shape, rel_i, rel_j);
+int run_self_test(void)
+{
+    self_test_s test = {.checks = 0, .failures = 0};
+
+    // 记录下来的走法是不打开 SURVIVAL_MODE 时的；打开以后评价函数多了危险程度一项，走法本来就不同，不比对
+#ifndef SURVIVAL_MODE
+    for (int g = 0; g < SELF_TEST_GOLDEN_COUNT; ++g) {
+        const self_test_golden_s *golden = &self_test_goldens[g];
+        int final_score = 0;
+        const uint64_t moves_hash = self_test__play_and_hash(golden->randomizer, golden->seed, golden->pieces, &final_score);
+
+        if (moves_hash != golden->moves_hash || final_score != golden->final_score) {
+            printf(
+                "golden %d: expected %016llx %d, got %016llx %d\n",
+                g, (unsigned long long) golden->moves_hash, golden->final_score, (unsigned long long) moves_hash, final_score
+            );
+        }
 
-                // 在这里修改了算法
-                if (cell == 0) {
-                    continue;
-                }
+        self_test_check(&test, moves_hash == golden->moves_hash && final_score == golden->final_score, "golden moves", g);
+    }
+#endif
 
-                const int abs_i = i_pos + rel_i;
-                const int abs_j = j_pos + rel_j;
+    for (long long case_index = 0; case_index < SELF_TEST_FUZZ_CASES; ++case_index) {
+        self_test__fuzz_one_case(&test, case_index);
+    }
 
-                // 出界
-                if (!(0 <= abs_i && abs_i < TETRIS_GRID_I_LIM && 0 <= abs_j && abs_j < TETRIS_GRID_J_LIM)) {
-                    can_place = false;
-                    goto end;
-                }
+    self_test__check_piece_generators(&test);
+    self_test__check_game_batch(&test);
 
-                // 位置被占
-                if (game_state->grid.content[abs_i][abs_j] == 1) {
-                    can_place = false;
-                    goto end;
-                }
+    printf("self test: %lld checks, %lld failures\n", test.checks, test.failures);
+    fflush(stdout);
+    return test.failures == 0 ? 0 : 1;
+}
 
-                // 上方被挡
-                bool any_value = false;
+TETRIS_API void tetris_initialize(void)
+{
+    // 动态库没有 main，查表和选内核要在这里做。重复调用没有害处。
+    row_features_table_initialize();
+    board_kernels_initialize();
+}
 
-                for (int abs_i_scan = 0; abs_i_scan < abs_i; ++abs_i_scan) {
 
-                    if (game_state->grid.content[abs_i_scan][abs_j] == 1) {
-                        any_value = true;
-                        break;
-                    }
-                }
+TETRIS_API int32_t tetris_make_decision(const uint8_t cells[], char falling_tetris, char next_tetris, int32_t operation[2])
+{
+    // 返回 0；无处可放时返回 -1，operation 不变
+    const game_state_s game = game_state_make(grid_make_from_cells(cells), falling_tetris, next_tetris, false, statistics_make_blank());
 
-                if (any_value) {
-                    can_place = false;
-                    goto end;
-                }
-            }
-        }
-    end:
-        // 现在就知道这个位置是否有效了
-        if (can_place) {
-            // 返回最矮的 i_pos
-            return i_pos;
-        }
+    if (!tetris_is_known(falling_tetris) || !game_state_has_valid_move(&game)) {
+        return -1;
     }
 
-    // 所有位置都无效
-    return -1;
+    const operation_s best = game_state_make_decision(&game);
+    operation[0] = best.rotation;
+    operation[1] = best.j_pos;
+    return 0;
 }
 
 
-operation_s game_state__calculate_best_move(const game_state_s *game_state)
+TETRIS_API int32_t tetris_make_decision_at_level(const uint8_t cells[], char falling_tetris, char next_tetris, int32_t level, int32_t operation[2])
 {
-    operation_s best_moves[40];
-    int best_moves_size = 0;
-    double best_evaluate_score = -INFINITY;
+    // 与 tetris_make_decision 相同，只是按 level 决策（见 ENGINE_LEVEL_*）；level 超出范围时也返回 -1
+    const game_state_s game = game_state_make(grid_make_from_cells(cells), falling_tetris, next_tetris, false, statistics_make_blank());
 
-    for (int rotation = 0; rotation < 4; ++rotation) {
+    if (!(0 <= level && level < ENGINE_LEVEL_COUNT) || !tetris_is_known(falling_tetris) || !game_state_has_valid_move(&game)) {
+        return -1;
+    }
 
-        for (int j_pos = 0; j_pos < 10; ++j_pos) {
-            const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+    const operation_s best = game_state_make_decision_at_level(&game, level);
+    operation[0] = best.rotation;
+    operation[1] = best.j_pos;
+    return 0;
+}
 
-            const int i_pos = game_state__calculate_i_pos(game_state, operation);
 
-            if (i_pos == -1) {
-                continue;
-            }
+TETRIS_API int32_t tetris_next_state(const uint8_t cells[], char falling_tetris, int32_t rotation, int32_t j_pos, uint8_t cells_out[], int32_t result[2])
+{
+    // result 是这一步的消行数与是否碰到死线。返回 0；这个摆法放不下时返回 -1，输出不变。
+    const game_state_s game = game_state_make(grid_make_from_cells(cells), falling_tetris, '?', false, statistics_make_blank());
+    const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+
+    if (!tetris_is_known(falling_tetris)
+        || !(0 <= rotation && rotation < TETRIS_MAX_ANGLE && 0 <= j_pos && j_pos < TETRIS_GRID_J_LIM)
+        || game_state__calculate_i_pos(&game, operation) == -1)
+    {
+        return -1;
+    }
 
-            const double evaluate_score = game_state__calculate_evaluate_score(game_state, rotation, j_pos, i_pos);
+    const game_state_s next = game_state_the_next_state_with_no_next_tetris(&game, operation);
+    grid_copy_to_cells(&next.grid, cells_out);
+    result[0] = next.statistics.total_lines_cleared;
+    result[1] = next.deadline_touched;
+    return 0;
+}
 
-            if (evaluate_score > best_evaluate_score) {
-                best_moves_size = 0;
-                best_moves[best_moves_size++] = operation;
-                best_evaluate_score = evaluate_score;
 
-            } else if (evaluate_score == best_evaluate_score) {
-                best_moves[best_moves_size++] = operation;
-            }
+TETRIS_API void tetris_evaluate_boards(int32_t count, const uint8_t cells[], const char falling_tetrises[], int32_t scores_x2[])
+{
+    // 第 k 个局面的 40 种摆法（rotation * 10 + j_pos）的评价值的两倍，放不下的记 INT32_MIN
+    for (int32_t k = 0; k < count; ++k) {
+        const grid_s grid = grid_make_from_cells(&cells[(size_t) k * TETRIS_GRID_I_LIM * TETRIS_GRID_J_LIM]);
+        const game_state_s game = game_state_make(grid, falling_tetrises[k], '?', false, statistics_make_blank());
+        int32_t *scores = &scores_x2[(size_t) k * TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+
+        for (int index = 0; index < TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM; ++index) {
+            const int rotation = index / TETRIS_GRID_J_LIM;
+            const int j_pos = index % TETRIS_GRID_J_LIM;
+            const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+            const int i_pos = tetris_is_known(game.falling_tetris) ? game_state__calculate_i_pos(&game, operation) : -1;
+
+            scores[index] = i_pos == -1 ? INT32_MIN : game_state__calculate_evaluate_score_x2(&game, rotation, j_pos, i_pos);
         }
     }
+}
+
+
+TETRIS_API int32_t tetris_play_sequence(int32_t piece_count, const char pieces[], int32_t operations[], int32_t scores[])
+{
+    // 与 run_ai_whole_sequence 相同：已知整个序列（可以以 X 结尾），贪心地走完。
+    // operations 是 [步数][2]，scores 是每一步之后的分数，都至少要有 piece_count - 1 项。返回步数。
+    if (piece_count < 2 || !tetris_is_known(pieces[0])) {
+        return 0;
+    }
 
-    assert(best_moves_size > 0);
+    game_state_s game = game_state_make(grid_make_blank(), pieces[0], pieces[1], false, statistics_make_blank());
+    int32_t step = 0;
 
-    // 如果不同摆法存在相同的最高评价值，就再按优先级（priority）分出高低。
-    // 第一档：优先靠墙。目标位置的横坐标偏离入场位置的程度越大，就越优先，每格记 100 分。
-    // 第二档：优先向左。如果第一档同分，就取向左移的摆法，“居左”这一状态记 10 分。
-    // 第三档：优先少转。如果前两档同分，就取旋转次数最少的摆法，每次旋转多扣 1 分。
-    // 第三档意义不明，所以直接忽略。
-    double best_score_for_priority = -INFINITY;
-    operation_s best_operation_by_priority;
+    while (game_state_has_valid_move(&game)) {
+        const operation_s operation = game_state_make_decision(&game);
+        game = game_state_the_next_state_with_no_next_tetris(&game, operation);
 
-    for (int i = 0; i < best_moves_size; ++i) {
-        const operation_s operation = best_moves[i];
-        //const int rotation = operation.rotation;
-        const int j_pos = operation.j_pos;
-        //const shape_s shape = tetris_shapes[(unsigned char) game_state->falling_tetris][rotation];
-        // 这里更改了公式
-        const int priority = 100 * fabs((j_pos) - 4.5) + 10 * (9 - j_pos);
+        operations[2 * step] = operation.rotation;
+        operations[2 * step + 1] = operation.j_pos;
+        scores[step] = game.statistics.score;
+        ++step;
 
-        if (priority > best_score_for_priority) {
-            best_score_for_priority = priority;
-            best_operation_by_priority = operation;
+        if (game.falling_tetris == 'X' || step + 1 >= piece_count) {
+            break;
         }
+
+        game = game_state_with_next_tetris_filled_in(&game, pieces[step + 1]);
     }
 
-    assert(best_score_for_priority > -INFINITY);
-    return best_operation_by_priority;
+    return step;
 }
 
 
-double game_state__calculate_evaluate_score(const game_state_s *game_state, int rotation, int j_pos, int i_pos)
+TETRIS_API void tetris_play_games(int32_t count, const uint64_t seeds[], int32_t randomizer, int32_t max_pieces, int32_t results[])
 {
-    // 评估得分。
+    // 与 run_self_play 相同的规则玩 count 局，第 k 局用 seeds[k] 生成方块。BATCH_LANES 局同时玩，见 game_batch_s。
+    // results 是 [count][3]：最终得分、放置的方块数、总消行数。
+    game_batch_s *batch = game_batch_make(randomizer, seeds, count, max_pieces);
+    game_batch_run(batch);
+
+    for (int32_t k = 0; k < count; ++k) {
+        results[3 * k] = batch->results[k].score;
+        results[3 * k + 1] = batch->results[k].placed_blocks;
+        results[3 * k + 2] = batch->results[k].total_lines_cleared;
+    }
 
-    // 公式：评价 = −4∗洞数 − 累计井数 − 行转变数 − 列转变数 − 方块着陆高度 + 侵蚀格数
-    // 洞（Hole）：洞是正上方存在砖格的空格
-    // 井（Well）：左右两侧都是砖格或墙壁的空格
-    // 行转变数（Row Transition）：一行中砖格和空格交替出现，交替了几次。墙和砖格等效。
-    // 列转变数（Column Transition）：一列中砖格和空格交替出现，交替了几次。墙和砖格等效。
-    // 方块着陆高度（Landing Height）：列高 + 块高/2。但如果触发消行，则是取消行后的结果。
-    // 侵蚀格数（Number of Eroded Cells）：当前方块的消行数乘以填入被消行的方格数
+    game_batch_free(batch);
+}
 
-    // 参考资料：
-    // 方块 AI 算法历史 (1996–2013) https://tetris.huijiwiki.com/wiki/%E6%96%B9%E5%9D%97_AI_%E7%AE%97%E6%B3%95%E5%8E%86%E5%8F%B2_(1996%E2%80%932013)
-    // Tetris AI (单块, Pierre Dellacherie, 2003) https://tetris.huijiwiki.com/wiki/Tetris_AI_(%E5%8D%95%E5%9D%97,_Pierre_Dellacherie,_2003)
+bool tetris_is_known(char tetris)
+{
+    // tetris_shapes 里没有填的字符，形状是全 0
+    return shape_get_i_lim(&tetris_shapes[(unsigned char) tetris][0]) > 0;
+}
 
-    const shape_s shape = tetris_shapes[(unsigned char) game_state->falling_tetris][rotation];
 
-    const grid_s new_grid = grid_with_a_tetris_placed(&game_state->grid, game_state->falling_tetris, rotation, j_pos, i_pos);
-    const full_rows_index_container_s container = grid_all_full_rows(&new_grid);
-    grid_s new_grid_with_full_rows_cleared = new_grid;
+int bits_count(uint32_t bits)
+{
+    // 不用编译器内建函数，MSVC 和 GCC 都能编译
+    bits = bits - ((bits >> 1) & 0x55555555u);
+    bits = (bits & 0x33333333u) + ((bits >> 2) & 0x33333333u);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0Fu;
+    return (int) ((bits * 0x01010101u) >> 24);
+}
+
+
+int bits_count_trailing_zeros(uint32_t bits)
+{
+    // 最低的 1 以下全变成 1，再数个数
+    return bits == 0 ? 32 : bits_count((bits & (0u - bits)) - 1);
+}
+
+
+
+//////////////// 类成员函数实现
+
+
+int shape_get_i_lim(const shape_s *shape)
+{
+    return shape->i_lim;
+}
+
+
+int shape_get_j_lim(const shape_s *shape)
+{
+    return shape->j_lim;
+}
+
+
+int shape_get_cell_hitbox_check(const shape_s *shape, int i, int j)
+{
+    assert(0 <= i && i < shape->i_lim);
+    assert(0 <= j && j < shape->j_lim);
+    return shape->content[i][j];
+}
+
+
+int shape_get_cell_not_hitbox_check(const shape_s *shape, int i, int j)
+{
+    assert(0 <= i && i < TETRIS_SHAPE_I_LIM);
+    assert(0 <= j && j < TETRIS_SHAPE_J_LIM);
+    return shape->content[i][j];
+}
+
+
+statistics_s statistics_make_blank()
+{
+    return (statistics_s) {
+        .placed_blocks       = 0,
+        .score               = 0,
+        .total_lines_cleared = 0,
+        .lines_cleared       = {0, 0, 0, 0, 0},
+    };
+}
+
+
+void statistics_print_out(const statistics_s *statistics)
+{
+    printf("statistics:\n");
+    printf("- score: %d\n", statistics->score);
+    printf("- placed_blocks: %d\n", statistics->placed_blocks);
+    printf("- cleared_lines:\n");
+
+    for (int i = 1; i < 5; ++i) {
+        printf("  - %d lines: %d\n", i, statistics->lines_cleared[i]);
+    }
+}
+
+
+grid_s grid_make_blank()
+{
+    grid_s grid;
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+
+        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+            grid.content[i][j] = 0;
+        }
+    }
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        grid.column_holes[j] = 0;
+        grid.column_tops[j] = TETRIS_GRID_I_LIM;
+    }
+    grid.surface_signature = 0;
+
+    return grid;
+}
+
+
+grid_s grid_make_from_cells(const uint8_t cells[TETRIS_GRID_I_LIM * TETRIS_GRID_J_LIM])
+{
+    grid_s grid;
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+
+        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+            grid.content[i][j] = cells[i * TETRIS_GRID_J_LIM + j] != 0;
+        }
+    }
+    grid__rebuild_index(&grid);
+
+    return grid;
+}
+
+
+void grid_copy_to_cells(const grid_s *grid, uint8_t cells[TETRIS_GRID_I_LIM * TETRIS_GRID_J_LIM])
+{
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+
+        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+            cells[i * TETRIS_GRID_J_LIM + j] = (uint8_t) grid->content[i][j];
+        }
+    }
+}
+
+
+grid_s grid_with_a_tetris_placed(const grid_s *grid, char tetris, int rotation, int j_pos, int i_pos)
+{
+    grid_s new_grid = *grid;
+    const shape_s shape = tetris_shapes[(unsigned char) tetris][rotation];
+    uint32_t column_bits_placed[TETRIS_SHAPE_J_LIM] = {0, 0, 0, 0};
+
+    for (int i = 0; i < shape_get_i_lim(&shape); ++i) {
+
+        for (int j = 0; j < shape_get_j_lim(&shape); ++j) {
+            const int abs_i = i_pos + i;
+            const int abs_j = j_pos + j;
+
+            assert(0 <= abs_i && abs_i < TETRIS_GRID_I_LIM);
+            assert(0 <= abs_j && abs_j < TETRIS_GRID_J_LIM);
+
+            if (shape_get_cell_hitbox_check(&shape, i, j) == 0) {
+                continue;
+            }
+
+            assert(new_grid.content[abs_i][abs_j] == 0);
+            new_grid.content[abs_i][abs_j] = 1;
+            column_bits_placed[j] |= 1u << abs_i;
+        }
+    }
+
+    // 索引只需更新方块占到的几列
+    for (int j = 0; j < shape_get_j_lim(&shape); ++j) {
+        grid__set_column_bits(&new_grid, j_pos + j, grid_get_column_bits(&new_grid, j_pos + j) | column_bits_placed[j]);
+    }
+    grid__update_surface_signature(&new_grid);
+
+    return new_grid;
+}
+
+
+full_rows_index_container_s grid_all_full_rows(const grid_s *grid)
+{
+    return board_kernels->full_rows(grid);
+}
+
+
+void grid_print_out(const grid_s *grid)
+{
+    printf("     0 1 2 3 4 5 6 7 8 9\n");
+    printf("   +--------------------+\n");
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+        printf("%2d |", i);
+
+        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+            printf("%s", grid->content[i][j] == 1 ? "[]" : "  ");
+        }
+        printf("|\n");
+    }
+    printf("   +--------------------+\n");
+}
+
+
+bool grid_is_deadline_touched(const grid_s *grid)
+{
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+
+        if (grid_get_column_bits(grid, j) & (1u << TETRIS_DEADLINE_ROW)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+bool grid_is_row_empty(const grid_s *grid, int i)
+{
+    return grid_get_row_bits(grid, i) == 0;
+}
+
+
+int grid_get_top_occupied_row(const grid_s *grid)
+{
+    int top_row = TETRIS_GRID_I_LIM;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        top_row = grid->column_tops[j] < top_row ? grid->column_tops[j] : top_row;
+    }
+
+    return top_row;
+}
+
+
+grid_s grid_with_garbage_rows_inserted(const grid_s *grid, int count, int hole_j)
+{
+    assert(0 <= count && count <= TETRIS_GRID_I_LIM);
+    assert(0 <= hole_j && hole_j < TETRIS_GRID_J_LIM);
+
+    // 原有的格子整体上移 count 行，最上面 count 行被挤掉（调用者应先检查它们是否为空），
+    // 底下补上 count 行只在 hole_j 列有缺口的垃圾行
+    grid_s return_value;
+    memcpy(
+        &return_value.content[0][0],
+        &grid->content[count][0],
+        (TETRIS_GRID_I_LIM - count) * sizeof grid->content[0]
+    );
+
+    for (int i = TETRIS_GRID_I_LIM - count; i < TETRIS_GRID_I_LIM; ++i) {
+
+        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+            return_value.content[i][j] = j != hole_j;
+        }
+    }
+
+    // 每列的位整体右移 count 位，再从底下补上垃圾行
+    const uint32_t garbage_bits = GRID_COLUMN_MASK & ~(GRID_COLUMN_MASK >> count);
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        const uint32_t bits = grid_get_column_bits(grid, j) >> count;
+        grid__set_column_bits(&return_value, j, j != hole_j ? bits | garbage_bits : bits);
+    }
+    grid__update_surface_signature(&return_value);
+
+    return return_value;
+}
+
+
+int grid_get_with_default(const grid_s *grid, int i, int j, int default_value)
+{
+    if (0 <= i && i < TETRIS_GRID_I_LIM && 0 <= j && j < TETRIS_GRID_J_LIM) {
+        return grid->content[i][j];
+    }
+
+    return default_value;
+}
+
+
+uint16_t grid_get_row_bits(const grid_s *grid, int i)
+{
+    assert(0 <= i && i < TETRIS_GRID_I_LIM);
+    uint16_t bits = 0;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        bits |= (uint16_t) (grid->content[i][j] << j);
+    }
+
+    return bits;
+}
+
+
+void grid_set_row_bits(grid_s *grid, int i, uint16_t bits)
+{
+    assert(0 <= i && i < TETRIS_GRID_I_LIM);
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        grid->content[i][j] = (bits >> j) & 1;
+
+        const uint32_t column_bits = grid_get_column_bits(grid, j);
+        grid__set_column_bits(grid, j, (bits >> j) & 1 ? column_bits | (1u << i) : column_bits & ~(1u << i));
+    }
+    grid__update_surface_signature(grid);
+}
+
+
+grid_s grid_with_full_rows_cleared(const grid_s *grid, const full_rows_index_container_s *container)
+{
+    grid_s return_value = *grid;
 
-    // 清除已满的行。
     // 如果不想再去更改已满行的索引，清除满行时应从上到下。
+    for (int k = 0; k < container->size; ++k) {
+        const int index = container->indices[k];
 
-    for (int i = 0; i < container.size; ++i) {
         memmove(
-            &new_grid_with_full_rows_cleared.content[1][0],
-            &new_grid_with_full_rows_cleared.content[0][0],
-            container.indices[i] * sizeof new_grid_with_full_rows_cleared.content[0]
+            &return_value.content[1][0],
+            &return_value.content[0][0],
+            index * sizeof return_value.content[0]
         );
-        memset(&new_grid_with_full_rows_cleared.content[0][0], 0, sizeof new_grid_with_full_rows_cleared.content[0]);
+        memset(&return_value.content[0][0], 0, sizeof return_value.content[0]);
+
+        // 每列去掉第 index 位，它上面的位往下挪一位
+        const uint32_t above_mask = (1u << index) - 1;
+
+        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+            const uint32_t bits = grid_get_column_bits(&return_value, j);
+            grid__set_column_bits(&return_value, j, (bits & ~(above_mask | (1u << index))) | ((bits & above_mask) << 1));
+        }
     }
 
-    // 洞
-    int hole = 0;
-    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+    if (container->size > 0) {
+        grid__update_surface_signature(&return_value);
+    }
+
+    return return_value;
+}
+
+
+uint32_t grid_get_column_bits(const grid_s *grid, int j)
+{
+    // 最高砖格及以下的格子，去掉洞，就是这一列的砖格
+    return (GRID_COLUMN_MASK & ~((1u << grid->column_tops[j]) - 1)) & ~grid->column_holes[j];
+}
+
+
+int grid_count_holes(const grid_s *grid)
+{
+    int hole = 0;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        hole += bits_count(grid->column_holes[j]);
+    }
+
+    return hole;
+}
+
+
+int grid_count_col_transitions(const grid_s *grid)
+{
+    int col_transition = 0;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        // 上下各补一格墙（第 0 位和第 TETRIS_GRID_I_LIM + 1 位），相邻两位不同就是一次转变
+        const uint32_t bits = 1u | (grid_get_column_bits(grid, j) << 1) | (1u << (TETRIS_GRID_I_LIM + 1));
+        col_transition += bits_count((bits ^ (bits >> 1)) & ((1u << (TETRIS_GRID_I_LIM + 1)) - 1));
+    }
+
+    return col_transition;
+}
+
+
+void grid__set_column_bits(grid_s *grid, int j, uint32_t bits)
+{
+    assert((bits & ~GRID_COLUMN_MASK) == 0);
+
+    const int top = bits == 0 ? TETRIS_GRID_I_LIM : bits_count_trailing_zeros(bits);
+    grid->column_tops[j] = top;
+    grid->column_holes[j] = (GRID_COLUMN_MASK & ~((1u << top) - 1)) & ~bits;
+}
+
+
+void grid__update_surface_signature(grid_s *grid)
+{
+    int lowest_height = TETRIS_GRID_I_LIM;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        const int height = TETRIS_GRID_I_LIM - grid->column_tops[j];
+        lowest_height = height < lowest_height ? height : lowest_height;
+    }
+
+    uint64_t signature = 0;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        const int height = TETRIS_GRID_I_LIM - grid->column_tops[j];
+        signature = (signature << 5) | (uint64_t) (height - lowest_height);
+    }
+
+    grid->surface_signature = signature;
+}
+
+
+void grid__rebuild_index(grid_s *grid)
+{
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        uint32_t bits = 0;
+
+        for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+            bits |= (uint32_t) grid->content[i][j] << i;
+        }
+
+        grid__set_column_bits(grid, j, bits);
+    }
+
+    grid__update_surface_signature(grid);
+}
+
+
+void operation_print_out(const operation_s *operation)
+{
+    printf("operation: rotation=%d, j_pos=%d\n", operation->rotation, operation->j_pos);
+}
+
+
+int operation_get_priority(const operation_s *operation)
+{
+    // 见 game_state__calculate_best_move_with_candidates 里的说明。
+    // 原公式是 100 * fabs(j_pos - 4.5) + 10 * (9 - j_pos)，其中 100 * |j_pos - 4.5| = 50 * |2 * j_pos - 9| 总是整数。
+    const int j_pos = operation->j_pos;
+    return 50 * abs(2 * j_pos - 9) + 10 * (9 - j_pos);
+}
+
+
+int64_t operation_make_selection_key(const operation_s *operation, int evaluate_score_x2)
+{
+    // 把“评价值、优先级、少转”三档比较压进一个整数，键越大越好：
+    //   评价值 × 2 | 优先级（< 1024） | 3 - rotation | rotation * 10 + j_pos
+    // 同一个 j_pos 的优先级相同，这时按原来的循环顺序取先出现的，也就是 rotation 小的。
+    // 最低 6 位只用来找回是哪个摆法，前面几档已经两两不同，不会影响大小关系。
+    const int64_t score_x2 = evaluate_score_x2;
+    const int priority = operation_get_priority(operation);
+    const int index = operation->rotation * TETRIS_GRID_J_LIM + operation->j_pos;
+
+    return ((score_x2 * 1024 + priority) * 4 + (3 - operation->rotation)) * 64 + index;
+}
+
+
+operation_s operation_from_selection_key(int64_t key)
+{
+    const int index = (int) ((uint64_t) key & 63);
+    return (operation_s) { .rotation = index / TETRIS_GRID_J_LIM, .j_pos = index % TETRIS_GRID_J_LIM };
+}
+
+
+int evaluate_features_to_score_x2(const evaluate_features_s *features)
+{
+    const evaluate_weights_s weights = evaluate_weights_make_default();
+    return evaluate_weights_apply_x2(&weights, features);
+}
+
+
+evaluate_weights_s evaluate_weights_make_default(void)
+{
+    evaluate_weights_s return_value = {
+        .hole = HOLE_WEIGHT,
+        .well = WELL_WEIGHT,
+        .row_transition = ROW_TRANSITION_WEIGHT,
+        .col_transition = COL_TRANSITION_WEIGHT,
+        .landing_height = LANDING_HEIGHT_WEIGHT,
+        .eroded_cells = ERODED_CELLS_WEIGHT,
+        .danger = DANGER_WEIGHT,
+    };
+    return return_value;
+}
+
+
+evaluate_weights_s evaluate_weights_make_safe(void)
+{
+    evaluate_weights_s return_value = evaluate_weights_make_default();
+    return_value.landing_height = SURVIVAL_SAFE_LANDING_HEIGHT_WEIGHT;
+    return_value.danger = SURVIVAL_SAFE_DANGER_WEIGHT;
+    return return_value;
+}
+
+
+int evaluate_weights_apply_x2(const evaluate_weights_s *weights, const evaluate_features_s *features)
+{
+    // 权重都是整数，除着陆高度外的各项乘 2 即可，结果与原来用 double 算出的评价值的两倍完全相同。
+    return
+        2 * weights->hole * features->hole
+        + 2 * weights->well * features->well
+        + 2 * weights->row_transition * features->row_transition
+        + 2 * weights->col_transition * features->col_transition
+        + weights->landing_height * features->landing_height_x2
+        + 2 * weights->eroded_cells * features->eroded_cells
+        + 2 * weights->danger * features->danger;
+}
+
+
+deadline_s deadline_make_after_microseconds(long long microseconds)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    return (deadline_s) {
+        .end_ticks = now.QuadPart + microseconds * deadline__ticks_per_second() / 1000000,
+        .expired   = false,
+    };
+}
+
+
+deadline_s deadline_make_never(void)
+{
+    return (deadline_s) {
+        .end_ticks = INT64_MAX,
+        .expired   = false,
+    };
+}
+
+
+bool deadline_is_expired(deadline_s *deadline)
+{
+    // QueryPerformanceCounter 只要几十纳秒，比一次评价函数便宜得多，所以每个候选都查一次。
+    if (!deadline->expired) {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        deadline->expired = now.QuadPart >= deadline->end_ticks;
+    }
+
+    return deadline->expired;
+}
+
+
+long long deadline__ticks_per_second(void)
+{
+    static long long ticks_per_second = 0;
+
+    if (ticks_per_second == 0) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        ticks_per_second = frequency.QuadPart;
+    }
+
+    return ticks_per_second;
+}
+
+
+void anytime_report_print_out(const anytime_report_s *report)
+{
+    printf("anytime: depth=%d, evaluated=%lld, elapsed=%lldus\n", report->completed_depth, report->evaluated_candidates, report->elapsed_microseconds);
+}
+
+
+game_state_s game_state_make(grid_s grid, char falling_tetris, char next_tetris, bool deadline_touched, statistics_s statistics)
+{
+    return (game_state_s) {
+        .grid             = grid,
+        .falling_tetris   = falling_tetris,
+        .next_tetris      = next_tetris,
+        .hold_tetris      = HOLD_EMPTY,
+        .deadline_touched = deadline_touched,
+        .statistics       = statistics
+    };
+}
+
+
+game_state_s game_state_with_next_tetris_filled_in(const game_state_s *game_state, char next_tetris)
+{
+    assert(game_state->next_tetris == '?');
+    game_state_s return_value = *game_state;
+
+    // 只有暂存是空时做了交换才会这样，见 game_state__with_hold_swapped
+    if (game_state->falling_tetris == '?') {
+        return_value.falling_tetris = next_tetris;
+    } else {
+        return_value.next_tetris = next_tetris;
+    }
+
+    return return_value;
+}
+
+
+void game_state_print_grid(const game_state_s *game_state)
+{
+    grid_print_out(&game_state->grid);
+}
+
+
+void game_state_print_statistics(const game_state_s *game_state)
+{
+    statistics_print_out(&game_state->statistics);
+}
+
+
+bool game_state_is_deadline_touched(const game_state_s *game_state)
+{
+    return game_state->deadline_touched;
+}
+
+
+operation_s game_state_make_decision(const game_state_s *game_state)
+{
+    return game_state__calculate_best_move(game_state);
+}
+
+
+operation_s game_state_make_decision_survival(const game_state_s *game_state)
+{
+    // 堆得很高时不再往后搜，只用更看重高度的权重做一次贪心：省下的时间也没什么用，先活下来要紧。
+    // 特征用 grid_feature_cache_s 增量地算，结果与完整的评价函数相同，但比平时的贪心还便宜。
+    if (grid_get_top_occupied_row(&game_state->grid) <= SURVIVAL_SAFE_POLICY_ROW) {
+        const grid_feature_cache_s cache = grid_feature_cache_make(&game_state->grid);
+        const evaluate_weights_s weights = evaluate_weights_make_safe();
+        const int64_t best_key = game_state__calculate_best_selection_key_cached(game_state, &cache, &weights);
+        assert(best_key != OPERATION_INVALID_SELECTION_KEY);
+        return operation_from_selection_key(best_key);
+    }
+
+#ifdef ANYTIME_DECISION
+    anytime_report_s report;
+    return game_state_make_decision_anytime(game_state, ANYTIME_BUDGET_MICROSECONDS, &report);
+#else
+    return game_state_make_decision(game_state);
+#endif /* ANYTIME_DECISION */
+}
+
+
+operation_s game_state_make_decision_cached(const game_state_s *game_state, move_cache_s *cache)
+{
+    const uint64_t key = move_cache__key_of(game_state);
+    operation_s operation;
+
+    if (key != 0 && move_cache_lookup(cache, key, &operation) && game_state__calculate_i_pos(game_state, operation) != -1) {
+        cache->hits++;
+
+#ifdef MOVE_CACHE_VALIDATION
+        // 只统计，不纠正：打开抽查不改变 AI 的走法
+        if (cache->hits % MOVE_CACHE_VALIDATION_PERIOD == 0) {
+            const operation_s calculated = game_state_make_decision(game_state);
+            cache->validations++;
+
+            if (calculated.rotation != operation.rotation || calculated.j_pos != operation.j_pos) {
+                cache->validation_mismatches++;
+            }
+        }
+#endif /* MOVE_CACHE_VALIDATION */
+
+        return operation;
+    }
+
+    cache->misses++;
+    operation = game_state_make_decision(game_state);
+
+    if (key != 0) {
+        move_cache_insert(cache, key, operation);
+    }
+
+    return operation;
+}
+
+
+bool game_state_has_valid_move(const game_state_s *game_state)
+{
+    for (int rotation = 0; rotation < 4; ++rotation) {
+
+        for (int j_pos = 0; j_pos < 10; ++j_pos) {
+            const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+
+            if (game_state__calculate_i_pos(game_state, operation) != -1) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+game_state_s game_state_the_next_state_with_no_next_tetris(const game_state_s *game_state, operation_s operation)
+{
+    // 先交换，再当作没有暂存来放
+    if (operation.hold) {
+        const game_state_s swapped = game_state__with_hold_swapped(game_state);
+        operation.hold = false;
+        return game_state_the_next_state_with_no_next_tetris(&swapped, operation);
+    }
+
+    const int rotation = operation.rotation;
+    const int j_pos = operation.j_pos;
+
+    // 0. 创建一个副本，并开始修改它
+    game_state_s return_value = *game_state;
+    const int i_pos = game_state__calculate_i_pos(&return_value, operation);
+
+    // 1. 更新网格（将下落的方块放入格子中）
+    return_value.grid = grid_with_a_tetris_placed(&return_value.grid, game_state->falling_tetris, rotation, j_pos, i_pos);
+
+    // debug
+    //printf("######################\n");
+    //grid_print_out(&return_value.grid);
+
+    // 2. 更新网格（清除已满的行）
+    const full_rows_index_container_s container = grid_all_full_rows(&return_value.grid);
+    return_value.grid = grid_with_full_rows_cleared(&return_value.grid, &container);
+
+    // debug
+    //printf("!!!!!!!!!!!!!!!!!!!!!!!\n");
+    //grid_print_out(&return_value.grid);
+
+    // 3. (有可能) deadline_touched = True
+    // 看的是消行之后的新网格：放下以后能消掉的方块不算碰到死线。
+    if (grid_is_deadline_touched(&return_value.grid)) {
+        return_value.deadline_touched = true;
+    }
+
+    // 4. 更新数据
+    return_value.statistics.placed_blocks++;
+
+    if (container.size > 0) {
+        return_value.statistics.score += scores_of_line_cleared[container.size];
+        return_value.statistics.lines_cleared[container.size]++;
+        return_value.statistics.total_lines_cleared += container.size;
+    }
+
+    // 5. falling_tetris = next_tetris
+    return_value.falling_tetris = game_state->next_tetris;
+
+    // 6. next_tetris = ""
+    // 假定下次调用此方法之前会调用 fill_in_the_next_tetris() 方法
+    return_value.next_tetris = '?';
+
+    // 7. 返回已修改的副本
+    return return_value;
+}
+
+
+int game_state__calculate_i_pos(const game_state_s *game_state, operation_s operation)
+{
+    const int rotation = operation.rotation;
+    const int j_pos = operation.j_pos;
+
+    const shape_s shape = tetris_shapes[(unsigned char) game_state->falling_tetris][rotation];
+
+    // 方块每一列最低的格子必须在网格这一列最高的砖格之上（不能被上方挡住），
+    // 所以每列能允许的最低位置只看列高，取其中最高的就是方块落下的位置。
+    int i_pos = TETRIS_GRID_I_LIM - 1;
+
+    for (int rel_j = 0; rel_j < shape_get_j_lim(&shape); ++rel_j) {
+        const int abs_j = j_pos + rel_j;
+        int lowest_rel_i = -1;
+
+        for (int rel_i = 0; rel_i < shape_get_i_lim(&shape); ++rel_i) {
+
+            if (shape_get_cell_hitbox_check(&shape, rel_i, rel_j) != 0) {
+                lowest_rel_i = rel_i;
+            }
+        }
+
+        if (lowest_rel_i == -1) {
+            continue;
+        }
+
+        // 出界
+        if (!(0 <= abs_j && abs_j < TETRIS_GRID_J_LIM)) {
+            return -1;
+        }
+
+        const int highest_i_pos = game_state->grid.column_tops[abs_j] - 1 - lowest_rel_i;
+        i_pos = highest_i_pos < i_pos ? highest_i_pos : i_pos;
+    }
+
+    // 小于 0 就是所有位置都无效
+    return i_pos >= 0 ? i_pos : -1;
+}
+
+
+operation_s game_state__calculate_best_move(const game_state_s *game_state)
+{
+    candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+    return game_state__calculate_best_move_with_candidates(game_state, candidates);
+}
+
+
+operation_s game_state__calculate_best_move_with_candidates(const game_state_s *game_state, candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM])
+{
+    const evaluate_weights_s weights = evaluate_weights_make_default();
+    return game_state__calculate_best_move_with_weights(game_state, &weights, candidates);
+}
+
+
+operation_s game_state__calculate_best_move_with_weights(const game_state_s *game_state, const evaluate_weights_s *weights, candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM])
+{
+    // 顺便把每种摆法的特征留在 candidates 里，导出训练数据时就不用再算一遍了。
+    int64_t keys[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+
+    for (int rotation = 0; rotation < 4; ++rotation) {
+
+        for (int j_pos = 0; j_pos < 10; ++j_pos) {
+            const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+            const int index = rotation * TETRIS_GRID_J_LIM + j_pos;
+
+            const int i_pos = game_state__calculate_i_pos(game_state, operation);
+            candidate_s *candidate = &candidates[index];
+            candidate->i_pos = i_pos;
+
+            if (i_pos == -1) {
+                keys[index] = OPERATION_INVALID_SELECTION_KEY;
+                continue;
+            }
+
+            candidate->features = game_state__calculate_evaluate_features(game_state, rotation, j_pos, i_pos);
+            keys[index] = operation_make_selection_key(&operation, evaluate_weights_apply_x2(weights, &candidate->features));
+        }
+    }
+
+    // 如果不同摆法存在相同的最高评价值，就再按优先级（priority）分出高低。
+    // 第一档：优先靠墙。目标位置的横坐标偏离入场位置的程度越大，就越优先，每格记 100 分。
+    // 第二档：优先向左。如果第一档同分，就取向左移的摆法，“居左”这一状态记 10 分。
+    // 第三档：优先少转。如果前两档同分，就取旋转次数最少的摆法，每次旋转多扣 1 分。
+    // 第三档意义不明，所以直接忽略。
+    // 这几档都编进了选择键（见 operation_make_selection_key），所以取一次最大值就够了。
+    // 这个循环没有分支，编译器可以把它向量化。
+    int64_t best_key = OPERATION_INVALID_SELECTION_KEY;
+
+    for (int index = 0; index < TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM; ++index) {
+        best_key = keys[index] > best_key ? keys[index] : best_key;
+    }
+
+    assert(best_key != OPERATION_INVALID_SELECTION_KEY);
+    return operation_from_selection_key(best_key);
+}
+
+
+double game_state__calculate_evaluate_score(const game_state_s *game_state, int rotation, int j_pos, int i_pos)
+{
+    return game_state__calculate_evaluate_score_x2(game_state, rotation, j_pos, i_pos) / 2.0;
+}
+
+
+int game_state__calculate_evaluate_score_x2(const game_state_s *game_state, int rotation, int j_pos, int i_pos)
+{
+    const evaluate_features_s features = game_state__calculate_evaluate_features(game_state, rotation, j_pos, i_pos);
+    const int res = evaluate_features_to_score_x2(&features);
+
+#ifdef DEBUGGING_THE_EVALUATOR
+    printf("result of the evaluator: %lf\n", res / 2.0);
+#endif
+
+    return res;
+}
+
+
+evaluate_features_s game_state__calculate_evaluate_features(const game_state_s *game_state, int rotation, int j_pos, int i_pos)
+{
+    // 评估得分所需的各项特征。
+
+    // 公式：评价 = −4∗洞数 − 累计井数 − 行转变数 − 列转变数 − 方块着陆高度 + 侵蚀格数
+    // 洞（Hole）：洞是正上方存在砖格的空格
+    // 井（Well）：左右两侧都是砖格或墙壁的空格
+    // 行转变数（Row Transition）：一行中砖格和空格交替出现，交替了几次。墙和砖格等效。
+    // 列转变数（Column Transition）：一列中砖格和空格交替出现，交替了几次。墙和砖格等效。
+    // 方块着陆高度（Landing Height）：列高 + 块高/2。但如果触发消行，则是取消行后的结果。
+    // 侵蚀格数（Number of Eroded Cells）：当前方块的消行数乘以填入被消行的方格数
+
+    // 参考资料：
+    // 方块 AI 算法历史 (1996–2013) https://tetris.huijiwiki.com/wiki/%E6%96%B9%E5%9D%97_AI_%E7%AE%97%E6%B3%95%E5%8E%86%E5%8F%B2_(1996%E2%80%932013)
+    // Tetris AI (单块, Pierre Dellacherie, 2003) https://tetris.huijiwiki.com/wiki/Tetris_AI_(%E5%8D%95%E5%9D%97,_Pierre_Dellacherie,_2003)
+
+    const shape_s shape = tetris_shapes[(unsigned char) game_state->falling_tetris][rotation];
+
+    const grid_s new_grid = grid_with_a_tetris_placed(&game_state->grid, game_state->falling_tetris, rotation, j_pos, i_pos);
+    const full_rows_index_container_s container = grid_all_full_rows(&new_grid);
+    const grid_s new_grid_with_full_rows_cleared = grid_with_full_rows_cleared(&new_grid, &container);
+
+    // 洞、列转变数
+    const column_features_s column_features = board_kernels->column_features(&new_grid_with_full_rows_cleared);
+    const int hole = column_features.hole;
+    const int col_transition = column_features.col_transition;
+#ifdef DEBUGGING_THE_EVALUATOR
+    printf("hole: %d\n", hole);
+#endif
+
+    // 井、行转变数
+    // 都只取决于这一行本身，直接查表
+    int well = 0;
+    int row_transition = 0;
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+        const row_features_s *row_features = &row_features_table[grid_get_row_bits(&new_grid_with_full_rows_cleared, i)];
+        well += row_features->well;
+        row_transition += row_features->row_transition;
+    }
+#ifdef DEBUGGING_THE_EVALUATOR
+    printf("well: %d\n", well);
+    printf("row_transition: %d\n", row_transition);
+#endif
+
+#ifdef DEBUGGING_THE_EVALUATOR
+    printf("col_transition: %d\n", col_transition);
+#endif
+
+
+    // 着陆高度
+    // 存两倍的值：2 * (20 - (i_pos + 块高 / 2))
+    const int landing_height_x2 = 2 * 20 - (2 * i_pos + shape_get_i_lim(&shape));
+
+#ifdef DEBUGGING_THE_EVALUATOR
+    printf("landing_height: %lf\n", landing_height_x2 / 2.0);
+#endif
+
+    // 侵蚀格数
+    int eroded_cells = 0;
+
+    for (int rel_i = 0; rel_i < shape_get_i_lim(&shape); ++rel_i) {
+
+        for (int rel_j = 0; rel_j < shape_get_j_lim(&shape); ++rel_j) {
+            const int abs_i = i_pos + rel_i;
+
+            if (full_rows_index_container_contains(&container, abs_i)) {
+                ++eroded_cells;
+            }
+        }
+    }
+    eroded_cells *= container.size;
+#ifdef DEBUGGING_THE_EVALUATOR
+    printf("eroded_cells: %d\n", eroded_cells);
+#endif
+
+    // 危险程度
+    const int top_row = grid_get_top_occupied_row(&new_grid_with_full_rows_cleared);
+    const int danger = top_row < SURVIVAL_DANGER_ROW ? SURVIVAL_DANGER_ROW - top_row : 0;
+#ifdef DEBUGGING_THE_EVALUATOR
+    printf("danger: %d\n", danger);
+#endif
+
+    return (evaluate_features_s) {
+        .hole           = hole,
+        .well           = well,
+        .row_transition = row_transition,
+        .col_transition = col_transition,
+        .landing_height_x2 = landing_height_x2,
+        .eroded_cells   = eroded_cells,
+        .danger         = danger,
+    };
+}
+
+
+operation_s game_state_make_decision_anytime(const game_state_s *game_state, long long budget_microseconds, anytime_report_s *report)
+{
+    return game_state__make_decision_searching(game_state, deadline_make_after_microseconds(budget_microseconds), ANYTIME_MAX_DEPTH, report);
+}
+
+
+operation_s game_state__make_decision_searching(const game_state_s *game_state, deadline_s deadline, int max_depth, anytime_report_s *report)
+{
+    // 第 1 层（贪心）不受时限约束，因为总得给出一个操作；之后每一层都可能被时限打断，
+    // 被打断的那一层的结果全部作废，返回上一个完整搜完的深度的最优解。
+    // 竞技场（arena）装满也当作超时处理。
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    search_context_s context = {
+        .deadline  = deadline,
+        .arena     = arena_for_this_thread(),
+        .evaluated = 0,
+    };
+
+    // 根节点的子节点按贪心的优先顺序排好，第一个就是 game_state__calculate_best_move 的结果
+    search_node_s root = search_node_make_from_game_state(game_state);
+    const bool root_expanded = search_node__expand(&root, ANYTIME_ROOT_WIDTH, game_state->next_tetris, &context, NULL);
+    operation_s best_operation;
+    report->completed_depth = 1;
+
+    // 竞技场连根节点的子节点都装不下时没法往后搜，直接用贪心的结果
+    if (!root_expanded || root.child_count == 0) {
+        best_operation = game_state_make_decision(game_state);
+        goto out_of_time;
+    }
+
+    best_operation = search_node_get_move(&root.children[0]);
+
+    for (int depth = 2; depth <= max_depth; ++depth) {
+        operation_s depth_best_operation = best_operation;
+        double depth_best_value = -INFINITY;
+
+        for (int i = 0; i < root.child_count; ++i) {
+            search_node_s *child = &root.children[i];
+            double child_value;
+
+            if (!search_node__value(child, depth - 1, &context, &child_value)) {
+                goto out_of_time;
+            }
+
+            // 严格大于：同分时保留贪心顺序靠前的那个
+            if (child->move_score_x2 + child_value > depth_best_value) {
+                depth_best_value = child->move_score_x2 + child_value;
+                depth_best_operation = search_node_get_move(child);
+            }
+        }
+
+        best_operation = depth_best_operation;
+        report->completed_depth = depth;
+    }
+
+out_of_time:
+    arena_reset(context.arena);
+    report->evaluated_candidates = context.evaluated;
+
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+    report->elapsed_microseconds = (end.QuadPart - start.QuadPart) * 1000000 / deadline__ticks_per_second();
+
+    return best_operation;
+}
+
+
+int game_state__calculate_top_moves(const game_state_s *game_state, int width, operation_s moves[], int scores_x2[], deadline_s *deadline, long long *evaluated)
+{
+    // 按贪心的优先顺序取出前 width 个摆法：评价值高的在前；同分时按 game_state__calculate_best_move 的优先级。
+    // 返回取到的个数；deadline 不为 NULL 且已过期时返回 -1。
+    int count = 0;
+    int64_t keys[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+
+    for (int rotation = 0; rotation < 4; ++rotation) {
+
+        for (int j_pos = 0; j_pos < 10; ++j_pos) {
+
+            if (deadline != NULL && deadline_is_expired(deadline)) {
+                return -1;
+            }
+
+            const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+            const int i_pos = game_state__calculate_i_pos(game_state, operation);
+
+            if (i_pos == -1) {
+                continue;
+            }
+
+            const int score_x2 = game_state__calculate_evaluate_score_x2(game_state, rotation, j_pos, i_pos);
+            const int64_t key = operation_make_selection_key(&operation, score_x2);
+            ++*evaluated;
+
+            // 按选择键插入排序
+            int k = count < width ? count++ : width;
+
+            while (k > 0 && key > keys[k - 1]) {
+
+                if (k < width) {
+                    moves[k] = moves[k - 1];
+                    scores_x2[k] = scores_x2[k - 1];
+                    keys[k] = keys[k - 1];
+                }
+                --k;
+            }
+
+            if (k < width) {
+                moves[k] = operation;
+                scores_x2[k] = score_x2;
+                keys[k] = key;
+            }
+        }
+    }
+
+    return count;
+}
+
+
+void game_state_draw_the_falling_tetris(const game_state_s *game_state)
+{
+    const shape_s shape = tetris_shapes[(unsigned char) game_state->falling_tetris][0];
+    printf("       falling tetris\n");
+    printf("       +------------+\n");
+    printf("       |            |\n");
+
+    for (int i = 0; i < TETRIS_SHAPE_I_LIM; ++i) {
+
+        if (i < shape_get_i_lim(&shape)) {
+            // 打印一行
+            printf("       |  ");
+
+            for (int j = 0; j < TETRIS_SHAPE_J_LIM; ++j) {
+                printf("%s", shape_get_cell_not_hitbox_check(&shape, i, j) == 1 ? "[]" : "  ");
+            }
+            printf("  |\n");
+
+        } else {
+            // 打印空行
+            printf("       |            |\n");
+        }
+    }
+
+    printf("       |            |\n");
+    printf("       +------------+\n");
+}
+
+
+void game_state_static_test_evaluator(void)
+{
+    /*
+    const game_state_s game = {
+        .grid = {
+            .content = {
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {1, 0, 0, 0, 0, 0, 0, 0, 1, 0},
+                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
+                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
+            },
+        },
+        .falling_tetris   = 'I',
+        .next_tetris      = 'Z',
+        .deadline_touched = false,
+        .statistics       = {
+            .placed_blocks       = 5,
+            .score               = 0,
+            .total_lines_cleared = 0,
+            .lines_cleared       = {0, 0, 0, 0, 0},
+        },
+    };
+    */
+
+    // 造环境然后测试
+
+    game_state_s game = {
+        .grid = {
+            .content = {
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
+                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
+                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
+                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
+            },
+        },
+        .falling_tetris   = 'I',
+        .next_tetris      = 'J',
+        .deadline_touched = false,
+        .statistics       = {
+            .placed_blocks       = 233,
+            .score               = 0,
+            .total_lines_cleared = 0,
+            .lines_cleared       = {0, 0, 0, 0, 0},
+        },
+    };
+    grid__rebuild_index(&game.grid);
+
+    const int j_pos = 0;
+    const int i_pos = 16;
+    const int rotation = 1;
+
+    game_state__calculate_evaluate_score(&game, rotation, j_pos, i_pos);
+
+    grid_s grid = game.grid;
+    grid = grid_with_a_tetris_placed(&grid, game.falling_tetris, rotation, j_pos, i_pos);
+    grid_print_out(&grid);
+
+    return;
+}
+
+
+full_rows_index_container_s full_rows_index_container_make_blank()
+{
+    return (full_rows_index_container_s) { .indices = {0, 0, 0, 0}, .size = 0 };
+}
+
+
+full_rows_index_container_s full_rows_index_container_with_a_row_index_appended(const full_rows_index_container_s *container, int index)
+{
+    assert(0 <= index && index < TETRIS_GRID_I_LIM);
+    assert(0 <= container->size && container->size <= 3);
+
+    full_rows_index_container_s new_container = *container;
+
+    new_container.indices[new_container.size++] = index;
+
+    return new_container;
+}
+
+
+bool full_rows_index_container_contains(const full_rows_index_container_s *container, int index)
+{
+    for (int i = 0; i < container->size; ++i) {
+
+        if (container->indices[i] == index) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+training_data_exporter_s *training_data_exporter_open(const char *file_name)
+{
+    training_data_exporter_s *exporter = malloc(sizeof *exporter);
+    assert(exporter != NULL);
+
+    exporter->file = fopen(file_name, "wb");
+    assert(exporter->file != NULL);
+
+    for (int i = 0; i < 2; ++i) {
+        exporter->chunks[i] = malloc(sizeof *exporter->chunks[i]);
+        assert(exporter->chunks[i] != NULL);
+        exporter->chunks[i]->sample_count = 0;
+        exporter->chunks[i]->game_count = 0;
+    }
+
+    exporter->filling  = exporter->chunks[0];
+    exporter->pending  = NULL;
+    exporter->stopping = false;
+    exporter->game_id  = 0;
+    exporter->step     = 0;
+
+    InitializeCriticalSection(&exporter->lock);
+    InitializeConditionVariable(&exporter->pending_changed);
+    exporter->writer_thread = CreateThread(NULL, 0, training_data_exporter__writer_thread_main, exporter, 0, NULL);
+    assert(exporter->writer_thread != NULL);
+
+    return exporter;
+}
+
+
+void training_data_exporter_close(training_data_exporter_s *exporter)
+{
+    if (exporter->filling->sample_count > 0 || exporter->filling->game_count > 0) {
+        training_data_exporter__submit_filling_chunk(exporter);
+    }
+
+    EnterCriticalSection(&exporter->lock);
+    exporter->stopping = true;
+    WakeAllConditionVariable(&exporter->pending_changed);
+    LeaveCriticalSection(&exporter->lock);
+
+    WaitForSingleObject(exporter->writer_thread, INFINITE);
+    CloseHandle(exporter->writer_thread);
+    DeleteCriticalSection(&exporter->lock);
+
+    fclose(exporter->file);
+    free(exporter->chunks[0]);
+    free(exporter->chunks[1]);
+    free(exporter);
+}
+
+
+void training_data_exporter_record_decision(training_data_exporter_s *exporter, const game_state_s *game_state, const candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM], operation_s operation)
+{
+    training_data_chunk_s *chunk = exporter->filling;
+    const uint32_t n = chunk->sample_count;
+
+    chunk->sample_game_id[n] = exporter->game_id;
+    chunk->sample_step[n] = exporter->step++;
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+        chunk->board[n][i] = grid_get_row_bits(&game_state->grid, i);
+    }
+
+    chunk->falling_tetris[n] = (uint8_t) game_state->falling_tetris;
+    chunk->next_tetris[n] = (uint8_t) game_state->next_tetris;
+
+    for (int k = 0; k < TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM; ++k) {
+        uint8_t *features = chunk->candidate_features[n][k];
+
+        if (candidates[k].i_pos == -1) {
+            memset(features, TRAINING_DATA_INVALID_FEATURE, TRAINING_DATA_FEATURE_COUNT);
+            continue;
+        }
+
+        // 各项特征都不超过 20 * 11，用一个字节存得下；着陆高度是半整数，存两倍的值。
+        features[0] = (uint8_t) candidates[k].features.hole;
+        features[1] = (uint8_t) candidates[k].features.well;
+        features[2] = (uint8_t) candidates[k].features.row_transition;
+        features[3] = (uint8_t) candidates[k].features.col_transition;
+        features[4] = (uint8_t) candidates[k].features.landing_height_x2;
+        features[5] = (uint8_t) candidates[k].features.eroded_cells;
+    }
+
+    chunk->chosen_move[n] = (uint8_t) (operation.rotation * TETRIS_GRID_J_LIM + operation.j_pos);
+    chunk->sample_count = n + 1;
+
+    if (chunk->sample_count == TRAINING_DATA_CHUNK_SAMPLES) {
+        training_data_exporter__submit_filling_chunk(exporter);
+    }
+}
+
+
+void training_data_exporter_record_game_over(training_data_exporter_s *exporter, const game_state_s *game_state)
+{
+    training_data_chunk_s *chunk = exporter->filling;
+    const uint32_t g = chunk->game_count;
+
+    chunk->game_id[g] = exporter->game_id;
+    chunk->final_score[g] = game_state->statistics.score;
+    chunk->final_placed_blocks[g] = game_state->statistics.placed_blocks;
+    chunk->final_total_lines_cleared[g] = game_state->statistics.total_lines_cleared;
+    chunk->game_count = g + 1;
+
+    exporter->game_id++;
+    exporter->step = 0;
+
+    if (chunk->game_count == TRAINING_DATA_CHUNK_GAMES) {
+        training_data_exporter__submit_filling_chunk(exporter);
+    }
+}
+
+
+void training_data_exporter__submit_filling_chunk(training_data_exporter_s *exporter)
+{
+    EnterCriticalSection(&exporter->lock);
+
+    // 写线程还在写另一块，只能等它
+    while (exporter->pending != NULL) {
+        SleepConditionVariableCS(&exporter->pending_changed, &exporter->lock, INFINITE);
+    }
+
+    exporter->pending = exporter->filling;
+    exporter->filling = exporter->filling == exporter->chunks[0] ? exporter->chunks[1] : exporter->chunks[0];
+    WakeAllConditionVariable(&exporter->pending_changed);
+    LeaveCriticalSection(&exporter->lock);
+
+    exporter->filling->sample_count = 0;
+    exporter->filling->game_count = 0;
+}
+
+
+DWORD WINAPI training_data_exporter__writer_thread_main(LPVOID parameter)
+{
+    training_data_exporter_s *exporter = parameter;
+
+    EnterCriticalSection(&exporter->lock);
+
+    while (true) {
+
+        while (exporter->pending == NULL && !exporter->stopping) {
+            SleepConditionVariableCS(&exporter->pending_changed, &exporter->lock, INFINITE);
+        }
+
+        if (exporter->pending == NULL) {
+            break;
+        }
+
+        const training_data_chunk_s *chunk = exporter->pending;
+        LeaveCriticalSection(&exporter->lock);
+
+        training_data_chunk_write_to(chunk, exporter->file);
+
+        EnterCriticalSection(&exporter->lock);
+        exporter->pending = NULL;
+        WakeAllConditionVariable(&exporter->pending_changed);
+    }
+
+    LeaveCriticalSection(&exporter->lock);
+    return 0;
+}
+
+
+void training_data_chunk_write_to(const training_data_chunk_s *chunk, FILE *file)
+{
+    const uint32_t n = chunk->sample_count;
+    const uint32_t g = chunk->game_count;
+
+    fwrite("TTDC", 1, 4, file);
+    fwrite(&n, sizeof n, 1, file);
+    fwrite(&g, sizeof g, 1, file);
+
+    fwrite(chunk->sample_game_id, sizeof chunk->sample_game_id[0], n, file);
+    fwrite(chunk->sample_step, sizeof chunk->sample_step[0], n, file);
+    fwrite(chunk->board, sizeof chunk->board[0], n, file);
+    fwrite(chunk->falling_tetris, sizeof chunk->falling_tetris[0], n, file);
+    fwrite(chunk->next_tetris, sizeof chunk->next_tetris[0], n, file);
+    fwrite(chunk->candidate_features, sizeof chunk->candidate_features[0], n, file);
+    fwrite(chunk->chosen_move, sizeof chunk->chosen_move[0], n, file);
+
+    fwrite(chunk->game_id, sizeof chunk->game_id[0], g, file);
+    fwrite(chunk->final_score, sizeof chunk->final_score[0], g, file);
+    fwrite(chunk->final_placed_blocks, sizeof chunk->final_placed_blocks[0], g, file);
+    fwrite(chunk->final_total_lines_cleared, sizeof chunk->final_total_lines_cleared[0], g, file);
+}
+
+
+int server_session_take_line(server_session_s *session, char *line, int line_capacity)
+{
+    // 取出缓冲区里的第一行（去掉行尾的 \r\n），返回长度；没有完整的一行时返回 -1。
+    const char *newline = memchr(session->input, '\n', session->input_size);
+
+    if (newline == NULL) {
+        return -1;
+    }
+
+    const int consumed = (int) (newline - session->input) + 1;
+    int length = consumed - 1;
+
+    if (length > 0 && session->input[length - 1] == '\r') {
+        --length;
+    }
+
+    if (length >= line_capacity) {
+        length = line_capacity - 1;
+    }
+
+    memcpy(line, session->input, length);
+    line[length] = '\0';
+
+    session->input_size -= consumed;
+    memmove(session->input, session->input + consumed, session->input_size);
+
+    return length;
+}
+
+
+bool server_session_has_line(const server_session_s *session)
+{
+    return memchr(session->input, '\n', session->input_size) != NULL;
+}
+
+
+void server_session_handle_line(server_session_s *session, const char *line, int length)
+{
+    if (length == 0) {
+        return;
+    }
+
+    if (!session->started) {
+
+        if (length == 7 && memcmp(line, "level ", 6) == 0 && '0' <= line[6] && line[6] < '0' + ENGINE_LEVEL_COUNT) {
+            session->level = line[6] - '0';
+            return;
+        }
+
+        if (length != 2 || !tetris_is_known(line[0]) || !(tetris_is_known(line[1]) || line[1] == 'X')) {
+            session->finished = true;
+            return;
+        }
+
+        session->started = true;
+        server_session__step_and_reply(session, game_state_make(grid_make_blank(), line[0], line[1], false, statistics_make_blank()));
+        return;
+    }
+
+    if (length != 1 || line[0] == 'E' || !(tetris_is_known(line[0]) || line[0] == 'X')) {
+        session->finished = true;
+        return;
+    }
+
+    const game_state_s game = packed_game_state_to_game_state(&session->game);
+    server_session__step_and_reply(session, game_state_with_next_tetris_filled_in(&game, line[0]));
+}
+
+
+void server_session__step_and_reply(server_session_s *session, game_state_s game)
+{
+    // run_ai_1 在没有合法摆法时会触发 game_state__calculate_best_move 的断言，
+    // 这里不能让一局游戏结束连带整个进程退出。
+    if (!game_state_has_valid_move(&game)) {
+        session->finished = true;
+        return;
+    }
+
+    const operation_s operation = game_state_make_decision_at_level(&game, session->level);
+    game = game_state_the_next_state_with_no_next_tetris(&game, operation);
+    session->game = packed_game_state_make(&game);
+
+    char reply[64];
+    const int reply_size = snprintf(reply, sizeof reply, "%d %d\n%d\n", operation.rotation, operation.j_pos, game.statistics.score);
+
+    for (int sent = 0; sent < reply_size; ) {
+        const int n = send(session->socket, reply + sent, reply_size - sent, 0);
+
+        if (n <= 0) {
+            session->finished = true;
+            return;
+        }
+        sent += n;
+    }
+
+    if (game.falling_tetris == 'X') {
+        session->finished = true;
+    }
+}
+
+
+server_session_pool_s *server_session_pool_make(void)
+{
+    server_session_pool_s *pool = malloc(sizeof *pool);
+    assert(pool != NULL);
+
+    // 倒着压栈，先分配出去的是下标小的会话
+    for (int i = 0; i < SERVER_MAX_SESSIONS; ++i) {
+        pool->free_indices[i] = SERVER_MAX_SESSIONS - 1 - i;
+    }
+
+    pool->free_count = SERVER_MAX_SESSIONS;
+    pool->active_count = 0;
+    return pool;
+}
+
+
+void server_session_pool_free(server_session_pool_s *pool)
+{
+    free(pool);
+}
+
+
+server_session_s *server_session_pool_allocate(server_session_pool_s *pool, SOCKET socket)
+{
+    if (pool->free_count == 0) {
+        return NULL;
+    }
+
+    const int index = pool->free_indices[--pool->free_count];
+    pool->active_positions[index] = pool->active_count;
+    pool->active_indices[pool->active_count++] = index;
+
+    server_session_s *session = &pool->sessions[index];
+    session->socket     = socket;
+    session->started    = false;
+    session->busy       = false;
+    session->finished   = false;
+    session->hung_up    = false;
+    session->input_size = 0;
+    session->level      = SERVER_DEFAULT_ENGINE_LEVEL;
+    return session;
+}
+
+
+void server_session_pool_release(server_session_pool_s *pool, server_session_s *session)
+{
+    const int index = server_session_pool_index_of(pool, session);
+    const int position = pool->active_positions[index];
+
+    // 用最后一个活跃会话填补空位
+    const int last_index = pool->active_indices[--pool->active_count];
+    pool->active_indices[position] = last_index;
+    pool->active_positions[last_index] = position;
+
+    pool->free_indices[pool->free_count++] = index;
+}
+
+
+int server_session_pool_index_of(const server_session_pool_s *pool, const server_session_s *session)
+{
+    return (int) (session - pool->sessions);
+}
+
+
+void server_run(const char *socket_path)
+{
+    WSADATA wsa_data;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        fprintf(stderr, "cannot start Winsock\n");
+        return;
+    }
+
+    server_s *server = malloc(sizeof *server);
+    assert(server != NULL);
+    server->pool = server_session_pool_make();
+    server->job_head = 0;
+    server->job_count = 0;
+    InitializeCriticalSection(&server->lock);
+    InitializeConditionVariable(&server->job_available);
+
+    SOCKADDR_UN address = {0};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof address.sun_path - 1);
+    DeleteFileA(socket_path);
+
+    server->listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (server->listen_socket == INVALID_SOCKET
+        || bind(server->listen_socket, (struct sockaddr *) &address, sizeof address) == SOCKET_ERROR
+        || listen(server->listen_socket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        // 还没有起工作线程，收拾干净再退出
+        fprintf(stderr, "cannot listen on %s\n", socket_path);
+
+        if (server->listen_socket != INVALID_SOCKET) {
+            closesocket(server->listen_socket);
+        }
+
+        DeleteCriticalSection(&server->lock);
+        server_session_pool_free(server->pool);
+        free(server);
+        WSACleanup();
+        return;
+    }
+
+    for (int i = 0; i < SERVER_WORKER_COUNT; ++i) {
+        server->workers[i] = CreateThread(NULL, 0, server__worker_thread_main, server, 0, NULL);
+        assert(server->workers[i] != NULL);
+    }
+
+    // poll_fds[0] 是监听套接字，poll_fds[k] 对应会话 poll_sessions[k]
+    WSAPOLLFD *poll_fds = malloc((SERVER_MAX_SESSIONS + 1) * sizeof *poll_fds);
+    int *poll_sessions = malloc((SERVER_MAX_SESSIONS + 1) * sizeof *poll_sessions);
+    assert(poll_fds != NULL && poll_sessions != NULL);
+
+    while (true) {
+        int poll_count = 0;
+        poll_fds[poll_count++] = (WSAPOLLFD) { .fd = server->listen_socket, .events = POLLRDNORM };
+
+        EnterCriticalSection(&server->lock);
+
+        for (int k = 0; k < server->pool->active_count; ++k) {
+            const int index = server->pool->active_indices[k];
+            const server_session_s *session = &server->pool->sessions[index];
+
+            // 缓冲区满了就先不读，等工作线程消费掉再说
+            if (session->hung_up || session->input_size == SERVER_INPUT_BUFFER_SIZE) {
+                continue;
+            }
+
+            poll_sessions[poll_count] = index;
+            poll_fds[poll_count++] = (WSAPOLLFD) { .fd = session->socket, .events = POLLRDNORM };
+        }
+
+        LeaveCriticalSection(&server->lock);
+
+        // 超时是为了及时回收工作线程刚刚结束的会话
+        WSAPoll(poll_fds, poll_count, SERVER_POLL_TIMEOUT_MS);
+
+        if (poll_fds[0].revents & POLLRDNORM) {
+            const SOCKET client = accept(server->listen_socket, NULL, NULL);
+
+            if (client != INVALID_SOCKET) {
+                EnterCriticalSection(&server->lock);
+                const server_session_s *session = server_session_pool_allocate(server->pool, client);
+                LeaveCriticalSection(&server->lock);
+
+                if (session == NULL) {
+                    closesocket(client);
+                }
+            }
+        }
+
+        for (int k = 1; k < poll_count; ++k) {
+
+            if (poll_fds[k].revents == 0) {
+                continue;
+            }
+
+            server_session_s *session = &server->pool->sessions[poll_sessions[k]];
+            char received[SERVER_INPUT_BUFFER_SIZE];
+
+            // input_size 只会被工作线程减小，所以先看一眼剩余空间再在锁外 recv 是安全的
+            EnterCriticalSection(&server->lock);
+            const int space = SERVER_INPUT_BUFFER_SIZE - session->input_size;
+            LeaveCriticalSection(&server->lock);
+
+            const int n = recv(session->socket, received, space, 0);
+
+            EnterCriticalSection(&server->lock);
+
+            if (n <= 0) {
+                session->hung_up = true;
+
+            } else {
+                memcpy(session->input + session->input_size, received, n);
+                session->input_size += n;
+
+                // 缓冲区满了还没有一整行：这一行永远收不完，这个套接字也不会再被 poll，只能按协议出错结束
+                if (session->input_size == SERVER_INPUT_BUFFER_SIZE && !server_session_has_line(session)) {
+                    session->finished = true;
+                }
+
+                server__enqueue_if_ready(server, session);
+            }
+
+            LeaveCriticalSection(&server->lock);
+        }
+
+        // 回收已结束的会话。倒着遍历，因为回收时会把最后一个活跃会话挪到当前位置。
+        EnterCriticalSection(&server->lock);
+
+        for (int k = server->pool->active_count - 1; k >= 0; --k) {
+            server_session_s *session = &server->pool->sessions[server->pool->active_indices[k]];
+
+            if (!session->busy && (session->finished || session->hung_up)) {
+                closesocket(session->socket);
+                server_session_pool_release(server->pool, session);
+            }
+        }
+
+        LeaveCriticalSection(&server->lock);
+    }
+}
+
+
+void server__enqueue_if_ready(server_s *server, server_session_s *session)
+{
+    // 调用时须持有 server->lock
+    if (session->busy || session->finished || session->hung_up || !server_session_has_line(session)) {
+        return;
+    }
+
+    session->busy = true;
+    server->job_queue[(server->job_head + server->job_count) % SERVER_MAX_SESSIONS] = server_session_pool_index_of(server->pool, session);
+    server->job_count++;
+    WakeConditionVariable(&server->job_available);
+}
+
+
+DWORD WINAPI server__worker_thread_main(LPVOID parameter)
+{
+    server_s *server = parameter;
+    char line[SERVER_INPUT_BUFFER_SIZE];
+
+    EnterCriticalSection(&server->lock);
+
+    while (true) {
+
+        while (server->job_count == 0) {
+            SleepConditionVariableCS(&server->job_available, &server->lock, INFINITE);
+        }
+
+        server_session_s *session = &server->pool->sessions[server->job_queue[server->job_head]];
+        server->job_head = (server->job_head + 1) % SERVER_MAX_SESSIONS;
+        server->job_count--;
+
+        // 把这个会话缓冲区里已有的行都处理完再放手，这期间主线程新收到的行也会在这里被处理
+        while (!session->finished) {
+            const int length = server_session_take_line(session, line, sizeof line);
+
+            if (length < 0) {
+                break;
+            }
+
+            LeaveCriticalSection(&server->lock);
+            server_session_handle_line(session, line, length);
+            EnterCriticalSection(&server->lock);
+        }
+
+        session->busy = false;
+    }
+
+    LeaveCriticalSection(&server->lock);
+    return 0;
+}
+
+
+arena_s arena_make(size_t capacity)
+{
+    arena_s arena = {
+        .base     = malloc(capacity),
+        .capacity = capacity,
+        .used     = 0,
+    };
+    assert(arena.base != NULL);
+    return arena;
+}
+
+
+void *arena_allocate(arena_s *arena, size_t size)
+{
+    // 按 16 字节对齐
+    const size_t aligned_size = (size + 15) & ~(size_t) 15;
+
+    if (arena->capacity - arena->used < aligned_size) {
+        return NULL;
+    }
+
+    void *pointer = arena->base + arena->used;
+    arena->used += aligned_size;
+    return pointer;
+}
+
+
+void arena_reset(arena_s *arena)
+{
+    arena->used = 0;
+}
+
+
+arena_s *arena_for_this_thread(void)
+{
+    // 每个线程第一次用时分配一次，之后一直复用
+    static _Thread_local arena_s arena = {0};
+
+    if (arena.base == NULL) {
+        arena = arena_make(ANYTIME_ARENA_BYTES);
+    }
+
+    return &arena;
+}
+
+
+search_node_s search_node_make_from_game_state(const game_state_s *game_state)
+{
+    search_node_s node = {
+        .children       = NULL,
+        .move_score_x2  = 0,
+        .move           = 0,
+        .lines_cleared  = 0,
+        .falling_tetris = game_state->falling_tetris,
+        .child_count    = SEARCH_NODE_NOT_EXPANDED,
+    };
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+        node.rows[i] = grid_get_row_bits(&game_state->grid, i);
+    }
+
+    return node;
+}
+
+
+game_state_s search_node_to_game_state(const search_node_s *node)
+{
+    // 搜索只关心网格和下落的方块，统计数据从零开始
+    grid_s grid = grid_make_blank();
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+        grid_set_row_bits(&grid, i, node->rows[i]);
+    }
+
+    return game_state_make(grid, node->falling_tetris, '?', false, statistics_make_blank());
+}
+
+
+operation_s search_node_get_move(const search_node_s *node)
+{
+    return (operation_s) { .rotation = node->move / TETRIS_GRID_J_LIM, .j_pos = node->move % TETRIS_GRID_J_LIM };
+}
+
+
+bool search_node__expand(search_node_s *node, int width, char child_falling_tetris, search_context_s *context, deadline_s *deadline)
+{
+    // 返回 false 表示超时或竞技场已满，此时节点保持未展开。
+    assert(node->child_count == SEARCH_NODE_NOT_EXPANDED);
+
+    if (node->falling_tetris == '?') {
+        const char tetrises[] = "IOLJZST";
+        search_node_s *children = arena_allocate(context->arena, 7 * sizeof *children);
+
+        if (children == NULL) {
+            return false;
+        }
+
+        for (int i = 0; i < 7; ++i) {
+            children[i] = *node;
+            children[i].children = NULL;
+            children[i].move_score_x2 = 0;
+            children[i].lines_cleared = 0;
+            children[i].falling_tetris = tetrises[i];
+        }
+
+        node->children = children;
+        node->child_count = 7;
+        return true;
+    }
+
+    const game_state_s game_state = search_node_to_game_state(node);
+    operation_s moves[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+    int scores_x2[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+    const int count = game_state__calculate_top_moves(&game_state, width, moves, scores_x2, deadline, &context->evaluated);
+
+    if (count < 0) {
+        return false;
+    }
+
+    search_node_s *children = arena_allocate(context->arena, count * sizeof *children);
+
+    if (count > 0 && children == NULL) {
+        return false;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        game_state_s child_state = game_state;
+        child_state.next_tetris = child_falling_tetris;
+        child_state = game_state_the_next_state_with_no_next_tetris(&child_state, moves[i]);
+
+        children[i] = search_node_make_from_game_state(&child_state);
+        children[i].move_score_x2 = (int16_t) scores_x2[i];
+        children[i].move = (uint8_t) (moves[i].rotation * TETRIS_GRID_J_LIM + moves[i].j_pos);
+        children[i].lines_cleared = (uint8_t) child_state.statistics.total_lines_cleared;
+    }
+
+    node->children = children;
+    node->child_count = (uint8_t) count;
+    return true;
+}
+
+
+bool search_node__value(search_node_s *node, int depth, search_context_s *context, double *value)
+{
+    // 从这个节点往后再看 depth 个方块能得到的最高累计评价值（两倍）；随机方块节点对 7 种方块取平均。
+    // 返回 false 表示超时或竞技场已满。
+    if (depth == 0 || node->falling_tetris == 'X') {
+        *value = 0;
+        return true;
+    }
+
+    if (node->child_count == SEARCH_NODE_NOT_EXPANDED
+        && !search_node__expand(node, ANYTIME_BEAM_WIDTH, '?', context, &context->deadline))
+    {
+        return false;
+    }
+
+    if (node->falling_tetris == '?') {
+        double sum = 0;
+
+        for (int i = 0; i < node->child_count; ++i) {
+            double child_value;
+
+            if (!search_node__value(&node->children[i], depth, context, &child_value)) {
+                return false;
+            }
+            sum += child_value;
+        }
+
+        *value = sum / node->child_count;
+        return true;
+    }
+
+    if (node->child_count == 0) {
+        // 无处可放，游戏结束
+        *value = ANYTIME_DEAD_END_SCORE_X2;
+        return true;
+    }
+
+    double best_value = -INFINITY;
+
+    for (int i = 0; i < node->child_count; ++i) {
+        double child_value;
+
+        if (!search_node__value(&node->children[i], depth - 1, context, &child_value)) {
+            return false;
+        }
+
+        if (node->children[i].move_score_x2 + child_value > best_value) {
+            best_value = node->children[i].move_score_x2 + child_value;
+        }
+    }
+
+    *value = best_value;
+    return true;
+}
+
+
+packed_game_state_s packed_game_state_make(const game_state_s *game_state)
+{
+    packed_game_state_s packed = {
+        .falling_tetris   = game_state->falling_tetris,
+        .next_tetris      = game_state->next_tetris,
+        .deadline_touched = game_state->deadline_touched,
+        .hold_tetris      = game_state->hold_tetris,
+        .placed_blocks    = (uint32_t) game_state->statistics.placed_blocks,
+    };
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+        packed.rows[i] = grid_get_row_bits(&game_state->grid, i);
+    }
+
+    for (int lines = 1; lines < 5; ++lines) {
+        packed.lines_cleared[lines - 1] = (uint32_t) game_state->statistics.lines_cleared[lines];
+    }
+
+    return packed;
+}
+
+
+game_state_s packed_game_state_to_game_state(const packed_game_state_s *packed)
+{
+    grid_s grid = grid_make_blank();
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+        grid_set_row_bits(&grid, i, packed->rows[i]);
+    }
+
+    statistics_s statistics = statistics_make_blank();
+    statistics.placed_blocks       = packed_game_state_get_placed_blocks(packed);
+    statistics.score               = packed_game_state_get_score(packed);
+    statistics.total_lines_cleared = packed_game_state_get_total_lines_cleared(packed);
+
+    for (int lines = 1; lines < 5; ++lines) {
+        statistics.lines_cleared[lines] = packed_game_state_get_lines_cleared(packed, lines);
+    }
+
+    game_state_s game_state = game_state_make(grid, packed->falling_tetris, packed->next_tetris, packed->deadline_touched, statistics);
+    game_state.hold_tetris = packed->hold_tetris;
+    return game_state;
+}
+
+
+int packed_game_state_get_cell(const packed_game_state_s *packed, int i, int j)
+{
+    assert(0 <= i && i < TETRIS_GRID_I_LIM);
+    assert(0 <= j && j < TETRIS_GRID_J_LIM);
+    return (packed->rows[i] >> j) & 1;
+}
+
+
+char packed_game_state_get_falling_tetris(const packed_game_state_s *packed)
+{
+    return packed->falling_tetris;
+}
+
+
+char packed_game_state_get_next_tetris(const packed_game_state_s *packed)
+{
+    return packed->next_tetris;
+}
+
+
+char packed_game_state_get_hold_tetris(const packed_game_state_s *packed)
+{
+    return packed->hold_tetris;
+}
+
+
+bool packed_game_state_is_deadline_touched(const packed_game_state_s *packed)
+{
+    return packed->deadline_touched;
+}
+
+
+int packed_game_state_get_placed_blocks(const packed_game_state_s *packed)
+{
+    return (int) packed->placed_blocks;
+}
+
+
+int packed_game_state_get_lines_cleared(const packed_game_state_s *packed, int lines)
+{
+    assert(1 <= lines && lines <= 4);
+    return (int) packed->lines_cleared[lines - 1];
+}
+
+
+int packed_game_state_get_total_lines_cleared(const packed_game_state_s *packed)
+{
+    int total = 0;
+
+    for (int lines = 1; lines < 5; ++lines) {
+        total += lines * packed_game_state_get_lines_cleared(packed, lines);
+    }
+
+    return total;
+}
+
+
+int packed_game_state_get_score(const packed_game_state_s *packed)
+{
+    int score = 0;
+
+    for (int lines = 1; lines < 5; ++lines) {
+        score += scores_of_line_cleared[lines] * packed_game_state_get_lines_cleared(packed, lines);
+    }
+
+    return score;
+}
+
+
+battle_player_s battle_player_make(const evaluate_weights_s *weights, char falling_tetris, char next_tetris, uint64_t seed, telemetry_recorder_s *recorder, uint32_t game_id)
+{
+    battle_player_s return_value = {
+        .game = game_state_make(grid_make_blank(), falling_tetris, next_tetris, false, statistics_make_blank()),
+        .weights = weights,
+        .pending_garbage = 0,
+        .combo = 0,
+        .lines_sent = 0,
+        .garbage_random = seed,
+        .lost = false,
+        .recorder = recorder,
+        .telemetry = telemetry_game_make(game_id),
+    };
+    return return_value;
+}
+
+
+int battle_player_step(battle_player_s *player, char next_tetris)
+{
+    if (player->lost) {
+        return 0;
+    }
+
+    if (!game_state_has_valid_move(&player->game)) {
+        player->lost = true;
+        return 0;
+    }
+
+    LARGE_INTEGER decision_begin;
+    LARGE_INTEGER decision_end;
+    QueryPerformanceCounter(&decision_begin);
+
+    candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+    const operation_s operation = game_state__calculate_best_move_with_weights(&player->game, player->weights, candidates);
+
+    QueryPerformanceCounter(&decision_end);
+
+    const int total_lines_cleared_before = player->game.statistics.total_lines_cleared;
+    player->game = game_state_the_next_state_with_no_next_tetris(&player->game, operation);
+    const int lines_cleared = player->game.statistics.total_lines_cleared - total_lines_cleared_before;
+
+    if (player->recorder != NULL) {
+        telemetry_recorder_record_decision(player->recorder, &player->telemetry, decision_end.QuadPart - decision_begin.QuadPart, &player->game);
+    }
+
+    int garbage = 0;
+
+    if (lines_cleared > 0) {
+        const int combo_index = player->combo < BATTLE_COMBO_TABLE_SIZE ? player->combo : BATTLE_COMBO_TABLE_SIZE - 1;
+        garbage = battle_garbage_of_line_cleared[lines_cleared] + battle_garbage_of_combo[combo_index];
+        player->combo++;
+
+        // 先抵消自己还没升上来的垃圾行
+        const int offset = garbage < player->pending_garbage ? garbage : player->pending_garbage;
+        player->pending_garbage -= offset;
+        garbage -= offset;
+    } else {
+        player->combo = 0;
+        battle_player__raise_pending_garbage(player);
+    }
+
+    // 升上来的垃圾行也可能顶到死线，所以直接看网格，不看 deadline_touched
+    if (grid_is_deadline_touched(&player->game.grid)) {
+        player->lost = true;
+    }
+
+    player->game = game_state_with_next_tetris_filled_in(&player->game, next_tetris);
+    player->lines_sent += garbage;
+    return garbage;
+}
+
+
+void battle_player__raise_pending_garbage(battle_player_s *player)
+{
+    if (player->pending_garbage == 0) {
+        return;
+    }
+
+    const int count = player->pending_garbage < TETRIS_GRID_I_LIM ? player->pending_garbage : TETRIS_GRID_I_LIM;
+    player->pending_garbage = 0;
+
+    // 被顶出场地就输了
+    for (int i = 0; i < count; ++i) {
+
+        if (!grid_is_row_empty(&player->game.grid, i)) {
+            player->lost = true;
+            return;
+        }
+    }
+
+    // 同一批垃圾行的缺口在同一列
+    const int hole_j = (int) (battle__next_random(&player->garbage_random) % TETRIS_GRID_J_LIM);
+    player->game.grid = grid_with_garbage_rows_inserted(&player->game.grid, count, hole_j);
+}
+
+
+void battle_match_run(battle_match_s *match, telemetry_recorder_s *recorder, uint32_t first_game_id)
+{
+    // 两边用同一个方块序列和同一个垃圾行缺口序列，差别只在权重
+    piece_generator_s generator = piece_generator_make(PIECE_RANDOMIZER_BAG, match->seed);
+
+    const char first = piece_generator_next(&generator);
+    const char second = piece_generator_next(&generator);
+
+    battle_player_s players[2];
+
+    for (int side = 0; side < 2; ++side) {
+        const evaluate_weights_s *weights = &battle_entrants[match->entrant_indices[side]].weights;
+        players[side] = battle_player_make(weights, first, second, match->seed, recorder, first_game_id + (uint32_t) side);
+    }
+
+    int turn = 0;
+
+    while (turn < BATTLE_MAX_TURNS && !players[0].lost && !players[1].lost) {
+        const char next_tetris = piece_generator_next(&generator);
+        int garbage[2];
+
+        for (int side = 0; side < 2; ++side) {
+            garbage[side] = battle_player_step(&players[side], next_tetris);
+        }
+
+        // 两边都走完才交换垃圾行，所以谁先走都一样
+        players[0].pending_garbage += garbage[1];
+        players[1].pending_garbage += garbage[0];
+        ++turn;
+    }
+
+    match->turns = turn;
+
+    for (int side = 0; side < 2; ++side) {
+        match->lines_sent[side] = players[side].lines_sent;
+
+        if (recorder != NULL) {
+            telemetry_recorder_record_game_over(recorder, &players[side].telemetry, &players[side].game);
+        }
+    }
+
+    if (players[0].lost == players[1].lost) {
+        match->winner = -1;
+    } else {
+        match->winner = players[0].lost ? 1 : 0;
+    }
+}
+
+
+void battle_run_tournament(void)
+{
+    // 每两组权重打 BATTLE_MATCHES_PER_PAIR 局。不同的组合用同一批种子，大家面对的方块序列相同。
+    const int pair_count = BATTLE_ENTRANT_COUNT * (BATTLE_ENTRANT_COUNT - 1) / 2;
+    battle_tournament_s tournament = {
+        .matches = malloc(pair_count * BATTLE_MATCHES_PER_PAIR * sizeof(battle_match_s)),
+        .match_count = 0,
+        .next_match = 0,
+        .telemetry = NULL,
+    };
+    assert(tournament.matches != NULL);
+
+#ifdef TELEMETRY
+    tournament.telemetry = telemetry_make(2 * pair_count * BATTLE_MATCHES_PER_PAIR);
+#endif /* TELEMETRY */
+
+    for (int game_index = 0; game_index < BATTLE_MATCHES_PER_PAIR; ++game_index) {
+
+        for (int a = 0; a < BATTLE_ENTRANT_COUNT; ++a) {
+
+            for (int b = a + 1; b < BATTLE_ENTRANT_COUNT; ++b) {
+                battle_match_s *match = &tournament.matches[tournament.match_count++];
+                match->entrant_indices[0] = a;
+                match->entrant_indices[1] = b;
+                match->seed = (uint64_t) BATTLE_SEED * 1000003u + (uint64_t) game_index;
+            }
+        }
+    }
+
+    HANDLE threads[BATTLE_THREAD_COUNT];
+
+    for (int t = 0; t < BATTLE_THREAD_COUNT; ++t) {
+        threads[t] = CreateThread(NULL, 0, battle__worker_thread_main, &tournament, 0, NULL);
+        assert(threads[t] != NULL);
+    }
+
+    for (int t = 0; t < BATTLE_THREAD_COUNT; ++t) {
+        WaitForSingleObject(threads[t], INFINITE);
+        CloseHandle(threads[t]);
+    }
+
+    // 按对局顺序更新 Elo
+    double ratings[BATTLE_ENTRANT_COUNT];
+    int wins[BATTLE_ENTRANT_COUNT] = {0};
+    int losses[BATTLE_ENTRANT_COUNT] = {0};
+    int draws[BATTLE_ENTRANT_COUNT] = {0};
+    long long lines_sent[BATTLE_ENTRANT_COUNT] = {0};
+
+    for (int e = 0; e < BATTLE_ENTRANT_COUNT; ++e) {
+        ratings[e] = BATTLE_ELO_INITIAL;
+    }
+
+    for (int m = 0; m < tournament.match_count; ++m) {
+        const battle_match_s *match = &tournament.matches[m];
+        const int a = match->entrant_indices[0];
+        const int b = match->entrant_indices[1];
+
+        const double expected_a = 1.0 / (1.0 + pow(10.0, (ratings[b] - ratings[a]) / 400.0));
+        double actual_a = 0.5;
+
+        if (match->winner == 0) {
+            actual_a = 1.0;
+            wins[a]++;
+            losses[b]++;
+        } else if (match->winner == 1) {
+            actual_a = 0.0;
+            wins[b]++;
+            losses[a]++;
+        } else {
+            draws[a]++;
+            draws[b]++;
+        }
+
+        ratings[a] += BATTLE_ELO_K * (actual_a - expected_a);
+        ratings[b] -= BATTLE_ELO_K * (actual_a - expected_a);
+        lines_sent[a] += match->lines_sent[0];
+        lines_sent[b] += match->lines_sent[1];
+    }
+
+    printf("%-12s %7s %5s %5s %5s %10s\n", "entrant", "elo", "win", "loss", "draw", "sent/game");
+
+    for (int e = 0; e < BATTLE_ENTRANT_COUNT; ++e) {
+        const int games = wins[e] + losses[e] + draws[e];
+        printf(
+            "%-12s %7.1f %5d %5d %5d %10.1f\n",
+            battle_entrants[e].name, ratings[e], wins[e], losses[e], draws[e],
+            games > 0 ? (double) lines_sent[e] / games : 0.0
+        );
+    }
+
+#ifdef TELEMETRY
+    telemetry_print_summary(tournament.telemetry);
+    telemetry_write(tournament.telemetry);
+    telemetry_free(tournament.telemetry);
+#endif /* TELEMETRY */
+
+    fflush(stdout);
+    free(tournament.matches);
+}
+
+
+DWORD WINAPI battle__worker_thread_main(LPVOID parameter)
+{
+    battle_tournament_s *tournament = parameter;
+
+    // 记录器有几 KB，不收集遥测时也照样放在栈上，只是不传下去
+    telemetry_recorder_s recorder = telemetry_recorder_make(tournament->telemetry);
+
+    while (true) {
+        const LONG index = InterlockedIncrement(&tournament->next_match) - 1;
+
+        if (index >= tournament->match_count) {
+            break;
+        }
+
+        battle_match_run(&tournament->matches[index], tournament->telemetry != NULL ? &recorder : NULL, 2 * (uint32_t) index);
+    }
+
+    if (tournament->telemetry != NULL) {
+        telemetry_recorder_flush(&recorder);
+    }
+
+    return 0;
+}
+
+
+uint64_t battle__next_random(uint64_t *state)
+{
+    // splitmix64。每局、每个玩家各用各的状态，结果与线程调度无关。
+    uint64_t z = (*state += 0x9E3779B97F4A7C15u);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+    return z ^ (z >> 31);
+}
+
+
+row_features_s row_features_calculate(const grid_s *grid, int i)
+{
+    // 井：左右两侧都是砖格或墙壁的空格
+    int well = 0;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+
+        if (grid->content[i][j] == 1) {
+            continue;
+        }
+
+        if (grid_get_with_default(grid, i, j-1, 1) == 1
+            && grid_get_with_default(grid, i, j+1, 1) == 1)
+        {
+            ++well;
+        }
+    }
+
+    // 行转变数：墙和砖格等效
+    int row_transition = 0;
+
+    for (int j = -1; j < TETRIS_GRID_J_LIM; ++j) {
+
+        if (grid_get_with_default(grid, i, j, 1) != grid_get_with_default(grid, i, j+1, 1)) {
+            ++row_transition;
+        }
+    }
+
+    return (row_features_s) {
+        .row_transition = (uint8_t) row_transition,
+        .well           = (uint8_t) well,
+    };
+}
+
+
+void row_features_table_initialize(void)
+{
+    grid_s grid = grid_make_blank();
+
+    for (int bits = 0; bits < ROW_FEATURES_TABLE_SIZE; ++bits) {
+        grid_set_row_bits(&grid, 0, (uint16_t) bits);
+        row_features_table[bits] = row_features_calculate(&grid, 0);
+    }
+}
+
+
+piece_generator_s piece_generator_make(int randomizer, uint64_t seed)
+{
+    assert(randomizer == PIECE_RANDOMIZER_UNIFORM || randomizer == PIECE_RANDOMIZER_BAG || randomizer == PIECE_RANDOMIZER_HISTORY);
+
+    piece_generator_s return_value = {
+        .randomizer    = randomizer,
+        .seed          = seed,
+        .position      = 0,
+        .replay        = NULL,
+        .replay_length = 0,
+    };
+    return return_value;
+}
+
+
+piece_generator_s piece_generator_make_replay(const char *file_name)
+{
+    // 文件格式与 input_tetris_generator.py 的输出相同，但这里只按顺序取出方块字母，不管换行在哪里。
+    // 读到 X 或 E 就结束，之后的方块都当作 X。
+    FILE *file = fopen(file_name, "rb");
+    assert(file != NULL);
+
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    assert(size >= 0);
+
+    char *replay = malloc((size_t) size + 1);
+    assert(replay != NULL);
+    const size_t size_read = fread(replay, 1, (size_t) size, file);
+    fclose(file);
+
+    long long length = 0;
+
+    for (size_t k = 0; k < size_read; ++k) {
+
+        if (replay[k] == 'X' || replay[k] == 'E') {
+            break;
+        }
+
+        if (tetris_is_known(replay[k])) {
+            replay[length++] = replay[k];
+        }
+    }
+
+    piece_generator_s return_value = {
+        .randomizer    = PIECE_RANDOMIZER_REPLAY,
+        .seed          = 0,
+        .position      = 0,
+        .replay        = replay,
+        .replay_length = length,
+    };
+    return return_value;
+}
+
+
+void piece_generator_free(piece_generator_s *generator)
+{
+    free(generator->replay);
+    generator->replay = NULL;
+    generator->replay_length = 0;
+}
+
+
+void piece_generator_seek(piece_generator_s *generator, long long position)
+{
+    assert(position >= 0);
+
+    if (generator->randomizer != PIECE_RANDOMIZER_HISTORY) {
+        generator->position = position;
+        return;
+    }
+
+    // 历史只能顺序推出来，但每 PIECE_HISTORY_SYNC_PERIOD 个方块重置一次，所以从上一个重置点开始就行
+    generator->position = position - position % PIECE_HISTORY_SYNC_PERIOD;
+
+    while (generator->position < position) {
+        piece_generator_next(generator);
+    }
+}
+
+
+char piece_generator_next(piece_generator_s *generator)
+{
+    const long long position = generator->position++;
+
+    if (generator->randomizer == PIECE_RANDOMIZER_UNIFORM) {
+        return "IOLJZST"[piece_generator__hash(generator->seed, (uint64_t) position) % 7];
+    } else if (generator->randomizer == PIECE_RANDOMIZER_BAG) {
+        return piece_generator__bag_piece(generator, position);
+    } else if (generator->randomizer == PIECE_RANDOMIZER_HISTORY) {
+        return piece_generator__history_piece(generator, position);
+    } else {
+        return position < generator->replay_length ? generator->replay[position] : 'X';
+    }
+}
+
+
+void piece_generator_write_sequence(piece_generator_s *generator, long long length, FILE *file)
+{
+    // 与 input_tetris_generator.py 的输出相同：第一个方块后面没有换行，所以第一行是前两个方块；
+    // 之后每行一个，最后一行是 X。
+    if (length <= 0) {
+        return;
+    }
+
+    fputc(piece_generator_next(generator), file);
+
+    for (long long k = 1; k < length; ++k) {
+        fputc(piece_generator_next(generator), file);
+        fputc('\n', file);
+    }
+
+    fputs("X\n", file);
+}
+
+
+uint64_t piece_generator__hash(uint64_t seed, uint64_t counter)
+{
+    // splitmix64 的输出函数。输入是 (seed, counter)，没有内部状态。
+    uint64_t z = seed * 0x9E3779B97F4A7C15u + (counter + 1) * 0xD1B54A32D192ED03u;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9u;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBu;
+    return z ^ (z >> 31);
+}
+
+
+char piece_generator__bag_piece(const piece_generator_s *generator, long long position)
+{
+    // 第 bag 袋用 Fisher-Yates 洗牌，每次交换用的随机数只由 (seed, bag, t) 决定
+    const long long bag = position / 7;
+    char pieces[] = "IOLJZST";
+
+    for (int t = 6; t > 0; --t) {
+        const int k = (int) (piece_generator__hash(generator->seed, (uint64_t) bag * 8 + (uint64_t) t) % (uint64_t) (t + 1));
+        const char temp = pieces[t];
+        pieces[t] = pieces[k];
+        pieces[k] = temp;
+    }
+
+    return pieces[position % 7];
+}
+
+
+char piece_generator__history_piece(piece_generator_s *generator, long long position)
+{
+    if (position % PIECE_HISTORY_SYNC_PERIOD == 0) {
+        // 和 TGM 一样，开局的历史是 Z S Z S，所以第一个方块很少是 S 或 Z
+        memcpy(generator->history, "ZSZS", PIECE_HISTORY_SIZE);
+    }
+
+    char piece = 'I';
+
+    for (int t = 0; t < PIECE_HISTORY_TRIES; ++t) {
+        piece = "IOLJZST"[piece_generator__hash(generator->seed, (uint64_t) position * 8 + (uint64_t) t) % 7];
+
+        if (memchr(generator->history, piece, PIECE_HISTORY_SIZE) == NULL) {
+            break;
+        }
+    }
+
+    memmove(&generator->history[0], &generator->history[1], PIECE_HISTORY_SIZE - 1);
+    generator->history[PIECE_HISTORY_SIZE - 1] = piece;
+    return piece;
+}
+
+
+input_reader_s input_reader_make(FILE *file, size_t capacity)
+{
+    assert(capacity > 0);
+
+    input_reader_s return_value = {
+        .file        = file,
+        .buffer      = malloc(capacity),
+        .capacity    = capacity,
+        .size        = 0,
+        .position    = 0,
+        .end_of_file = false,
+        .pieces_read = 0,
+    };
+    assert(return_value.buffer != NULL);
+    return return_value;
+}
+
+
+void input_reader_free(input_reader_s *reader)
+{
+    free(reader->buffer);
+    reader->buffer = NULL;
+    reader->capacity = 0;
+    reader->size = 0;
+    reader->position = 0;
+}
+
+
+char input_reader_next_piece(input_reader_s *reader)
+{
+    while (true) {
+
+        while (reader->position < reader->size) {
+            const char c = reader->buffer[reader->position++];
+
+            if (!(c == ' ' || c == '\t' || c == '\r' || c == '\n')) {
+                reader->pieces_read++;
+                return c;
+            }
+        }
+
+        if (!input_reader__fill(reader)) {
+            return 'E';
+        }
+    }
+}
+
+
+long long input_reader_read_all_pieces(input_reader_s *reader, char **pieces)
+{
+    // 把还没用到的部分挪到缓冲区开头，然后一直读到文件尾，缓冲区不够就加倍
+    memmove(reader->buffer, reader->buffer + reader->position, reader->size - reader->position);
+    reader->size -= reader->position;
+    reader->position = 0;
+
+    while (!reader->end_of_file) {
+
+        if (reader->size == reader->capacity) {
+            reader->capacity *= 2;
+            reader->buffer = realloc(reader->buffer, reader->capacity);
+            assert(reader->buffer != NULL);
+        }
+
+        const int size_read = _read(_fileno(reader->file), reader->buffer + reader->size, (unsigned) (reader->capacity - reader->size));
+
+        if (size_read <= 0) {
+            reader->end_of_file = true;
+        } else {
+            reader->size += (size_t) size_read;
+        }
+    }
+
+    // 原地去掉空白，方块就排在缓冲区开头，不另外复制。X 保留，E 及其后面的内容丢掉。
+    long long count = 0;
+
+    for (size_t k = 0; k < reader->size; ++k) {
+        const char c = reader->buffer[k];
+
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            continue;
+        }
+
+        if (c == 'E') {
+            break;
+        }
+
+        reader->buffer[count++] = c;
+
+        if (c == 'X') {
+            break;
+        }
+    }
+
+    reader->size = 0;
+    *pieces = reader->buffer;
+    return count;
+}
+
+
+bool input_reader__fill(input_reader_s *reader)
+{
+    // _read 有多少就返回多少，不会为了填满缓冲区而等下去，所以交互式评测不会卡住
+    if (reader->end_of_file) {
+        return false;
+    }
+
+    const int size_read = _read(_fileno(reader->file), reader->buffer, (unsigned) reader->capacity);
+
+    if (size_read <= 0) {
+        reader->end_of_file = true;
+        return false;
+    }
+
+    reader->size = (size_t) size_read;
+    reader->position = 0;
+    return true;
+}
+
+
+offline_planner_s *offline_planner_make(const char *pieces, long long piece_count, const char *checkpoint_file_name)
+{
+    offline_planner_s *planner = malloc(sizeof *planner);
+    assert(planner != NULL);
+
+    planner->pieces = pieces;
+    planner->piece_count = piece_count;
+    planner->step = 0;
+
+    const game_state_s game = game_state_make(grid_make_blank(), pieces[0], pieces[1], false, statistics_make_blank());
+    planner->beam[0] = (offline_beam_entry_s) {
+        .state  = packed_game_state_make(&game),
+        .key    = 0,
+        .parent = 0,
+        .move   = 0,
+        .valid  = 1,
+    };
+    planner->beam_size = 1;
+    planner->next_parent = 0;
+
+    planner->checkpoint = fopen(checkpoint_file_name, "w+b");
+    assert(planner->checkpoint != NULL);
+
+    InitializeCriticalSection(&planner->lock);
+    InitializeConditionVariable(&planner->work_ready);
+    InitializeConditionVariable(&planner->work_done);
+    planner->generation = 0;
+    planner->busy_workers = 0;
+    planner->stopping = false;
+
+    for (int t = 0; t < OFFLINE_THREAD_COUNT; ++t) {
+        planner->workers[t] = CreateThread(NULL, 0, offline_planner__worker_thread_main, planner, 0, NULL);
+        assert(planner->workers[t] != NULL);
+    }
+
+    return planner;
+}
+
+
+void offline_planner_free(offline_planner_s *planner)
+{
+    EnterCriticalSection(&planner->lock);
+    planner->stopping = true;
+    WakeAllConditionVariable(&planner->work_ready);
+    LeaveCriticalSection(&planner->lock);
+
+    for (int t = 0; t < OFFLINE_THREAD_COUNT; ++t) {
+        WaitForSingleObject(planner->workers[t], INFINITE);
+        CloseHandle(planner->workers[t]);
+    }
+
+    DeleteCriticalSection(&planner->lock);
+    fclose(planner->checkpoint);
+    free(planner);
+}
+
+
+long long offline_planner_run(offline_planner_s *planner, operation_s operations[])
+{
+    const long long total_steps = planner->piece_count - 1;
+    long long step_count = 0;
+
+    while (step_count < total_steps) {
+        planner->step = step_count;
+        planner->next_parent = 0;
+
+        EnterCriticalSection(&planner->lock);
+        planner->busy_workers = OFFLINE_THREAD_COUNT;
+        planner->generation++;
+        WakeAllConditionVariable(&planner->work_ready);
+
+        while (planner->busy_workers > 0) {
+            SleepConditionVariableCS(&planner->work_done, &planner->lock, INFINITE);
+        }
+
+        LeaveCriticalSection(&planner->lock);
+
+        // 所有局面都无处可放了，就停在上一层
+        if (offline_planner__select(planner) == 0) {
+            break;
+        }
+
+        ++step_count;
+    }
+
+    if (step_count == 0) {
+        return 0;
+    }
+
+    // 从最后一层得分最高的局面沿回溯指针往回走
+    int best = 0;
+
+    for (int k = 1; k < planner->beam_size; ++k) {
+
+        if (packed_game_state_get_score(&planner->beam[k].state) > packed_game_state_get_score(&planner->beam[best].state)) {
+            best = k;
+        }
+    }
+
+    fflush(planner->checkpoint);
+
+    for (long long step = step_count - 1; step >= 0; --step) {
+        offline_checkpoint_record_s record;
+        // long 在 Win64 上也只有 32 位，每层 OFFLINE_BEAM_WIDTH 条记录，几百万步以后就超出了
+        const int64_t offset = (step * OFFLINE_BEAM_WIDTH + best) * (int64_t) sizeof record;
+
+        // 读不回来就没法往前走了；已经找回的是最后几步，缺了前面的也走不出来，所以一步都不给
+        if (_fseeki64(planner->checkpoint, offset, SEEK_SET) != 0 || fread(&record, sizeof record, 1, planner->checkpoint) != 1) {
+            fprintf(stderr, "cannot read back step %lld from the planner checkpoint file\n", step);
+            return 0;
+        }
+
+        assert(record.valid);
+
+        operations[step] = (operation_s) {.rotation = record.move / TETRIS_GRID_J_LIM, .j_pos = record.move % TETRIS_GRID_J_LIM};
+        best = record.parent;
+    }
+
+    return step_count;
+}
+
+
+void offline_planner__expand(offline_planner_s *planner, int parent_index)
+{
+    offline_beam_entry_s *children = &planner->children[parent_index * TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+    const game_state_s game = packed_game_state_to_game_state(&planner->beam[parent_index].state);
+
+    for (int index = 0; index < TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM; ++index) {
+        children[index].valid = 0;
+    }
+
+    if (!game_state_has_valid_move(&game)) {
+        return;
+    }
+
+    candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+    game_state__calculate_best_move_with_candidates(&game, candidates);
+
+    for (int index = 0; index < TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM; ++index) {
+
+        if (candidates[index].i_pos == -1) {
+            continue;
+        }
+
+        const operation_s operation = {.rotation = index / TETRIS_GRID_J_LIM, .j_pos = index % TETRIS_GRID_J_LIM};
+        game_state_s child = game_state_the_next_state_with_no_next_tetris(&game, operation);
+
+        if (planner->step + 2 < planner->piece_count) {
+            child = game_state_with_next_tetris_filled_in(&child, planner->pieces[planner->step + 2]);
+        }
+
+        // 得分是最终目标；局面以后还能不能继续得分，只看洞、井、转变数这些局面本身的特征，
+        // 不看着陆高度和侵蚀格数这两项只与这一步有关的特征
+        evaluate_features_s board_features = candidates[index].features;
+        board_features.landing_height_x2 = 0;
+        board_features.eroded_cells = 0;
+        int64_t key = (int64_t) child.statistics.score * OFFLINE_SCORE_WEIGHT / 100 + evaluate_features_to_score_x2(&board_features);
+
+        if (game_state_is_deadline_touched(&child)) {
+            key -= OFFLINE_DEADLINE_PENALTY;
+        }
+
+        children[index] = (offline_beam_entry_s) {
+            .state  = packed_game_state_make(&child),
+            .key    = key,
+            .parent = (uint16_t) parent_index,
+            .move   = (uint8_t) index,
+            .valid  = 1,
+        };
+    }
+}
+
+
+int offline_planner__select(offline_planner_s *planner)
+{
+    // 每次挑出键最大的一个，跳过与已选局面相同的（例如 O 的 4 种旋转），直到选满。
+    // 同分时取下标小的，结果与线程调度无关。
+    const int child_count = planner->beam_size * TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM;
+    offline_beam_entry_s selected[OFFLINE_BEAM_WIDTH];
+    int selected_count = 0;
+
+    while (selected_count < OFFLINE_BEAM_WIDTH) {
+        int best = -1;
+
+        for (int c = 0; c < child_count; ++c) {
+
+            if (planner->children[c].valid && (best == -1 || planner->children[c].key > planner->children[best].key)) {
+                best = c;
+            }
+        }
+
+        if (best == -1) {
+            break;
+        }
+
+        planner->children[best].valid = 0;
+        bool duplicate = false;
+
+        for (int k = 0; k < selected_count; ++k) {
+
+            if (memcmp(&selected[k].state, &planner->children[best].state, sizeof selected[k].state) == 0) {
+                duplicate = true;
+                break;
+            }
+        }
+
+        if (!duplicate) {
+            selected[selected_count] = planner->children[best];
+            selected[selected_count].valid = 1;
+            ++selected_count;
+        }
+    }
+
+    if (selected_count == 0) {
+        return 0;
+    }
+
+    offline_checkpoint_record_s records[OFFLINE_BEAM_WIDTH] = {{0}};
+
+    for (int k = 0; k < selected_count; ++k) {
+        planner->beam[k] = selected[k];
+        records[k] = (offline_checkpoint_record_s) {
+            .parent = selected[k].parent,
+            .move   = selected[k].move,
+            .valid  = 1,
+        };
+    }
+
+    planner->beam_size = selected_count;
+    fwrite(records, sizeof records[0], OFFLINE_BEAM_WIDTH, planner->checkpoint);
+    return selected_count;
+}
+
+
+DWORD WINAPI offline_planner__worker_thread_main(LPVOID parameter)
+{
+    offline_planner_s *planner = parameter;
+    long long seen_generation = 0;
+
+    while (true) {
+        EnterCriticalSection(&planner->lock);
+
+        while (planner->generation == seen_generation && !planner->stopping) {
+            SleepConditionVariableCS(&planner->work_ready, &planner->lock, INFINITE);
+        }
+
+        if (planner->stopping) {
+            LeaveCriticalSection(&planner->lock);
+            break;
+        }
+
+        seen_generation = planner->generation;
+        LeaveCriticalSection(&planner->lock);
+
+        while (true) {
+            const LONG parent_index = InterlockedIncrement(&planner->next_parent) - 1;
+
+            if (parent_index >= planner->beam_size) {
+                break;
+            }
+
+            offline_planner__expand(planner, (int) parent_index);
+        }
+
+        EnterCriticalSection(&planner->lock);
+
+        if (--planner->busy_workers == 0) {
+            WakeConditionVariable(&planner->work_done);
+        }
+
+        LeaveCriticalSection(&planner->lock);
+    }
+
+    return 0;
+}
+
+
+void self_test_check(self_test_s *test, bool ok, const char *what, long long case_index)
+{
+    test->checks++;
+
+    if (!ok) {
+        test->failures++;
+
+        // 同一种错误往往一错一大片，只打印前面几个
+        if (test->failures <= 20) {
+            printf("FAILED: %s (case %lld)\n", what, case_index);
+        }
+    }
+}
+
+
+uint64_t self_test__play_and_hash(int randomizer, uint64_t seed, int pieces, int *final_score)
+{
+    // 和 run_ai_1 一样玩一局，把每一步的 rotation、j_pos 与分数按 FNV-1a 散列起来
+    piece_generator_s generator = piece_generator_make(randomizer, seed);
+    const char first = piece_generator_next(&generator);
+    const char second = piece_generator_next(&generator);
+    game_state_s game = game_state_make(grid_make_blank(), first, second, false, statistics_make_blank());
+
+    uint64_t hash = 0xCBF29CE484222325u;
+
+    for (int piece = 0; piece < pieces && game_state_has_valid_move(&game); ++piece) {
+        const operation_s operation = game_state_make_decision(&game);
+        game = game_state_the_next_state_with_no_next_tetris(&game, operation);
+        game = game_state_with_next_tetris_filled_in(&game, piece_generator_next(&generator));
+
+        const int values[3] = {operation.rotation, operation.j_pos, game.statistics.score};
+
+        for (int v = 0; v < 3; ++v) {
+            hash = (hash ^ (uint64_t) (uint32_t) values[v]) * 0x100000001B3u;
+        }
+    }
+
+    *final_score = game.statistics.score;
+    return hash;
+}
+
+
+grid_s self_test__random_grid(long long case_index)
+{
+    // 底下随机若干行，每格七成概率有砖，满行随机挖掉一格；上面全空。不保证是真实对局里能出现的局面。
+    grid_s grid = grid_make_blank();
+    uint64_t counter = (uint64_t) case_index * 1024;
+    const int height = (int) (piece_generator__hash(SELF_TEST_SEED, counter++) % 17);
+
+    for (int i = TETRIS_GRID_I_LIM - height; i < TETRIS_GRID_I_LIM; ++i) {
+
+        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+            grid.content[i][j] = piece_generator__hash(SELF_TEST_SEED, counter++) % 10 < 7;
+        }
+
+        if (grid_get_row_bits(&grid, i) == ROW_FEATURES_TABLE_SIZE - 1) {
+            grid.content[i][piece_generator__hash(SELF_TEST_SEED, counter++) % TETRIS_GRID_J_LIM] = 0;
+        }
+    }
+    grid__rebuild_index(&grid);
+
+    return grid;
+}
+
+
+int self_test__count_cells(const grid_s *grid)
+{
+    int count = 0;
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+
+        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+            count += grid->content[i][j];
+        }
+    }
+
+    return count;
+}
+
+
+grid_s self_test__reference_clear_full_rows(const grid_s *grid, int *lines_cleared)
+{
+    // 从下往上把没满的行依次抄过去
+    grid_s return_value = grid_make_blank();
+    int target_i = TETRIS_GRID_I_LIM - 1;
+    *lines_cleared = 0;
+
+    for (int i = TETRIS_GRID_I_LIM - 1; i >= 0; --i) {
+
+        if (grid_get_row_bits(grid, i) == ROW_FEATURES_TABLE_SIZE - 1) {
+            ++*lines_cleared;
+            continue;
+        }
+
+        memcpy(return_value.content[target_i], grid->content[i], sizeof grid->content[i]);
+        --target_i;
+    }
+    grid__rebuild_index(&return_value);
+
+    return return_value;
+}
+
+
+int self_test__reference_i_pos(const grid_s *grid, char tetris, int rotation, int j_pos)
+{
+    // 从下往上逐个位置试：每个格子都在界内、没被占、上方也没有砖格
+    const shape_s shape = tetris_shapes[(unsigned char) tetris][rotation];
+
+    for (int i_pos = TETRIS_GRID_I_LIM - 1; i_pos >= 0; --i_pos) {
+        bool can_place = true;
+
+        for (int rel_i = 0; rel_i < shape_get_i_lim(&shape); ++rel_i) {
+
+            for (int rel_j = 0; rel_j < shape_get_j_lim(&shape); ++rel_j) {
+
+                if (shape_get_cell_hitbox_check(&shape, rel_i, rel_j) == 0) {
+                    continue;
+                }
+
+                const int abs_i = i_pos + rel_i;
+                const int abs_j = j_pos + rel_j;
+
+                if (!(abs_i < TETRIS_GRID_I_LIM && abs_j < TETRIS_GRID_J_LIM)) {
+                    can_place = false;
+                    continue;
+                }
+
+                for (int i = 0; i <= abs_i; ++i) {
+                    can_place = can_place && grid->content[i][abs_j] == 0;
+                }
+            }
+        }
+
+        if (can_place) {
+            return i_pos;
+        }
+    }
+
+    return -1;
+}
+
+
+bool self_test__is_grid_index_consistent(const grid_s *grid)
+{
+    grid_s rebuilt = *grid;
+    grid__rebuild_index(&rebuilt);
+    return memcmp(&rebuilt, grid, sizeof rebuilt) == 0;
+}
+
+
+void self_test__check_board_kernels(self_test_s *test, const grid_s *grid, long long case_index)
+{
+    // 这台机器支持的每一级内核都与 baseline 结果相同
+    const column_features_s expected_features = board_kernels__column_features_baseline(grid);
+    const full_rows_index_container_s expected_full_rows = board_kernels__full_rows_baseline(grid);
+
+    for (int level = ISA_LEVEL_V2; level <= board_kernels_detect_level(); ++level) {
+        const column_features_s features = board_kernels_table[level].column_features(grid);
+        const full_rows_index_container_s full_rows = board_kernels_table[level].full_rows(grid);
+
+        self_test_check(
+            test,
+            features.hole == expected_features.hole && features.col_transition == expected_features.col_transition,
+            "column features kernel", case_index
+        );
+        self_test_check(
+            test,
+            full_rows.size == expected_full_rows.size
+                && memcmp(full_rows.indices, expected_full_rows.indices, full_rows.size * sizeof full_rows.indices[0]) == 0,
+            "full rows kernel", case_index
+        );
+    }
+}
+
+
+double self_test__reference_evaluate_score(const game_state_s *game_state, int rotation, int j_pos, int i_pos)
+{
+    // 按评价函数的定义逐格计算，直接用 double，不用查表，也不用两倍的整数
+    const shape_s shape = tetris_shapes[(unsigned char) game_state->falling_tetris][rotation];
+    const grid_s placed = grid_with_a_tetris_placed(&game_state->grid, game_state->falling_tetris, rotation, j_pos, i_pos);
+    int lines_cleared = 0;
+    const grid_s grid = self_test__reference_clear_full_rows(&placed, &lines_cleared);
+
+    int hole = 0;
+    int well = 0;
+    int row_transition = 0;
+    int col_transition = 0;
+    int top_row = TETRIS_GRID_I_LIM;
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+
+        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+
+            if (grid.content[i][j] == 1) {
+                top_row = i < top_row ? i : top_row;
+                continue;
+            }
+
+            for (int i_scan = 0; i_scan < i; ++i_scan) {
+
+                if (grid.content[i_scan][j] == 1) {
+                    ++hole;
+                    break;
+                }
+            }
+
+            if (grid_get_with_default(&grid, i, j - 1, 1) == 1 && grid_get_with_default(&grid, i, j + 1, 1) == 1) {
+                ++well;
+            }
+        }
+
+        for (int j = -1; j < TETRIS_GRID_J_LIM; ++j) {
+            row_transition += grid_get_with_default(&grid, i, j, 1) != grid_get_with_default(&grid, i, j + 1, 1);
+        }
+    }
+
+    for (int i = -1; i < TETRIS_GRID_I_LIM; ++i) {
+
+        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+            col_transition += grid_get_with_default(&grid, i, j, 1) != grid_get_with_default(&grid, i + 1, j, 1);
+        }
+    }
+
+    const double landing_height = TETRIS_GRID_I_LIM - (i_pos + shape_get_i_lim(&shape) / 2.0);
+
+    // 侵蚀格数：和引擎一样，按方块外框落在被消掉的行里的格数算（外框里的空格也算），乘以消行数
+    int eroded_cells = 0;
+
+    for (int rel_i = 0; rel_i < shape_get_i_lim(&shape); ++rel_i) {
+
+        if (grid_get_row_bits(&placed, i_pos + rel_i) == ROW_FEATURES_TABLE_SIZE - 1) {
+            eroded_cells += shape_get_j_lim(&shape);
+        }
+    }
+
+    eroded_cells *= lines_cleared;
+
+    const int danger = top_row < SURVIVAL_DANGER_ROW ? SURVIVAL_DANGER_ROW - top_row : 0;
+
+    return HOLE_WEIGHT * hole
+        + WELL_WEIGHT * well
+        + ROW_TRANSITION_WEIGHT * row_transition
+        + COL_TRANSITION_WEIGHT * col_transition
+        + LANDING_HEIGHT_WEIGHT * landing_height
+        + ERODED_CELLS_WEIGHT * eroded_cells
+        + DANGER_WEIGHT * danger;
+}
+
+
+operation_s self_test__reference_best_move(const game_state_s *game_state)
+{
+    // 评价值最高者胜；同分比较优先级；再同分时取旋转次数少的（先遍历到的）
+    operation_s best = {.rotation = -1, .j_pos = -1};
+    double best_score = 0.0;
+
+    for (int rotation = 0; rotation < TETRIS_MAX_ANGLE; ++rotation) {
+
+        for (int j_pos = 0; j_pos < TETRIS_GRID_J_LIM; ++j_pos) {
+            const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+            const int i_pos = game_state__calculate_i_pos(game_state, operation);
+
+            if (i_pos == -1) {
+                continue;
+            }
+
+            const double score = self_test__reference_evaluate_score(game_state, rotation, j_pos, i_pos);
+
+            if (best.rotation == -1
+                || score > best_score
+                || (score == best_score && operation_get_priority(&operation) > operation_get_priority(&best)))
+            {
+                best = operation;
+                best_score = score;
+            }
+        }
+    }
+
+    return best;
+}
+
+
+void self_test__fuzz_one_case(self_test_s *test, long long case_index)
+{
+    const char tetrises[] = "IOLJZST";
+    const uint64_t counter = (uint64_t) case_index * 1024 + 1000;
+    const char falling = tetrises[piece_generator__hash(SELF_TEST_SEED, counter) % 7];
+    const char next = tetrises[piece_generator__hash(SELF_TEST_SEED, counter + 1) % 7];
+
+    const grid_s grid = self_test__random_grid(case_index);
+    game_state_s game = game_state_make(grid, falling, next, false, statistics_make_blank());
+    const int cells = self_test__count_cells(&grid);
+    const grid_feature_cache_s cache = grid_feature_cache_make(&grid);
+
+    // 一半的局面暂存为空
+    const uint64_t hold_draw = piece_generator__hash(SELF_TEST_SEED, counter + 3) % 14;
+    game.hold_tetris = hold_draw < 7 ? tetrises[hold_draw] : HOLD_EMPTY;
+
+    // 放置与消行
+    for (int rotation = 0; rotation < TETRIS_MAX_ANGLE; ++rotation) {
+
+        for (int j_pos = 0; j_pos < TETRIS_GRID_J_LIM; ++j_pos) {
+            const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+            const int i_pos = game_state__calculate_i_pos(&game, operation);
+            self_test_check(test, i_pos == self_test__reference_i_pos(&grid, falling, rotation, j_pos), "drop position", case_index);
+
+            if (i_pos == -1) {
+                continue;
+            }
+
+            const grid_s placed = grid_with_a_tetris_placed(&grid, falling, rotation, j_pos, i_pos);
+            self_test_check(test, self_test__count_cells(&placed) == cells + 4, "placement adds 4 cells", case_index);
+            self_test_check(test, self_test__is_grid_index_consistent(&placed), "grid index after placement", case_index);
+            self_test__check_board_kernels(test, &placed, case_index);
+
+            const game_state_s after = game_state_the_next_state_with_no_next_tetris(&game, operation);
+            const int lines = after.statistics.total_lines_cleared;
+            int reference_lines = 0;
+            const grid_s reference_grid = self_test__reference_clear_full_rows(&placed, &reference_lines);
+
+            self_test_check(test, lines == reference_lines && lines == grid_all_full_rows(&placed).size, "lines cleared", case_index);
+            self_test_check(test, self_test__count_cells(&after.grid) == cells + 4 - TETRIS_GRID_J_LIM * lines, "cells after clearing", case_index);
+            // 连同索引一起比：这边是增量更新的，参考实现是重建的
+            self_test_check(test, memcmp(&after.grid, &reference_grid, sizeof after.grid) == 0, "grid after clearing", case_index);
+            self_test_check(test, grid_all_full_rows(&after.grid).size == 0, "no full rows left", case_index);
+            self_test_check(test, after.deadline_touched == grid_is_deadline_touched(&after.grid), "deadline flag", case_index);
+            self_test_check(test, after.statistics.score == scores_of_line_cleared[lines], "score", case_index);
+
+            const double reference_score = self_test__reference_evaluate_score(&game, rotation, j_pos, i_pos);
+            self_test_check(
+                test,
+                game_state__calculate_evaluate_score_x2(&game, rotation, j_pos, i_pos) == (int) (2 * reference_score)
+                    && game_state__calculate_evaluate_score(&game, rotation, j_pos, i_pos) == reference_score,
+                "evaluate score", case_index
+            );
+
+            const evaluate_features_s features = game_state__calculate_evaluate_features(&game, rotation, j_pos, i_pos);
+            const evaluate_features_s cached_features = game_state__calculate_evaluate_features_cached(&game, &cache, rotation, j_pos, i_pos);
+            self_test_check(test, memcmp(&features, &cached_features, sizeof features) == 0, "cached features", case_index);
+
+            // 少算的几项记 0，其余各项与完整的评价函数相同
+            const evaluate_features_s row_features = game_state__calculate_evaluate_features_partial(&game, &cache, rotation, j_pos, i_pos, true);
+            const evaluate_features_s landing_features = game_state__calculate_evaluate_features_partial(&game, &cache, rotation, j_pos, i_pos, false);
+            self_test_check(
+                test,
+                row_features.well == features.well && row_features.row_transition == features.row_transition
+                    && row_features.landing_height_x2 == features.landing_height_x2 && row_features.eroded_cells == features.eroded_cells
+                    && row_features.hole == 0 && row_features.col_transition == 0 && row_features.danger == 0,
+                "partial features with rows", case_index
+            );
+            self_test_check(
+                test,
+                landing_features.landing_height_x2 == features.landing_height_x2 && landing_features.eroded_cells == features.eroded_cells
+                    && landing_features.well == 0 && landing_features.row_transition == 0,
+                "partial features", case_index
+            );
+        }
+    }
+
+    // 选择
+    if (game_state_has_valid_move(&game)) {
+        const operation_s operation = game_state_make_decision(&game);
+        const operation_s reference = self_test__reference_best_move(&game);
+        self_test_check(test, operation.rotation == reference.rotation && operation.j_pos == reference.j_pos, "best move", case_index);
+
+        const operation_s greedy = game_state_make_decision_at_level(&game, ENGINE_LEVEL_GREEDY);
+        self_test_check(test, greedy.rotation == reference.rotation && greedy.j_pos == reference.j_pos, "engine level greedy", case_index);
+    }
+
+    // 暂存：选出的是两个分支里选择键更大的那个，不暂存的一方优先
+    const game_state_s swapped = game_state_can_hold(&game) ? game_state__with_hold_swapped(&game) : game;
+
+    if (game_state_can_hold(&game) && (game_state_has_valid_move(&game) || game_state_has_valid_move(&swapped))) {
+        const operation_s operation = game_state_make_decision_with_hold(&game);
+        const evaluate_weights_s weights = evaluate_weights_make_default();
+        candidate_s candidates[TETRIS_MAX_ANGLE * TETRIS_GRID_J_LIM];
+        bool expected_hold = game_state_has_valid_move(&swapped);
+        operation_s expected = expected_hold ? game_state__calculate_best_move_with_weights(&swapped, &weights, candidates) : operation;
+
+        if (game_state_has_valid_move(&game)) {
+            const operation_s without_hold = game_state_make_decision(&game);
+            const int without_hold_score_x2 = game_state__calculate_evaluate_score_x2(&game, without_hold.rotation, without_hold.j_pos, game_state__calculate_i_pos(&game, without_hold));
+            const int64_t without_hold_key = operation_make_selection_key(&without_hold, without_hold_score_x2);
+
+            if (expected_hold) {
+                const int with_hold_score_x2 = game_state__calculate_evaluate_score_x2(&swapped, expected.rotation, expected.j_pos, game_state__calculate_i_pos(&swapped, expected));
+                expected_hold = operation_make_selection_key(&expected, with_hold_score_x2) > without_hold_key;
+            }
+
+            expected = expected_hold ? expected : without_hold;
+        }
+
+        self_test_check(
+            test,
+            operation.hold == expected_hold && operation.rotation == expected.rotation && operation.j_pos == expected.j_pos,
+            "best move with hold", case_index
+        );
+
+        const game_state_s after = game_state_the_next_state_with_no_next_tetris(&game, operation);
+        self_test_check(
+            test,
+            after.hold_tetris == (operation.hold ? falling : game.hold_tetris)
+                && after.falling_tetris == (operation.hold && game.hold_tetris == HOLD_EMPTY ? '?' : next),
+            "hold swap", case_index
+        );
+    }
+
+    // 逐行的查表与找最高行
+    int top_row = TETRIS_GRID_I_LIM;
+
+    for (int i = TETRIS_GRID_I_LIM - 1; i >= 0; --i) {
+        const row_features_s looked_up = row_features_table[grid_get_row_bits(&grid, i)];
+        const row_features_s calculated = row_features_calculate(&grid, i);
+        self_test_check(test, memcmp(&looked_up, &calculated, sizeof looked_up) == 0, "row features table", case_index);
+
+        if (!grid_is_row_empty(&grid, i)) {
+            top_row = i;
+        }
+    }
+
+    self_test_check(test, grid_get_top_occupied_row(&grid) == top_row, "top occupied row", case_index);
+
+    // 紧凑局面与搜索节点的来回转换
+    const packed_game_state_s packed = packed_game_state_make(&game);
+    const game_state_s unpacked = packed_game_state_to_game_state(&packed);
+    self_test_check(
+        test,
+        memcmp(&unpacked.grid, &game.grid, sizeof game.grid) == 0
+            && unpacked.falling_tetris == falling && unpacked.next_tetris == next && unpacked.hold_tetris == game.hold_tetris
+            && unpacked.statistics.score == game.statistics.score,
+        "packed game state round trip", case_index
+    );
+
+    const search_node_s node = search_node_make_from_game_state(&game);
+    const game_state_s from_node = search_node_to_game_state(&node);
+    self_test_check(test, memcmp(&from_node.grid, &game.grid, sizeof game.grid) == 0, "search node round trip", case_index);
+
+    // 垃圾行
+    const int garbage = (int) (piece_generator__hash(SELF_TEST_SEED, counter + 2) % 4) + 1;
+
+    if (top_row >= garbage) {
+        const grid_s raised = grid_with_garbage_rows_inserted(&grid, garbage, (int) (case_index % TETRIS_GRID_J_LIM));
+        self_test_check(test, self_test__count_cells(&raised) == cells + (TETRIS_GRID_J_LIM - 1) * garbage, "garbage rows", case_index);
+        self_test_check(test, self_test__is_grid_index_consistent(&raised), "grid index after garbage rows", case_index);
+    }
+}
+
+
+void self_test__check_piece_generators(self_test_s *test)
+{
+    // 跳到第 n 个方块，与从头顺序生成的第 n 个相同
+    char sequence[SELF_TEST_SEQUENCE_LENGTH];
+
+    for (int randomizer = PIECE_RANDOMIZER_UNIFORM; randomizer <= PIECE_RANDOMIZER_HISTORY; ++randomizer) {
+        piece_generator_s generator = piece_generator_make(randomizer, SELF_TEST_SEED);
+
+        for (int k = 0; k < SELF_TEST_SEQUENCE_LENGTH; ++k) {
+            sequence[k] = piece_generator_next(&generator);
+        }
+
+        for (int trial = 0; trial < 100; ++trial) {
+            const int position = (int) (piece_generator__hash(SELF_TEST_SEED, (uint64_t) trial) % SELF_TEST_SEQUENCE_LENGTH);
+            piece_generator_seek(&generator, position);
+            self_test_check(test, piece_generator_next(&generator) == sequence[position], "piece generator seek", trial);
+        }
+    }
+}
+
+
+move_cache_s *move_cache_make(void)
+{
+    move_cache_s *cache = malloc(sizeof *cache);
+    assert(cache != NULL);
+
+    cache->capacity = 1LL << MOVE_CACHE_CAPACITY_BITS;
+    cache->entries = calloc((size_t) cache->capacity, sizeof cache->entries[0]);
+    assert(cache->entries != NULL);
+
+    cache->size = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->validations = 0;
+    cache->validation_mismatches = 0;
+
+    return cache;
+}
+
+
+void move_cache_free(move_cache_s *cache)
+{
+    free(cache->entries);
+    free(cache);
+}
+
+
+bool move_cache_load(move_cache_s *cache, const char *file_name)
+{
+    FILE *file = fopen(file_name, "rb");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    uint32_t header[2];
+
+    if (fread(header, sizeof header[0], 2, file) != 2 || header[0] != MOVE_CACHE_HEIGHT_CLIP) {
+        fclose(file);
+        return false;
+    }
+
+    for (uint32_t k = 0; k < header[1]; ++k) {
+        uint64_t entry;
+
+        if (fread(&entry, sizeof entry, 1, file) != 1) {
+            break;
+        }
+
+        const operation_s operation = {.rotation = (int) ((entry >> 4) & 0xF), .j_pos = (int) (entry & 0xF)};
+        move_cache_insert(cache, entry >> 8, operation);
+    }
+
+    fclose(file);
+    return true;
+}
+
+
+void move_cache_save(const move_cache_s *cache, const char *file_name)
+{
+    FILE *file = fopen(file_name, "wb");
+    assert(file != NULL);
+
+    const uint32_t header[2] = {MOVE_CACHE_HEIGHT_CLIP, (uint32_t) cache->size};
+    fwrite(header, sizeof header[0], 2, file);
+
+    for (long long k = 0; k < cache->capacity; ++k) {
+
+        if (cache->entries[k] != 0) {
+            fwrite(&cache->entries[k], sizeof cache->entries[k], 1, file);
+        }
+    }
+
+    fclose(file);
+}
+
+
+bool move_cache_lookup(const move_cache_s *cache, uint64_t key, operation_s *operation)
+{
+    const uint64_t entry = cache->entries[move_cache__slot_of(cache, key)];
+
+    if (entry == 0) {
+        return false;
+    }
+
+    *operation = (operation_s) {.rotation = (int) ((entry >> 4) & 0xF), .j_pos = (int) (entry & 0xF)};
+    return true;
+}
+
+
+void move_cache_insert(move_cache_s *cache, uint64_t key, operation_s operation)
+{
+    const long long slot = move_cache__slot_of(cache, key);
+
+    if (cache->entries[slot] == 0) {
+
+        // 太满了探测会变长，干脆不再插入
+        if (cache->size * 4 >= cache->capacity * 3) {
+            return;
+        }
+
+        cache->size++;
+    }
+
+    cache->entries[slot] = (key << 8) | ((uint64_t) operation.rotation << 4) | (uint64_t) operation.j_pos;
+}
+
+
+void move_cache_print_statistics(const move_cache_s *cache)
+{
+    const long long lookups = cache->hits + cache->misses;
+
+    printf("move cache: %lld entries, %lld hits, %lld misses, hit rate %.1f%%\n",
+        cache->size, cache->hits, cache->misses, lookups > 0 ? 100.0 * cache->hits / lookups : 0.0);
+
+#ifdef MOVE_CACHE_VALIDATION
+    printf("move cache validation: %lld checked, %lld mismatches (%.2f%%)\n",
+        cache->validations, cache->validation_mismatches,
+        cache->validations > 0 ? 100.0 * cache->validation_mismatches / cache->validations : 0.0);
+#endif /* MOVE_CACHE_VALIDATION */
+}
+
+
+uint64_t move_cache__key_of(const game_state_s *game_state)
+{
+    _Static_assert(MOVE_CACHE_HEIGHT_CLIP <= 8, "每列的相对高度只有 3 位");
+    const grid_s *grid = &game_state->grid;
+    int lowest_column_top = 0;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+
+        if (grid->column_holes[j] != 0) {
+            return 0;
+        }
+
+        lowest_column_top = grid->column_tops[j] > lowest_column_top ? grid->column_tops[j] : lowest_column_top;
+    }
+
+    uint64_t contour = 0;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        const int relative_height = lowest_column_top - grid->column_tops[j];
+        contour = (contour << 3) | (uint64_t) (relative_height < MOVE_CACHE_HEIGHT_CLIP ? relative_height : MOVE_CACHE_HEIGHT_CLIP - 1);
+    }
+
+    return (contour << 7) | (unsigned char) game_state->falling_tetris;
+}
+
+
+long long move_cache__slot_of(const move_cache_s *cache, uint64_t key)
+{
+    // 乘法散列，然后线性探测，直到找到这个键或空位
+    long long slot = (long long) ((key * 0x9E3779B97F4A7C15ull) >> (64 - MOVE_CACHE_CAPACITY_BITS));
+
+    while (cache->entries[slot] != 0 && (cache->entries[slot] >> 8) != key) {
+        slot = (slot + 1) & (cache->capacity - 1);
+    }
+
+    return slot;
+}
+
+
+void board_kernels_initialize(void)
+{
+    const int detected = board_kernels_detect_level();
+    const char *forced = getenv(ISA_ENVIRONMENT_VARIABLE);
+    const int forced_level = forced != NULL ? board_kernels__level_from_name(forced) : -1;
+
+    board_kernels = &board_kernels_table[0 <= forced_level && forced_level <= detected ? forced_level : detected];
+}
+
+
+int board_kernels_detect_level(void)
+{
+#if defined(ISA_DISPATCH_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int max_leaf = info[0];
+
+    __cpuid(info, 1);
+    const bool popcnt = (info[2] >> 23) & 1;
+    const bool osxsave = (info[2] >> 27) & 1;
+    const bool avx = (info[2] >> 28) & 1;
+
+    bool bmi1 = false;
+    bool avx2 = false;
+    bool bmi2 = false;
+
+    if (max_leaf >= 7) {
+        __cpuidex(info, 7, 0);
+        bmi1 = (info[1] >> 3) & 1;
+        avx2 = (info[1] >> 5) & 1;
+        bmi2 = (info[1] >> 8) & 1;
+    }
+
+    // AVX 的寄存器还要操作系统在切换线程时保存
+    const bool os_saves_avx = osxsave && avx && (_xgetbv(0) & 6) == 6;
+
+    if (popcnt && os_saves_avx && avx2 && bmi1 && bmi2) {
+        return ISA_LEVEL_V3;
+    }
+
+    return popcnt ? ISA_LEVEL_V2 : ISA_LEVEL_BASELINE;
+#elif defined(ISA_DISPATCH_X86)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("popcnt") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2")) {
+        return ISA_LEVEL_V3;
+    }
+
+    return __builtin_cpu_supports("popcnt") ? ISA_LEVEL_V2 : ISA_LEVEL_BASELINE;
+#else
+    return ISA_LEVEL_BASELINE;
+#endif /* ISA_DISPATCH_X86 */
+}
+
+
+int board_kernels__level_from_name(const char *name)
+{
+    for (int level = 0; level < ISA_LEVEL_COUNT; ++level) {
+
+        if (strcmp(name, board_kernels_table[level].name) == 0) {
+            return level;
+        }
+    }
+
+    return -1;
+}
+
+
+column_features_s board_kernels__column_features_baseline(const grid_s *grid)
+{
+    return (column_features_s) {
+        .hole           = grid_count_holes(grid),
+        .col_transition = grid_count_col_transitions(grid),
+    };
+}
+
+
+full_rows_index_container_s board_kernels__full_rows_baseline(const grid_s *grid)
+{
+    // 所有列的位与起来，剩下的 1 就是满行
+    uint32_t full_rows = GRID_COLUMN_MASK;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        full_rows &= grid_get_column_bits(grid, j);
+    }
+
+    // 从上到下（从低位到高位）依次取出
+    full_rows_index_container_s container = full_rows_index_container_make_blank();
+
+    while (full_rows != 0) {
+        container = full_rows_index_container_with_a_row_index_appended(&container, bits_count_trailing_zeros(full_rows));
+        full_rows &= full_rows - 1;
+    }
+
+    return container;
+}
+
+
+#if defined(ISA_DISPATCH_X86) && defined(_MSC_VER)
+
+// MSVC 没法让编译器换指令集，只能直接用内建函数写。v3 的数洞和 v2 相同，多的是找满行用 TZCNT。
+
+column_features_s board_kernels__column_features_v2(const grid_s *grid)
+{
+    column_features_s features = {.hole = 0, .col_transition = 0};
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        const uint32_t bits = 1u | (grid_get_column_bits(grid, j) << 1) | (1u << (TETRIS_GRID_I_LIM + 1));
+        features.hole += ISA_POPCOUNT32(grid->column_holes[j]);
+        features.col_transition += ISA_POPCOUNT32((bits ^ (bits >> 1)) & ((1u << (TETRIS_GRID_I_LIM + 1)) - 1));
+    }
+
+    return features;
+}
+
+
+full_rows_index_container_s board_kernels__full_rows_v2(const grid_s *grid)
+{
+    // POPCNT 对找满行没有帮助
+    return board_kernels__full_rows_baseline(grid);
+}
+
+
+column_features_s board_kernels__column_features_v3(const grid_s *grid)
+{
+    return board_kernels__column_features_v2(grid);
+}
+
+
+full_rows_index_container_s board_kernels__full_rows_v3(const grid_s *grid)
+{
+    uint32_t full_rows = GRID_COLUMN_MASK;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        full_rows &= grid_get_column_bits(grid, j);
+    }
+
+    full_rows_index_container_s container = full_rows_index_container_make_blank();
+
+    while (full_rows != 0) {
+        container = full_rows_index_container_with_a_row_index_appended(&container, ISA_TZCNT32(full_rows));
+        full_rows &= full_rows - 1;
+    }
+
+    return container;
+}
+
+#elif defined(ISA_DISPATCH_X86)
+
+// 下面两级就是 baseline 的代码换一套指令集编译：grid_count_holes 等都内联进来，
+// GCC 认得出 bits_count 的写法，会换成 POPCNT；v3 打开了 AVX2，每列的循环交给编译器去向量化。
+
+ISA_TARGET_V2 ISA_INLINE_CALLEES column_features_s board_kernels__column_features_v2(const grid_s *grid)
+{
+    return board_kernels__column_features_baseline(grid);
+}
+
+
+ISA_TARGET_V2 ISA_INLINE_CALLEES full_rows_index_container_s board_kernels__full_rows_v2(const grid_s *grid)
+{
+    return board_kernels__full_rows_baseline(grid);
+}
+
+
+ISA_TARGET_V3 ISA_INLINE_CALLEES column_features_s board_kernels__column_features_v3(const grid_s *grid)
+{
+    return board_kernels__column_features_baseline(grid);
+}
+
+
+ISA_TARGET_V3 ISA_INLINE_CALLEES full_rows_index_container_s board_kernels__full_rows_v3(const grid_s *grid)
+{
+    return board_kernels__full_rows_baseline(grid);
+}
+
+#else
+
+column_features_s board_kernels__column_features_v2(const grid_s *grid)
+{
+    return board_kernels__column_features_baseline(grid);
+}
+
+
+full_rows_index_container_s board_kernels__full_rows_v2(const grid_s *grid)
+{
+    return board_kernels__full_rows_baseline(grid);
+}
+
+
+column_features_s board_kernels__column_features_v3(const grid_s *grid)
+{
+    return board_kernels__column_features_baseline(grid);
+}
+
+
+full_rows_index_container_s board_kernels__full_rows_v3(const grid_s *grid)
+{
+    return board_kernels__full_rows_baseline(grid);
+}
+
+#endif /* ISA_DISPATCH_X86 */
+
+
+telemetry_game_s telemetry_game_make(uint32_t game_id)
+{
+    return (telemetry_game_s) {
+        .game_id          = game_id,
+        .score            = 0,
+        .placed_blocks    = 0,
+        .lines_cleared    = {0, 0, 0, 0},
+        .max_stack_height = 0,
+    };
+}
+
+
+telemetry_s *telemetry_make(LONG game_capacity)
+{
+    telemetry_s *telemetry = malloc(sizeof *telemetry);
+    assert(telemetry != NULL);
+
+    telemetry->games = malloc((size_t) game_capacity * sizeof telemetry->games[0]);
+    assert(telemetry->games != NULL);
+    telemetry->game_capacity = game_capacity;
+    telemetry->game_count = 0;
+
+    for (int k = 0; k < TELEMETRY_LATENCY_BUCKETS; ++k) {
+        telemetry->latency_buckets[k] = 0;
+    }
+
+    telemetry->ticks_per_second = deadline__ticks_per_second();
+    return telemetry;
+}
+
+
+void telemetry_free(telemetry_s *telemetry)
+{
+    free(telemetry->games);
+    free(telemetry);
+}
+
+
+void telemetry_write(telemetry_s *telemetry)
+{
+    const LONG game_count = telemetry__recorded_game_count(telemetry);
+    qsort(telemetry->games, (size_t) game_count, sizeof telemetry->games[0], telemetry__compare_games);
+
+#ifdef TELEMETRY_BINARY
+    FILE *file = fopen(TELEMETRY_BINARY_FILE_NAME, "wb");
+    assert(file != NULL);
+
+    const uint32_t header[2] = {(uint32_t) game_count, TELEMETRY_LATENCY_BUCKETS};
+    fwrite(header, sizeof header[0], 2, file);
+    fwrite(telemetry->games, sizeof telemetry->games[0], (size_t) game_count, file);
+
+    for (int k = 0; k < TELEMETRY_LATENCY_BUCKETS; ++k) {
+        const int64_t count = telemetry->latency_buckets[k];
+        fwrite(&count, sizeof count, 1, file);
+    }
+
+    fclose(file);
+#else
+    FILE *games_file = fopen(TELEMETRY_GAMES_FILE_NAME, "w");
+    assert(games_file != NULL);
+    fprintf(games_file, "game_id,score,placed_blocks,lines_1,lines_2,lines_3,lines_4,max_stack_height\n");
+
+    for (LONG k = 0; k < game_count; ++k) {
+        const telemetry_game_s *game = &telemetry->games[k];
+        fprintf(
+            games_file, "%u,%d,%d,%d,%d,%d,%d,%d\n",
+            game->game_id, game->score, game->placed_blocks,
+            game->lines_cleared[0], game->lines_cleared[1], game->lines_cleared[2], game->lines_cleared[3],
+            game->max_stack_height
+        );
+    }
+
+    fclose(games_file);
+
+    FILE *latency_file = fopen(TELEMETRY_LATENCY_FILE_NAME, "w");
+    assert(latency_file != NULL);
+    fprintf(latency_file, "lower_ns,upper_ns,count\n");
+
+    for (int k = 0; k < TELEMETRY_LATENCY_BUCKETS; ++k) {
+        fprintf(latency_file, "%lld,%lld,%lld\n", k == 0 ? 0LL : 1LL << k, 1LL << (k + 1), (long long) telemetry->latency_buckets[k]);
+    }
+
+    fclose(latency_file);
+#endif /* TELEMETRY_BINARY */
+}
+
+
+void telemetry_print_summary(const telemetry_s *telemetry)
+{
+    const LONG game_count = telemetry__recorded_game_count(telemetry);
+    long long score = 0;
+    long long placed_blocks = 0;
+    long long max_stack_height = 0;
+
+    for (LONG k = 0; k < game_count; ++k) {
+        score += telemetry->games[k].score;
+        placed_blocks += telemetry->games[k].placed_blocks;
+        max_stack_height += telemetry->games[k].max_stack_height;
+    }
+
+    long long decisions = 0;
+
+    for (int k = 0; k < TELEMETRY_LATENCY_BUCKETS; ++k) {
+        decisions += telemetry->latency_buckets[k];
+    }
+
+    printf("telemetry: %ld games", (long) game_count);
+
+    if (telemetry->game_count > telemetry->game_capacity) {
+        printf(" (%ld dropped)", (long) (telemetry->game_count - telemetry->game_capacity));
+    }
+
+    if (game_count > 0) {
+        printf(
+            ", mean score %.1f, mean placed_blocks %.1f, mean max_stack_height %.2f",
+            (double) score / game_count, (double) placed_blocks / game_count, (double) max_stack_height / game_count
+        );
+    }
+
+    printf("\n");
+
+    // 直方图只能给出分位数落在哪个桶，打印桶的上界
+    const double quantiles[3] = {0.5, 0.9, 0.99};
+    printf("telemetry: %lld decisions, latency", decisions);
+
+    for (int q = 0; q < 3; ++q) {
+        long long seen = 0;
+        int k = 0;
+
+        while (k < TELEMETRY_LATENCY_BUCKETS - 1 && seen + telemetry->latency_buckets[k] < quantiles[q] * decisions) {
+            seen += telemetry->latency_buckets[k];
+            ++k;
+        }
+
+        printf(" p%g < %lld ns", quantiles[q] * 100, 1LL << (k + 1));
+    }
+
+    printf("\n");
+    fflush(stdout);
+}
+
+
+LONG telemetry__recorded_game_count(const telemetry_s *telemetry)
+{
+    return telemetry->game_count < telemetry->game_capacity ? telemetry->game_count : telemetry->game_capacity;
+}
+
+
+int telemetry__compare_games(const void *a, const void *b)
+{
+    const uint32_t id_a = ((const telemetry_game_s *) a)->game_id;
+    const uint32_t id_b = ((const telemetry_game_s *) b)->game_id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+
+telemetry_recorder_s telemetry_recorder_make(telemetry_s *telemetry)
+{
+    telemetry_recorder_s recorder;
+    recorder.telemetry = telemetry;
+    recorder.game_count = 0;
+
+    for (int k = 0; k < TELEMETRY_LATENCY_BUCKETS; ++k) {
+        recorder.latency_buckets[k] = 0;
+    }
+
+    return recorder;
+}
+
+
+void telemetry_recorder_record_decision(telemetry_recorder_s *recorder, telemetry_game_s *game, long long ticks, const game_state_s *game_state)
+{
+    // 换算成纳秒再取以 2 为底的对数
+    const long long nanoseconds = ticks * 1000000000LL / recorder->telemetry->ticks_per_second;
+    int bucket = 0;
+
+    while (bucket < TELEMETRY_LATENCY_BUCKETS - 1 && (nanoseconds >> (bucket + 1)) != 0) {
+        ++bucket;
+    }
+
+    recorder->latency_buckets[bucket]++;
+
+    const int stack_height = TETRIS_GRID_I_LIM - grid_get_top_occupied_row(&game_state->grid);
+
+    if (stack_height > game->max_stack_height) {
+        game->max_stack_height = stack_height;
+    }
+}
+
+
+void telemetry_recorder_record_game_over(telemetry_recorder_s *recorder, telemetry_game_s *game, const game_state_s *game_state)
+{
+    game->score = game_state->statistics.score;
+    game->placed_blocks = game_state->statistics.placed_blocks;
+
+    for (int lines = 1; lines <= 4; ++lines) {
+        game->lines_cleared[lines - 1] = game_state->statistics.lines_cleared[lines];
+    }
+
+    recorder->games[recorder->game_count++] = *game;
+
+    if (recorder->game_count == TELEMETRY_RECORDER_BATCH_GAMES) {
+        telemetry_recorder_flush(recorder);
+    }
+}
+
+
+void telemetry_recorder_flush(telemetry_recorder_s *recorder)
+{
+    telemetry_s *telemetry = recorder->telemetry;
+
+    // 先预留一段位置，再把这一批抄进去；别的线程预留的是别的位置
+    if (recorder->game_count > 0) {
+        const LONG end = InterlockedAdd(&telemetry->game_count, recorder->game_count);
+        const LONG begin = end - recorder->game_count;
+
+        for (LONG k = begin; k < end && k < telemetry->game_capacity; ++k) {
+            telemetry->games[k] = recorder->games[k - begin];
+        }
+
+        recorder->game_count = 0;
+    }
+
+    for (int k = 0; k < TELEMETRY_LATENCY_BUCKETS; ++k) {
+
+        if (recorder->latency_buckets[k] != 0) {
+            InterlockedAdd64(&telemetry->latency_buckets[k], recorder->latency_buckets[k]);
+            recorder->latency_buckets[k] = 0;
+        }
+    }
+}
+
+
+visualizer_snapshot_s visualizer_snapshot_make(const game_state_s *game_state)
+{
+    visualizer_snapshot_s snapshot;
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+        snapshot.rows[i] = grid_get_row_bits(&game_state->grid, i);
+    }
+
+    snapshot.falling_tetris = game_state->falling_tetris;
+    snapshot.score = game_state->statistics.score;
+    snapshot.placed_blocks = game_state->statistics.placed_blocks;
+    snapshot.total_lines_cleared = game_state->statistics.total_lines_cleared;
+    return snapshot;
+}
+
+
+visualizer_s *visualizer_open(void)
+{
+    visualizer_s *visualizer = malloc(sizeof *visualizer);
+    assert(visualizer != NULL);
+
+    visualizer->queue_head = 0;
+    visualizer->queue_size = 0;
+    visualizer->dropped = 0;
+    visualizer->stopping = false;
+    visualizer->drawn_anything = false;
+    visualizer->frame_size = 0;
+    visualizer->frames = 0;
+
+    visualizer__enable_virtual_terminal();
+    InitializeCriticalSection(&visualizer->lock);
+    visualizer->thread = CreateThread(NULL, 0, visualizer__thread_main, visualizer, 0, NULL);
+    assert(visualizer->thread != NULL);
+
+    return visualizer;
+}
+
+
+void visualizer_close(visualizer_s *visualizer)
+{
+    EnterCriticalSection(&visualizer->lock);
+    visualizer->stopping = true;
+    LeaveCriticalSection(&visualizer->lock);
+
+    WaitForSingleObject(visualizer->thread, INFINITE);
+    CloseHandle(visualizer->thread);
+    DeleteCriticalSection(&visualizer->lock);
+    free(visualizer);
+}
+
+
+void visualizer_push(visualizer_s *visualizer, const game_state_s *game_state)
+{
+    // 快照在锁外做好，锁里只拷贝一次
+    const visualizer_snapshot_s snapshot = visualizer_snapshot_make(game_state);
+
+    EnterCriticalSection(&visualizer->lock);
+
+    if (visualizer->queue_size == VISUALIZER_QUEUE_SIZE) {
+        visualizer->queue_head = (visualizer->queue_head + 1) % VISUALIZER_QUEUE_SIZE;
+        visualizer->queue_size--;
+        visualizer->dropped++;
+    }
+
+    visualizer->queue[(visualizer->queue_head + visualizer->queue_size) % VISUALIZER_QUEUE_SIZE] = snapshot;
+    visualizer->queue_size++;
+
+    LeaveCriticalSection(&visualizer->lock);
+}
+
+
+bool visualizer__take_latest(visualizer_s *visualizer, visualizer_snapshot_s *snapshot, bool *stopping)
+{
+    EnterCriticalSection(&visualizer->lock);
+
+    const bool any = visualizer->queue_size > 0;
+
+    if (any) {
+        *snapshot = visualizer->queue[(visualizer->queue_head + visualizer->queue_size - 1) % VISUALIZER_QUEUE_SIZE];
+        visualizer->dropped += visualizer->queue_size - 1;
+        visualizer->queue_head = 0;
+        visualizer->queue_size = 0;
+    }
+
+    *stopping = visualizer->stopping;
+    LeaveCriticalSection(&visualizer->lock);
+    return any;
+}
+
+
+void visualizer__render(visualizer_s *visualizer, const visualizer_snapshot_s *snapshot)
+{
+    // 第 1 行是状态，第 2 行和第 23 行是上下边框，网格第 i 行画在第 i + 3 行，第 j 列画在第 2 * j + 2 列（都从 1 开始数）
+    visualizer->frame_size = 0;
+
+    if (!visualizer->drawn_anything) {
+        // 隐藏光标、清屏，画边框；然后假装上一帧是"全都不一样"，下面就会把每一格都画出来
+        visualizer__append(visualizer, "\x1b[?25l\x1b[2J\x1b[2;1H+--------------------+");
+
+        for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+            visualizer__append(visualizer, "\x1b[%d;1H|\x1b[%d;22H|", i + 3, i + 3);
+            visualizer->drawn_rows[i] = (uint16_t) ~snapshot->rows[i];
+        }
+
+        visualizer__append(visualizer, "\x1b[%d;1H+--------------------+", TETRIS_GRID_I_LIM + 3);
+        visualizer->drawn_anything = true;
+    }
+
+    // 状态行很短，每帧都重写；\x1b[K 清掉行尾上一帧多出来的字
+    visualizer__append(
+        visualizer, "\x1b[1;1Hscore %d  placed %d  lines %d  falling %c  frames %lld  skipped %lld\x1b[K",
+        snapshot->score, snapshot->placed_blocks, snapshot->total_lines_cleared, snapshot->falling_tetris,
+        visualizer->frames, visualizer->dropped
+    );
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+        const uint16_t changed = (snapshot->rows[i] ^ visualizer->drawn_rows[i]) & ((1u << TETRIS_GRID_J_LIM) - 1);
+        int cursor_j = -1;  // 光标现在停在这一行的哪一格前面，-1 表示不知道
+
+        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+
+            if (((changed >> j) & 1) == 0) {
+                continue;
+            }
+
+            // 紧挨着上一个画过的格子时不用移动光标
+            if (cursor_j != j) {
+                visualizer__append(visualizer, "\x1b[%d;%dH", i + 3, 2 * j + 2);
+            }
+
+            visualizer__append(visualizer, "%s", (snapshot->rows[i] >> j) & 1 ? "[]" : "  ");
+            cursor_j = j + 1;
+        }
+
+        visualizer->drawn_rows[i] = snapshot->rows[i];
+    }
+
+    visualizer__append(visualizer, "\x1b[%d;1H", TETRIS_GRID_I_LIM + 4);
+
+    // 一帧只写一次
+    fwrite(visualizer->frame, 1, visualizer->frame_size, stderr);
+    fflush(stderr);
+    visualizer->frames++;
+}
+
+
+void visualizer__append(visualizer_s *visualizer, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    const int length = vsnprintf(
+        visualizer->frame + visualizer->frame_size, sizeof visualizer->frame - visualizer->frame_size, format, arguments
+    );
+    va_end(arguments);
+
+    // 一帧最多也就几千字节，装不下说明 VISUALIZER_FRAME_BUFFER_SIZE 设小了
+    assert(length >= 0 && (size_t) length < sizeof visualizer->frame - visualizer->frame_size);
+    visualizer->frame_size += (size_t) length;
+}
+
+
+void visualizer__enable_virtual_terminal(void)
+{
+    // Windows 10 以后的控制台要打开这个模式才认 ANSI 转义序列；重定向到文件时会失败，不用管
+    const HANDLE output = GetStdHandle(STD_ERROR_HANDLE);
+    DWORD mode = 0;
+
+    if (output != INVALID_HANDLE_VALUE && GetConsoleMode(output, &mode)) {
+        SetConsoleMode(output, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+    }
+}
+
+
+DWORD WINAPI visualizer__thread_main(LPVOID parameter)
+{
+    visualizer_s *visualizer = parameter;
+    const long long ticks_per_frame = deadline__ticks_per_second() / VISUALIZER_FPS;
+
+    while (true) {
+        LARGE_INTEGER begin;
+        QueryPerformanceCounter(&begin);
+
+        visualizer_snapshot_s snapshot;
+        bool stopping;
+
+        if (visualizer__take_latest(visualizer, &snapshot, &stopping)) {
+            visualizer__render(visualizer, &snapshot);
+        }
+
+        // 主循环在停止之前推进来的最后一个快照已经在上面画过了
+        if (stopping) {
+            break;
+        }
+
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&end);
+        const long long remaining_ticks = ticks_per_frame - (end.QuadPart - begin.QuadPart);
+
+        if (remaining_ticks > 0) {
+            Sleep((DWORD) (remaining_ticks * 1000 / deadline__ticks_per_second()));
+        }
+    }
+
+    // 恢复光标
+    fputs("\x1b[?25h", stderr);
+    fflush(stderr);
+    return 0;
+}
+
+
+board_batch_s board_batch_make_blank(void)
+{
+    board_batch_s batch;
+    memset(&batch, 0, sizeof batch);
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        board_batch_clear_lane(&batch, lane);
+    }
+
+    const char nothing[BATCH_LANES] = {0};
+    board_batch_load_pieces(&batch, nothing);
+    return batch;
+}
+
+
+void board_batch_clear_lane(board_batch_s *batch, int lane)
+{
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        batch->columns[j][lane] = 0;
+        batch->column_tops[j][lane] = TETRIS_GRID_I_LIM;
+    }
+}
+
+
+void board_batch_load_pieces(board_batch_s *batch, const char falling_tetrises[BATCH_LANES])
+{
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+
+        for (int rotation = 0; rotation < TETRIS_MAX_ANGLE; ++rotation) {
+            const shape_s *shape = &tetris_shapes[(unsigned char) falling_tetrises[lane]][rotation];
+            batch->piece_i_lims[rotation][lane] = shape_get_i_lim(shape);
+            batch->piece_j_lims[rotation][lane] = shape_get_j_lim(shape);
+
+            for (int rel_j = 0; rel_j < TETRIS_SHAPE_J_LIM; ++rel_j) {
+                uint32_t bits = 0;
+                int bottom = -1;
+
+                for (int rel_i = 0; rel_i < TETRIS_SHAPE_I_LIM; ++rel_i) {
+
+                    if (shape_get_cell_not_hitbox_check(shape, rel_i, rel_j) != 0) {
+                        bits |= 1u << rel_i;
+                        bottom = rel_i;
+                    }
+                }
+
+                batch->piece_columns[rotation][rel_j][lane] = bits;
+                batch->piece_bottoms[rotation][rel_j][lane] = bottom;
+            }
+        }
+    }
+}
+
+
+int board_batch_place(board_batch_s *batch, int lane, operation_s operation, bool *deadline_touched)
+{
+    // 只动一个网格，逐列做与 board_batch__selection_keys 相同的位运算。调用前要确认放得下。
+    const int rotation = operation.rotation;
+    const int j_pos = operation.j_pos;
+    const int j_lim = batch->piece_j_lims[rotation][lane];
+    int i_pos = TETRIS_GRID_I_LIM - 1;
+
+    assert(j_pos + j_lim <= TETRIS_GRID_J_LIM);
+
+    for (int rel_j = 0; rel_j < j_lim; ++rel_j) {
+
+        if (batch->piece_columns[rotation][rel_j][lane] != 0) {
+            const int highest_i_pos = batch->column_tops[j_pos + rel_j][lane] - 1 - batch->piece_bottoms[rotation][rel_j][lane];
+            i_pos = highest_i_pos < i_pos ? highest_i_pos : i_pos;
+        }
+    }
+
+    assert(i_pos >= 0);
+
+    uint32_t full_rows = GRID_COLUMN_MASK;
+
+    for (int rel_j = 0; rel_j < j_lim; ++rel_j) {
+        const uint32_t piece_bits = batch->piece_columns[rotation][rel_j][lane] << i_pos;
+        assert((batch->columns[j_pos + rel_j][lane] & piece_bits) == 0);
+        batch->columns[j_pos + rel_j][lane] |= piece_bits;
+    }
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        full_rows &= batch->columns[j][lane];
+    }
+
+    const int lines_cleared = bits_count(full_rows);
+    uint32_t occupied = 0;
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        uint32_t bits = batch->columns[j][lane];
+
+        // 从上往下消：消掉一行只挪动它上面的行，下面的满行位置不变
+        for (uint32_t rows = full_rows; rows != 0; rows &= rows - 1) {
+            const uint32_t row = rows & (0u - rows);
+            bits = (bits & ~((row << 1) - 1)) | ((bits & (row - 1)) << 1);
+        }
+
+        batch->columns[j][lane] = bits;
+        batch->column_tops[j][lane] = bits == 0 ? TETRIS_GRID_I_LIM : bits_count_trailing_zeros(bits);
+        occupied |= bits;
+    }
+
+    // 与 grid_is_deadline_touched 相同
+    *deadline_touched = (occupied & (1u << TETRIS_DEADLINE_ROW)) != 0;
+    return lines_cleared;
+}
+
+
+void board_batch__selection_keys(const board_batch_s *batch, const evaluate_weights_s *weights, int rotation, int j_pos, int64_t keys[BATCH_LANES])
+{
+    // 与 game_state__calculate_evaluate_features 算的是同样的特征，只是全部改成按列的位运算。
+    // 下面每个 lane 循环都对所有网格做同样的运算，没有依赖数据的分支，编译器会把它们向量化；
+    // 放不下的网格也照样算（移位量取 0），最后再丢掉结果。
+    const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+    const int priority = operation_get_priority(&operation);
+    const int index = rotation * TETRIS_GRID_J_LIM + j_pos;
+
+    int32_t valid[BATCH_LANES];
+    int32_t i_pos[BATCH_LANES];
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        valid[lane] = j_pos + batch->piece_j_lims[rotation][lane] <= TETRIS_GRID_J_LIM;
+        i_pos[lane] = TETRIS_GRID_I_LIM - 1;
+    }
+
+    // 落点：方块每一列最低的格子要在网格这一列最高的砖格之上
+    for (int rel_j = 0; rel_j < TETRIS_SHAPE_J_LIM && j_pos + rel_j < TETRIS_GRID_J_LIM; ++rel_j) {
+
+        for (int lane = 0; lane < BATCH_LANES; ++lane) {
+            const int32_t highest_i_pos = batch->column_tops[j_pos + rel_j][lane] - 1 - batch->piece_bottoms[rotation][rel_j][lane];
+            const int32_t limit = batch->piece_columns[rotation][rel_j][lane] != 0 ? highest_i_pos : TETRIS_GRID_I_LIM - 1;
+            i_pos[lane] = limit < i_pos[lane] ? limit : i_pos[lane];
+        }
+    }
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        valid[lane] &= i_pos[lane] >= 0;
+        i_pos[lane] = valid[lane] ? i_pos[lane] : 0;
+    }
+
+    // 放方块，找满行
+    uint32_t columns[TETRIS_GRID_J_LIM][BATCH_LANES];
+    uint32_t full_rows[BATCH_LANES];
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        full_rows[lane] = GRID_COLUMN_MASK;
+    }
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        const int rel_j = j - j_pos;
+        const bool covered = 0 <= rel_j && rel_j < TETRIS_SHAPE_J_LIM;
+
+        for (int lane = 0; lane < BATCH_LANES; ++lane) {
+            const uint32_t piece_bits = covered ? batch->piece_columns[rotation][rel_j][lane] << i_pos[lane] : 0;
+            columns[j][lane] = batch->columns[j][lane] | piece_bits;
+            full_rows[lane] &= columns[j][lane];
+        }
+    }
+
+    // 侵蚀格数（与原来的写法一样，数的是方块外框里被消掉的格子）、着陆高度
+    int32_t eroded_cells[BATCH_LANES];
+    int32_t landing_height_x2[BATCH_LANES];
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        const int32_t i_lim = batch->piece_i_lims[rotation][lane];
+        const uint32_t piece_rows = ((1u << i_lim) - 1) << i_pos[lane];
+        eroded_cells[lane] = bits_count(full_rows[lane] & piece_rows) * batch->piece_j_lims[rotation][lane] * bits_count(full_rows[lane]);
+        landing_height_x2[lane] = 2 * TETRIS_GRID_I_LIM - (2 * i_pos[lane] + i_lim);
+    }
+
+    // 消行：一次最多消 4 行，每次去掉最上面的一行；没有满行了就原样不动
+    for (int k = 0; k < 4; ++k) {
+
+        for (int lane = 0; lane < BATCH_LANES; ++lane) {
+            const uint32_t row = full_rows[lane] & (0u - full_rows[lane]);
+            const uint32_t below = ~((row << 1) - 1);
+            const uint32_t above = row - 1;
+
+            for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+                const uint32_t cleared = (columns[j][lane] & below) | ((columns[j][lane] & above) << 1);
+                columns[j][lane] = row != 0 ? cleared : columns[j][lane];
+            }
+
+            full_rows[lane] &= full_rows[lane] - 1;
+        }
+    }
+
+    // 洞、列转变数、井、行转变数，墙都算作砖格
+    int32_t hole[BATCH_LANES];
+    int32_t col_transition[BATCH_LANES];
+    int32_t well[BATCH_LANES];
+    int32_t row_transition[BATCH_LANES];
+    uint32_t occupied[BATCH_LANES];
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        hole[lane] = 0;
+        col_transition[lane] = 0;
+        well[lane] = 0;
+        row_transition[lane] = bits_count(GRID_COLUMN_MASK ^ columns[TETRIS_GRID_J_LIM - 1][lane]);
+        occupied[lane] = 0;
+    }
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+
+        for (int lane = 0; lane < BATCH_LANES; ++lane) {
+            const uint32_t bits = columns[j][lane];
+            const uint32_t left = j > 0 ? columns[j - 1][lane] : GRID_COLUMN_MASK;
+            const uint32_t right = j < TETRIS_GRID_J_LIM - 1 ? columns[j + 1][lane] : GRID_COLUMN_MASK;
+            const uint32_t walled = 1u | (bits << 1) | (1u << (TETRIS_GRID_I_LIM + 1));
+
+            // 最高的砖格以下（含）的位是 bits | -bits
+            hole[lane] += bits_count(~bits & (bits | (0u - bits)) & GRID_COLUMN_MASK);
+            col_transition[lane] += bits_count((walled ^ (walled >> 1)) & ((1u << (TETRIS_GRID_I_LIM + 1)) - 1));
+            well[lane] += bits_count(~bits & left & right & GRID_COLUMN_MASK);
+            row_transition[lane] += bits_count(left ^ bits);
+            occupied[lane] |= bits;
+        }
+    }
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        // 危险程度：堆顶到 SURVIVAL_DANGER_ROW 之间的行数
+        const int32_t danger = bits_count((occupied[lane] | (0u - occupied[lane])) & ((1u << SURVIVAL_DANGER_ROW) - 1));
+
+        const int64_t score_x2 =
+            2 * weights->hole * hole[lane]
+            + 2 * weights->well * well[lane]
+            + 2 * weights->row_transition * row_transition[lane]
+            + 2 * weights->col_transition * col_transition[lane]
+            + weights->landing_height * landing_height_x2[lane]
+            + 2 * weights->eroded_cells * eroded_cells[lane]
+            + 2 * weights->danger * danger;
+
+        // 与 operation_make_selection_key 相同
+        const int64_t key = ((score_x2 * 1024 + priority) * 4 + (3 - rotation)) * 64 + index;
+        keys[lane] = valid[lane] ? key : OPERATION_INVALID_SELECTION_KEY;
+    }
+}
+
+
+void board_kernels__batch_selection_keys_baseline(const board_batch_s *batch, const evaluate_weights_s *weights, int rotation, int j_pos, int64_t keys[BATCH_LANES])
+{
+    board_batch__selection_keys(batch, weights, rotation, j_pos, keys);
+}
+
+
+#ifdef ISA_DISPATCH_X86
+
+// 同一份代码在 AVX2 下编译，一次处理 8 个 uint32。x86-64-v2 没有更宽的向量，和 baseline 共用。
+ISA_TARGET_V3 ISA_INLINE_CALLEES void board_kernels__batch_selection_keys_v3(const board_batch_s *batch, const evaluate_weights_s *weights, int rotation, int j_pos, int64_t keys[BATCH_LANES])
+{
+    board_batch__selection_keys(batch, weights, rotation, j_pos, keys);
+}
+
+#else
+
+void board_kernels__batch_selection_keys_v3(const board_batch_s *batch, const evaluate_weights_s *weights, int rotation, int j_pos, int64_t keys[BATCH_LANES])
+{
+    board_batch__selection_keys(batch, weights, rotation, j_pos, keys);
+}
+
+#endif /* ISA_DISPATCH_X86 */
+
+
+game_batch_s *game_batch_make(int randomizer, const uint64_t seeds[], int game_count, int max_pieces)
+{
+    game_batch_s *batch = malloc(sizeof *batch);
+    assert(batch != NULL);
+
+    batch->boards = board_batch_make_blank();
+    batch->randomizer = randomizer;
+    batch->seeds = seeds;
+    batch->game_count = game_count;
+    batch->max_pieces = max_pieces;
+    batch->next_game = 0;
+    batch->results = malloc((game_count > 0 ? game_count : 1) * sizeof(statistics_s));
+    assert(batch->results != NULL);
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        game_batch__start_next_game(batch, lane);
+    }
+
+    return batch;
+}
+
+
+void game_batch_free(game_batch_s *batch)
+{
+    free(batch->results);
+    free(batch);
+}
+
+
+void game_batch_run(game_batch_s *batch)
+{
+    while (game_batch_step(batch)) {
+    }
+}
+
+
+bool game_batch_step(game_batch_s *batch)
+{
+    const evaluate_weights_s weights = evaluate_weights_make_default();
+    bool any_active = false;
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        any_active |= batch->lane_games[lane] != -1;
+    }
+
+    if (!any_active) {
+        return false;
+    }
+
+    // 空闲的通道当作没有方块，照样参与计算，结果不用
+    char falling_tetrises[BATCH_LANES];
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        falling_tetrises[lane] = batch->lane_games[lane] != -1 ? batch->lane_falling_tetrises[lane] : 0;
+    }
+
+    board_batch_load_pieces(&batch->boards, falling_tetrises);
+
+    // 与 game_state__calculate_best_move_with_weights 一样，对所有摆法的选择键取最大值
+    int64_t best_keys[BATCH_LANES];
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        best_keys[lane] = OPERATION_INVALID_SELECTION_KEY;
+    }
+
+    for (int rotation = 0; rotation < TETRIS_MAX_ANGLE; ++rotation) {
+
+        for (int j_pos = 0; j_pos < TETRIS_GRID_J_LIM; ++j_pos) {
+            int64_t keys[BATCH_LANES];
+            board_kernels->batch_selection_keys(&batch->boards, &weights, rotation, j_pos, keys);
+
+            for (int lane = 0; lane < BATCH_LANES; ++lane) {
+                best_keys[lane] = keys[lane] > best_keys[lane] ? keys[lane] : best_keys[lane];
+            }
+        }
+    }
+
+    for (int lane = 0; lane < BATCH_LANES; ++lane) {
+        const int game = batch->lane_games[lane];
+
+        if (game == -1) {
+            continue;
+        }
+
+        statistics_s *statistics = &batch->lane_statistics[lane];
+        bool game_over = best_keys[lane] == OPERATION_INVALID_SELECTION_KEY;
+
+        if (!game_over) {
+            bool deadline_touched = false;
+            const int lines_cleared = board_batch_place(&batch->boards, lane, operation_from_selection_key(best_keys[lane]), &deadline_touched);
+
+            statistics->placed_blocks++;
+
+            if (lines_cleared > 0) {
+                statistics->score += scores_of_line_cleared[lines_cleared];
+                statistics->lines_cleared[lines_cleared]++;
+                statistics->total_lines_cleared += lines_cleared;
+            }
+
+            batch->lane_falling_tetrises[lane] = batch->lane_next_tetrises[lane];
+            batch->lane_next_tetrises[lane] = piece_generator_next(&batch->lane_generators[lane]);
+            game_over = deadline_touched || statistics->placed_blocks >= batch->max_pieces;
+        }
+
+        if (game_over) {
+            batch->results[game] = *statistics;
+            game_batch__start_next_game(batch, lane);
+        }
+    }
+
+    return true;
+}
+
+
+void game_batch__start_next_game(game_batch_s *batch, int lane)
+{
+    batch->lane_games[lane] = -1;
+
+    // 一个方块也不让放的局不占通道，直接记下结果
+    while (batch->next_game < batch->game_count) {
+        const int game = batch->next_game++;
+
+        if (batch->max_pieces <= 0) {
+            batch->results[game] = statistics_make_blank();
+            continue;
+        }
+
+        batch->lane_games[lane] = game;
+        batch->lane_generators[lane] = piece_generator_make(batch->randomizer, batch->seeds[game]);
+        batch->lane_falling_tetrises[lane] = piece_generator_next(&batch->lane_generators[lane]);
+        batch->lane_next_tetrises[lane] = piece_generator_next(&batch->lane_generators[lane]);
+        batch->lane_statistics[lane] = statistics_make_blank();
+        board_batch_clear_lane(&batch->boards, lane);
+        return;
+    }
+}
+
+
+statistics_s self_test__reference_play_game(int randomizer, uint64_t seed, int max_pieces)
+{
+    // 原来 tetris_play_games 里逐局玩的写法
+    piece_generator_s generator = piece_generator_make(randomizer, seed);
+    const char first = piece_generator_next(&generator);
+    const char second = piece_generator_next(&generator);
+    game_state_s game = game_state_make(grid_make_blank(), first, second, false, statistics_make_blank());
+
+    for (int piece = 0; piece < max_pieces && game_state_has_valid_move(&game); ++piece) {
+        const operation_s operation = game_state_make_decision(&game);
+        game = game_state_the_next_state_with_no_next_tetris(&game, operation);
+
+        if (game_state_is_deadline_touched(&game)) {
+            break;
+        }
+
+        game = game_state_with_next_tetris_filled_in(&game, piece_generator_next(&generator));
+    }
+
+    return game.statistics;
+}
+
+
+void self_test__check_game_batch(self_test_s *test)
+{
+    // 局数不是 BATCH_LANES 的倍数、每局长短不一，通道会在不同的时候换局。机器支持的每一级内核都查一遍。
+    uint64_t seeds[3 * BATCH_LANES + 3];
+    const int game_count = (int) (sizeof seeds / sizeof seeds[0]);
+    const board_kernels_s *selected_kernels = board_kernels;
+
+    for (int k = 0; k < game_count; ++k) {
+        seeds[k] = piece_generator__hash(SELF_TEST_SEED, k);
+    }
+
+    for (int level = 0; level <= board_kernels_detect_level(); ++level) {
+        board_kernels = &board_kernels_table[level];
+
+        for (int randomizer = PIECE_RANDOMIZER_UNIFORM; randomizer <= PIECE_RANDOMIZER_HISTORY; ++randomizer) {
+            const int max_pieces = 50 + 450 * randomizer;
+            game_batch_s *batch = game_batch_make(randomizer, seeds, game_count, max_pieces);
+            game_batch_run(batch);
+
+            for (int k = 0; k < game_count; ++k) {
+                const statistics_s expected = self_test__reference_play_game(randomizer, seeds[k], max_pieces);
+                self_test_check(test, memcmp(&batch->results[k], &expected, sizeof expected) == 0, "game batch", k);
+            }
+
+            game_batch_free(batch);
+        }
+    }
+
+    board_kernels = selected_kernels;
+}
+
+
+grid_feature_cache_s grid_feature_cache_make(const grid_s *grid)
+{
+    grid_feature_cache_s cache = {
+        .column_total   = {.hole = 0, .col_transition = 0},
+        .well           = 0,
+        .row_transition = 0,
+        .top_row        = grid_get_top_occupied_row(grid),
+    };
+
+    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+        cache.row_bits[i] = grid_get_row_bits(grid, i);
+        cache.well += row_features_table[cache.row_bits[i]].well;
+        cache.row_transition += row_features_table[cache.row_bits[i]].row_transition;
+    }
+
+    for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+        cache.columns[j] = grid_feature_cache__column_features_of(grid_get_column_bits(grid, j));
+        cache.column_total.hole += cache.columns[j].hole;
+        cache.column_total.col_transition += cache.columns[j].col_transition;
+    }
+
+    return cache;
+}
+
+
+column_features_s grid_feature_cache__column_features_of(uint32_t bits)
+{
+    // 最高的砖格及以下的位是 bits | -bits；上下的墙都算作砖格
+    const uint32_t walled = 1u | (bits << 1) | (1u << (TETRIS_GRID_I_LIM + 1));
+
+    return (column_features_s) {
+        .hole           = bits_count(~bits & (bits | (0u - bits)) & GRID_COLUMN_MASK),
+        .col_transition = bits_count((walled ^ (walled >> 1)) & ((1u << (TETRIS_GRID_I_LIM + 1)) - 1)),
+    };
+}
+
+
+bool game_state_can_hold(const game_state_s *game_state)
+{
+    const char swapped_in = game_state->hold_tetris == HOLD_EMPTY ? game_state->next_tetris : game_state->hold_tetris;
+    return tetris_is_known(game_state->falling_tetris) && tetris_is_known(swapped_in) && swapped_in != game_state->falling_tetris;
+}
+
+
+operation_s game_state_make_decision_with_hold(const game_state_s *game_state)
+{
+    // 两个分支都是一层贪心，网格相同，只是落下的方块不同，所以网格本身的特征只算一次。
+    // 选择键相同时取不暂存的。
+    const grid_feature_cache_s cache = grid_feature_cache_make(&game_state->grid);
+    const evaluate_weights_s weights = evaluate_weights_make_default();
+
+    int64_t best_key = game_state__calculate_best_selection_key_cached(game_state, &cache, &weights);
+    bool hold = false;
+
+    if (game_state_can_hold(game_state)) {
+        const game_state_s swapped = game_state__with_hold_swapped(game_state);
+        const int64_t hold_key = game_state__calculate_best_selection_key_cached(&swapped, &cache, &weights);
+
+        if (hold_key > best_key) {
+            best_key = hold_key;
+            hold = true;
+        }
+    }
+
+    assert(best_key != OPERATION_INVALID_SELECTION_KEY);
+    operation_s operation = operation_from_selection_key(best_key);
+    operation.hold = hold;
+    return operation;
+}
+
+
+game_state_s game_state__with_hold_swapped(const game_state_s *game_state)
+{
+    assert(game_state_can_hold(game_state));
+    game_state_s return_value = *game_state;
+    return_value.hold_tetris = game_state->falling_tetris;
+
+    if (game_state->hold_tetris == HOLD_EMPTY) {
+        // 放下的是下一个方块，再下一个还不知道；放完以后下落的方块是 '?'，要先填它
+        return_value.falling_tetris = game_state->next_tetris;
+        return_value.next_tetris = '?';
+    } else {
+        return_value.falling_tetris = game_state->hold_tetris;
+    }
+
+    return return_value;
+}
+
 
-        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+int64_t game_state__calculate_best_selection_key_cached(const game_state_s *game_state, const grid_feature_cache_s *cache, const evaluate_weights_s *weights)
+{
+    // 与 game_state__calculate_best_move_with_weights 相同，只是特征用 cache 算
+    int64_t best_key = OPERATION_INVALID_SELECTION_KEY;
 
-            if (new_grid_with_full_rows_cleared.content[i][j] == 1) {
-                continue;
-            }
-            bool any_value = false;
+    for (int rotation = 0; rotation < TETRIS_MAX_ANGLE; ++rotation) {
 
-            for (int i_scan = 0; i_scan < i; ++i_scan) {
+        for (int j_pos = 0; j_pos < TETRIS_GRID_J_LIM; ++j_pos) {
+            const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+            const int i_pos = game_state__calculate_i_pos(game_state, operation);
 
-                if (new_grid_with_full_rows_cleared.content[i_scan][j] == 1) {
-                    any_value = true;
-                    break;
-                }
+            if (i_pos == -1) {
+                continue;
             }
 
-            if (any_value) {
-                ++hole;
-            }
+            const evaluate_features_s features = game_state__calculate_evaluate_features_cached(game_state, cache, rotation, j_pos, i_pos);
+            const int64_t key = operation_make_selection_key(&operation, evaluate_weights_apply_x2(weights, &features));
+            best_key = key > best_key ? key : best_key;
         }
     }
-#ifdef DEBUGGING_THE_EVALUATOR
-    printf("hole: %d\n", hole);
-#endif
 
-    // 井
-    int well = 0;
-    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+    return best_key;
+}
 
-        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
 
-            if (new_grid_with_full_rows_cleared.content[i][j] == 1) {
-                continue;
-            }
+evaluate_features_s game_state__calculate_evaluate_features_cached(const game_state_s *game_state, const grid_feature_cache_s *cache, int rotation, int j_pos, int i_pos)
+{
+    const shape_s shape = tetris_shapes[(unsigned char) game_state->falling_tetris][rotation];
+    const int i_lim = shape_get_i_lim(&shape);
+    const int j_lim = shape_get_j_lim(&shape);
 
-            if (grid_get_with_default(&new_grid_with_full_rows_cleared, i, j-1, 1) == 1
-                && grid_get_with_default(&new_grid_with_full_rows_cleared, i, j+1, 1) == 1)
-            {
-                ++well;
-            }
-        }
-    }
-#ifdef DEBUGGING_THE_EVALUATOR
-    printf("well: %d\n", well);
-#endif
+    // 方块占到的几行放下以后的样子。有满行的话整个网格都要往下挪，按原来的办法算。
+    uint16_t placed_rows[TETRIS_SHAPE_I_LIM];
+    int piece_top_row = TETRIS_GRID_I_LIM;
 
-    // 行转变数
-    int row_transition = 0;
+    for (int rel_i = 0; rel_i < i_lim; ++rel_i) {
+        uint16_t piece_bits = 0;
 
-    for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+        for (int rel_j = 0; rel_j < j_lim; ++rel_j) {
+            piece_bits |= (uint16_t) (shape_get_cell_hitbox_check(&shape, rel_i, rel_j) << rel_j);
+        }
 
-        for (int j = -1; j < TETRIS_GRID_J_LIM; ++j) {
+        placed_rows[rel_i] = cache->row_bits[i_pos + rel_i] | (uint16_t) (piece_bits << j_pos);
 
-            if (grid_get_with_default(&new_grid_with_full_rows_cleared, i, j, 1) != grid_get_with_default(&new_grid_with_full_rows_cleared, i, j+1, 1)) {
-                ++row_transition;
-            }
+        if (placed_rows[rel_i] == (1u << TETRIS_GRID_J_LIM) - 1) {
+            return game_state__calculate_evaluate_features(game_state, rotation, j_pos, i_pos);
+        }
+
+        if (piece_bits != 0 && i_pos + rel_i < piece_top_row) {
+            piece_top_row = i_pos + rel_i;
         }
     }
-#ifdef DEBUGGING_THE_EVALUATOR
-    printf("row_transition: %d\n", row_transition);
-#endif
 
-    // 列转变数
-    int col_transition = 0;
+    // 井、行转变数：换掉方块占到的几行
+    int well = cache->well;
+    int row_transition = cache->row_transition;
 
-    for (int i = -1; i < TETRIS_GRID_I_LIM; ++i) {
+    for (int rel_i = 0; rel_i < i_lim; ++rel_i) {
+        const row_features_s *before = &row_features_table[cache->row_bits[i_pos + rel_i]];
+        const row_features_s *after = &row_features_table[placed_rows[rel_i]];
+        well += after->well - before->well;
+        row_transition += after->row_transition - before->row_transition;
+    }
 
-        for (int j = 0; j < TETRIS_GRID_J_LIM; ++j) {
+    // 洞、列转变数：换掉方块占到的几列
+    column_features_s columns = cache->column_total;
 
-            if (grid_get_with_default(&new_grid_with_full_rows_cleared, i, j, 1) != grid_get_with_default(&new_grid_with_full_rows_cleared, i+1, j, 1)) {
-                ++col_transition;
-            }
+    for (int rel_j = 0; rel_j < j_lim; ++rel_j) {
+        uint32_t piece_bits = 0;
+
+        for (int rel_i = 0; rel_i < i_lim; ++rel_i) {
+            piece_bits |= (uint32_t) shape_get_cell_hitbox_check(&shape, rel_i, rel_j) << rel_i;
         }
+
+        const column_features_s *before = &cache->columns[j_pos + rel_j];
+        const column_features_s after = grid_feature_cache__column_features_of(grid_get_column_bits(&game_state->grid, j_pos + rel_j) | (piece_bits << i_pos));
+        columns.hole += after.hole - before->hole;
+        columns.col_transition += after.col_transition - before->col_transition;
     }
-#ifdef DEBUGGING_THE_EVALUATOR
-    printf("col_transition: %d\n", col_transition);
-#endif
 
+    // 没有消行，侵蚀格数为 0；堆顶是原来的堆顶和方块顶上取高的
+    const int top_row = piece_top_row < cache->top_row ? piece_top_row : cache->top_row;
+
+    return (evaluate_features_s) {
+        .hole              = columns.hole,
+        .well              = well,
+        .row_transition    = row_transition,
+        .col_transition    = columns.col_transition,
+        .landing_height_x2 = 2 * 20 - (2 * i_pos + i_lim),
+        .eroded_cells      = 0,
+        .danger            = top_row < SURVIVAL_DANGER_ROW ? SURVIVAL_DANGER_ROW - top_row : 0,
+    };
+}
 
-    // 着陆高度
-    double landing_height = 20 - (i_pos + shape_get_i_lim(&shape) / 2.0);
 
-#ifdef DEBUGGING_THE_EVALUATOR
-    printf("landing_height: %lf\n", landing_height);
-#endif
+checkpoint_s checkpoint_make(const game_state_s *game_state, long long steps)
+{
+    checkpoint_s return_value;
+    memset(&return_value, 0, sizeof return_value);  // 连同填充字节一起清零，写出的文件只由内容决定
 
-    // 侵蚀格数
-    int eroded_cells = 0;
+    return_value.magic = CHECKPOINT_MAGIC;
+    return_value.size = sizeof return_value;
+    return_value.steps = steps;
+    return_value.game = packed_game_state_make(game_state);
+    return return_value;
+}
 
-    for (int rel_i = 0; rel_i < shape_get_i_lim(&shape); ++rel_i) {
 
-        for (int rel_j = 0; rel_j < shape_get_j_lim(&shape); ++rel_j) {
-            const int abs_i = i_pos + rel_i;
+bool checkpoint_load(checkpoint_s *checkpoint, const char *file_name, telemetry_s *telemetry)
+{
+    FILE *file = fopen(file_name, "rb");
 
-            if (full_rows_index_container_contains(&container, abs_i)) {
-                ++eroded_cells;
-            }
+    if (file == NULL) {
+        return false;
+    }
+
+    if (fread(checkpoint, sizeof *checkpoint, 1, file) != 1 || checkpoint->magic != CHECKPOINT_MAGIC || checkpoint->size != sizeof *checkpoint) {
+        fclose(file);
+        return false;
+    }
+
+    if (telemetry != NULL) {
+
+        // 总表装不下（SELF_PLAY_GAMES 改小了）或者文件不完整，都当作不匹配
+        if (checkpoint->telemetry_game_count > (uint32_t) telemetry->game_capacity
+            || fread(telemetry->games, sizeof telemetry->games[0], checkpoint->telemetry_game_count, file) != checkpoint->telemetry_game_count)
+        {
+            fclose(file);
+            return false;
+        }
+
+        telemetry->game_count = (LONG) checkpoint->telemetry_game_count;
+
+        for (int k = 0; k < TELEMETRY_LATENCY_BUCKETS; ++k) {
+            telemetry->latency_buckets[k] = checkpoint->latency_buckets[k];
         }
     }
-    eroded_cells *= container.size;
-#ifdef DEBUGGING_THE_EVALUATOR
-    printf("eroded_cells: %d\n", eroded_cells);
-#endif
 
-    const double res =
-        HOLE_WEIGHT * hole
-        + WELL_WEIGHT * well
-        + ROW_TRANSITION_WEIGHT * row_transition
-        + COL_TRANSITION_WEIGHT * col_transition
-        + LANDING_HEIGHT_WEIGHT * landing_height
-        + ERODED_CELLS_WEIGHT * eroded_cells;
+    fclose(file);
+    return true;
+}
 
-#ifdef DEBUGGING_THE_EVALUATOR
-    printf("result of the evaluator: %lf\n", res);
-#endif
 
-    return res;
+void checkpoint_write_to(const checkpoint_s *checkpoint, const telemetry_game_s games[], const char *file_name)
+{
+    char temporary_file_name[FILENAME_MAX];
+    snprintf(temporary_file_name, sizeof temporary_file_name, "%s.tmp", file_name);
+
+    FILE *file = fopen(temporary_file_name, "wb");
+    assert(file != NULL);
+
+    fwrite(checkpoint, sizeof *checkpoint, 1, file);
+    fwrite(games, sizeof games[0], checkpoint->telemetry_game_count, file);
+    fflush(file);
+
+    // 内容真正写到盘上以后才改名，断电时不会留下只写了一半的检查点
+    FlushFileBuffers((HANDLE) _get_osfhandle(_fileno(file)));
+    fclose(file);
+
+    const BOOL moved = MoveFileExA(temporary_file_name, file_name, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    assert(moved);
+    (void) moved;
 }
 
 
-void game_state_draw_the_falling_tetris(const game_state_s *game_state)
+checkpoint_writer_s *checkpoint_writer_open(LONG game_capacity)
 {
-    const shape_s shape = tetris_shapes[(unsigned char) game_state->falling_tetris][0];
-    printf("       falling tetris\n");
-    printf("       +------------+\n");
-    printf("       |            |\n");
+    checkpoint_writer_s *writer = malloc(sizeof *writer);
+    assert(writer != NULL);
 
-    for (int i = 0; i < TETRIS_SHAPE_I_LIM; ++i) {
+    writer->pending_games = malloc((size_t) game_capacity * sizeof writer->pending_games[0]);
+    writer->writing_games = malloc((size_t) game_capacity * sizeof writer->writing_games[0]);
+    assert(game_capacity == 0 || (writer->pending_games != NULL && writer->writing_games != NULL));
 
-        if (i < shape_get_i_lim(&shape)) {
-            // 打印一行
-            printf("       |  ");
+    writer->game_capacity = game_capacity;
+    writer->has_pending   = false;
+    writer->stopping      = false;
 
-            for (int j = 0; j < TETRIS_SHAPE_J_LIM; ++j) {
-                printf("%s", shape_get_cell_not_hitbox_check(&shape, i, j) == 1 ? "[]" : "  ");
-            }
-            printf("  |\n");
+    InitializeCriticalSection(&writer->lock);
+    InitializeConditionVariable(&writer->pending_changed);
+    writer->writer_thread = CreateThread(NULL, 0, checkpoint_writer__thread_main, writer, 0, NULL);
+    assert(writer->writer_thread != NULL);
 
-        } else {
-            // 打印空行
-            printf("       |            |\n");
+    return writer;
+}
+
+
+void checkpoint_writer_close(checkpoint_writer_s *writer)
+{
+    EnterCriticalSection(&writer->lock);
+    writer->stopping = true;
+    WakeAllConditionVariable(&writer->pending_changed);
+    LeaveCriticalSection(&writer->lock);
+
+    WaitForSingleObject(writer->writer_thread, INFINITE);
+    CloseHandle(writer->writer_thread);
+    DeleteCriticalSection(&writer->lock);
+
+    free(writer->pending_games);
+    free(writer->writing_games);
+    free(writer);
+}
+
+
+void checkpoint_writer_submit(checkpoint_writer_s *writer, const checkpoint_s *checkpoint, const telemetry_s *telemetry)
+{
+    EnterCriticalSection(&writer->lock);
+
+    // 写线程还没取走上一份的话直接覆盖，不等
+    writer->pending = *checkpoint;
+
+    if (telemetry != NULL) {
+        const LONG game_count = telemetry__recorded_game_count(telemetry);
+        assert(game_count <= writer->game_capacity);
+        memcpy(writer->pending_games, telemetry->games, (size_t) game_count * sizeof telemetry->games[0]);
+        writer->pending.telemetry_game_count = (uint32_t) game_count;
+
+        for (int k = 0; k < TELEMETRY_LATENCY_BUCKETS; ++k) {
+            writer->pending.latency_buckets[k] = telemetry->latency_buckets[k];
         }
     }
 
-    printf("       |            |\n");
-    printf("       +------------+\n");
+    writer->has_pending = true;
+    WakeAllConditionVariable(&writer->pending_changed);
+    LeaveCriticalSection(&writer->lock);
 }
 
 
-void game_state_static_test_evaluator(void)
+DWORD WINAPI checkpoint_writer__thread_main(LPVOID parameter)
 {
-    /*
-    const game_state_s game = {
-        .grid = {
-            .content = {
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {1, 0, 0, 0, 0, 0, 0, 0, 1, 0},
-                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
-                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
-            },
-        },
-        .falling_tetris   = 'I',
-        .next_tetris      = 'Z',
-        .deadline_touched = false,
-        .statistics       = {
-            .placed_blocks       = 5,
-            .score               = 0,
-            .total_lines_cleared = 0,
-            .lines_cleared       = {0, 0, 0, 0, 0},
-        },
-    };
-    */
+    checkpoint_writer_s *writer = parameter;
 
-    // 造环境然后测试
+    EnterCriticalSection(&writer->lock);
 
-    const game_state_s game = {
-        .grid = {
-            .content = {
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
-                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
-                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
-                {1, 1, 1, 1, 1, 1, 1, 1, 1, 0},
-            },
-        },
-        .falling_tetris   = 'I',
-        .next_tetris      = 'J',
-        .deadline_touched = false,
-        .statistics       = {
-            .placed_blocks       = 233,
-            .score               = 0,
-            .total_lines_cleared = 0,
-            .lines_cleared       = {0, 0, 0, 0, 0},
-        },
-    };
+    while (true) {
 
-    const int j_pos = 0;
-    const int i_pos = 16;
-    const int rotation = 1;
+        while (!writer->has_pending && !writer->stopping) {
+            SleepConditionVariableCS(&writer->pending_changed, &writer->lock, INFINITE);
+        }
 
-    game_state__calculate_evaluate_score(&game, rotation, j_pos, i_pos);
+        // 停下之前最后一份也要写完
+        if (!writer->has_pending) {
+            break;
+        }
 
-    grid_s grid = game.grid;
-    grid = grid_with_a_tetris_placed(&grid, game.falling_tetris, rotation, j_pos, i_pos);
-    grid_print_out(&grid);
+        writer->writing = writer->pending;
+        memcpy(writer->writing_games, writer->pending_games, writer->pending.telemetry_game_count * sizeof writer->pending_games[0]);
+        writer->has_pending = false;
+        LeaveCriticalSection(&writer->lock);
 
-    return;
+        checkpoint_write_to(&writer->writing, writer->writing_games, CHECKPOINT_FILE_NAME);
+
+        EnterCriticalSection(&writer->lock);
+    }
+
+    LeaveCriticalSection(&writer->lock);
+    return 0;
 }
 
 
-full_rows_index_container_s full_rows_index_container_make_blank()
+
+operation_s game_state_make_decision_at_level(const game_state_s *game_state, int level)
 {
-    return (full_rows_index_container_s) { .indices = {0, 0, 0, 0}, .size = 0 };
+    assert(0 <= level && level < ENGINE_LEVEL_COUNT);
+
+    if (level < ENGINE_LEVEL_GREEDY) {
+        return game_state__calculate_best_move_partial(game_state, level == ENGINE_LEVEL_ROW_FEATURES);
+    }
+
+    // 结果与 game_state_make_decision 相同，特征用 grid_feature_cache_s 增量地算，快一些
+    if (level == ENGINE_LEVEL_GREEDY) {
+        const grid_feature_cache_s cache = grid_feature_cache_make(&game_state->grid);
+        const evaluate_weights_s weights = evaluate_weights_make_default();
+        const int64_t best_key = game_state__calculate_best_selection_key_cached(game_state, &cache, &weights);
+        assert(best_key != OPERATION_INVALID_SELECTION_KEY);
+        return operation_from_selection_key(best_key);
+    }
+
+    // 贪心是第 1 层，往上每级多一层
+    anytime_report_s report;
+    return game_state__make_decision_searching(game_state, deadline_make_never(), level - ENGINE_LEVEL_GREEDY + 1, &report);
 }
 
 
-full_rows_index_container_s full_rows_index_container_with_a_row_index_appended(const full_rows_index_container_s *container, int index)
+operation_s game_state__calculate_best_move_partial(const game_state_s *game_state, bool with_row_features)
 {
-    assert(0 <= index && index < TETRIS_GRID_I_LIM);
-    assert(0 <= container->size && container->size <= 3);
+    // 与 game_state__calculate_best_move_with_weights 相同，只是评价值只由算了的几项特征组成
+    const grid_feature_cache_s cache = grid_feature_cache_make(&game_state->grid);
+    const evaluate_weights_s weights = evaluate_weights_make_default();
+    int64_t best_key = OPERATION_INVALID_SELECTION_KEY;
 
-    full_rows_index_container_s new_container = *container;
+    for (int rotation = 0; rotation < TETRIS_MAX_ANGLE; ++rotation) {
 
-    new_container.indices[new_container.size++] = index;
+        for (int j_pos = 0; j_pos < TETRIS_GRID_J_LIM; ++j_pos) {
+            const operation_s operation = {.rotation = rotation, .j_pos = j_pos};
+            const int i_pos = game_state__calculate_i_pos(game_state, operation);
 
-    return new_container;
+            if (i_pos == -1) {
+                continue;
+            }
+
+            const evaluate_features_s features = game_state__calculate_evaluate_features_partial(game_state, &cache, rotation, j_pos, i_pos, with_row_features);
+            const int64_t key = operation_make_selection_key(&operation, evaluate_weights_apply_x2(&weights, &features));
+            best_key = key > best_key ? key : best_key;
+        }
+    }
+
+    assert(best_key != OPERATION_INVALID_SELECTION_KEY);
+    return operation_from_selection_key(best_key);
 }
 
 
-bool full_rows_index_container_contains(const full_rows_index_container_s *container, int index)
+evaluate_features_s game_state__calculate_evaluate_features_partial(const game_state_s *game_state, const grid_feature_cache_s *cache, int rotation, int j_pos, int i_pos, bool with_row_features)
 {
-    for (int i = 0; i < container->size; ++i) {
+    // 算了的几项与 game_state__calculate_evaluate_features 相同，没算的记 0。洞和列转变数两级都不算。
+    // 和 game_state__calculate_evaluate_features_cached 一样只看方块占到的几行：满行只可能出现在这几行里，
+    // 侵蚀格数直接数出来；井和行转变数没有满行时增量更新，有满行时才做出消行后的网格重算。
+    const shape_s shape = tetris_shapes[(unsigned char) game_state->falling_tetris][rotation];
+    const int i_lim = shape_get_i_lim(&shape);
+    const int j_lim = shape_get_j_lim(&shape);
 
-        if (container->indices[i] == index) {
-            return true;
+    uint16_t placed_rows[TETRIS_SHAPE_I_LIM];
+    int full_rows = 0;
+
+    for (int rel_i = 0; rel_i < i_lim; ++rel_i) {
+        uint16_t piece_bits = 0;
+
+        for (int rel_j = 0; rel_j < j_lim; ++rel_j) {
+            piece_bits |= (uint16_t) (shape_get_cell_hitbox_check(&shape, rel_i, rel_j) << rel_j);
         }
+
+        placed_rows[rel_i] = cache->row_bits[i_pos + rel_i] | (uint16_t) (piece_bits << j_pos);
+        full_rows += placed_rows[rel_i] == (1u << TETRIS_GRID_J_LIM) - 1;
     }
 
-    return false;
+    int well = 0;
+    int row_transition = 0;
+
+    if (with_row_features && full_rows == 0) {
+        well = cache->well;
+        row_transition = cache->row_transition;
+
+        for (int rel_i = 0; rel_i < i_lim; ++rel_i) {
+            const row_features_s *before = &row_features_table[cache->row_bits[i_pos + rel_i]];
+            const row_features_s *after = &row_features_table[placed_rows[rel_i]];
+            well += after->well - before->well;
+            row_transition += after->row_transition - before->row_transition;
+        }
+    } else if (with_row_features) {
+        const grid_s new_grid = grid_with_a_tetris_placed(&game_state->grid, game_state->falling_tetris, rotation, j_pos, i_pos);
+        const full_rows_index_container_s container = grid_all_full_rows(&new_grid);
+        const grid_s new_grid_with_full_rows_cleared = grid_with_full_rows_cleared(&new_grid, &container);
+
+        for (int i = 0; i < TETRIS_GRID_I_LIM; ++i) {
+            const row_features_s *row_features = &row_features_table[grid_get_row_bits(&new_grid_with_full_rows_cleared, i)];
+            well += row_features->well;
+            row_transition += row_features->row_transition;
+        }
+    }
+
+    return (evaluate_features_s) {
+        .hole              = 0,
+        .well              = well,
+        .row_transition    = row_transition,
+        .col_transition    = 0,
+        .landing_height_x2 = 2 * 20 - (2 * i_pos + i_lim),
+        .eroded_cells      = full_rows * j_lim * full_rows,  // 与原来的算法相同：满行数 × 方块宽度 × 满行数
+        .danger            = 0,
+    };
 }